@@ -0,0 +1,336 @@
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cpu.c"
+#include "machine.c"
+#include "dma.c"
+#include "sched.c"
+
+/*
+   irx batch runner
+   Runs many short checksum jobs through the scheduler with 1, 2, 4...
+   workers and reports aggregate guest instructions per second.
+
+   Every job starts parked on WAIT. A feeder thread then copies each job
+   its input and raises an interrupt, the way a device would, and the job
+   sums its input bytes into A and halts. Jobs use the input files named
+   on the command line in turn, or generated data.
+
+   With -d the input comes through a DMA channel instead: each job starts
+   a DMA_IN of its whole input and waits for it, while the feeder makes
+   it ready a chunk at a time. Chunks then land as cpu service requests
+   on jobs that may be running, parked or on their way to parking.
+
+   usage: batch [-d] [-n jobs] [-s input size] [-w max workers] [-c core] [file...]
+   */
+
+#define BATCH_INPUT 0x1000 // input bytes
+#define BATCH_LENGTH 0x0F00 // little-endian input length
+#define BATCH_INPUT_MAX (0xFF00 - BATCH_INPUT) // clear of the stack
+#define BATCH_PROLOGUE 0x0040 // DMA start-up code, see BATCH_dmaPrologue
+#define BATCH_DMA_PORT 1 // ports 1 to 5
+#define BATCH_CHUNK 256 // bytes the feeder makes ready at a time
+
+const uint8_t BATCH_program[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(EXT, WAIT),                   // 0x04 until the input is in
+  OP(LOAD_I, 4), BATCH_LENGTH & 0xFF, BATCH_LENGTH >> 8, // 0x05 GH = length
+  OP(LOAD_I, 5), (BATCH_LENGTH + 1) & 0xFF, (BATCH_LENGTH + 1) >> 8,
+  OP(SET, 2), BATCH_INPUT & 0xFF,  // 0x0B CD = input
+  OP(SET, 3), BATCH_INPUT >> 8,
+  OP(SET, 6), 0x00,                // 0x0F E = sum
+  // loop: done once GH is 0
+  OP(COPY_IN, 4),                  // 0x11
+  OP(OR, 5),
+  OP(BRCH, 2), 0x33, 0x00,
+  // GH--
+  OP(COPY_IN, 4),                  // 0x16
+  OP(OR, 0),
+  OP(BRCH, 3), 0x1E, 0x00,
+  OP(COPY_IN, 5),
+  OP(DEC, 0),
+  OP(COPY_OUT, 5),
+  OP(COPY_IN, 4),                  // 0x1E
+  OP(DEC, 0),
+  OP(COPY_OUT, 4),
+  // E += [CD]
+  OP(LOAD_R, 1), 0x01,             // 0x21
+  OP(COPY_IN, 6),
+  OP(CLF, 0),
+  OP(ADD, 1),
+  OP(COPY_OUT, 6),
+  // CD++
+  OP(COPY_IN, 2),                  // 0x27
+  OP(INC, 0),
+  OP(COPY_OUT, 2),
+  OP(BRCH, 3), 0x11, 0x00,
+  OP(COPY_IN, 3),                  // 0x2D
+  OP(INC, 0),
+  OP(COPY_OUT, 3),
+  OP(JMP, 3), 0x11, 0x00,
+  // done: A = sum
+  OP(COPY_IN, 6),                  // 0x33
+  OP(SYS, HALT),
+};
+
+#define BATCH_PORT(port, value) OP(SET, 6), port, OP(SET, 0), value, OP(SYS, DATA_OUT)
+
+// Loaded at BATCH_PROLOGUE for -d: DMA_IN the input, then sum it with
+// BATCH_program from past its WAIT.
+const uint8_t BATCH_dmaPrologue[] = {
+  BATCH_PORT(BATCH_DMA_PORT, BATCH_INPUT & 0xFF),     // 0x40 address
+  BATCH_PORT(BATCH_DMA_PORT + 1, BATCH_INPUT >> 8),
+  OP(LOAD_I, 0), BATCH_LENGTH & 0xFF, BATCH_LENGTH >> 8, // 0x4A length
+  OP(SET, 6), BATCH_DMA_PORT + 2,
+  OP(SYS, DATA_OUT),
+  OP(LOAD_I, 0), (BATCH_LENGTH + 1) & 0xFF, (BATCH_LENGTH + 1) >> 8,
+  OP(SET, 6), BATCH_DMA_PORT + 3,
+  OP(SYS, DATA_OUT),
+  BATCH_PORT(BATCH_DMA_PORT + 4, DMA_IN),             // 0x56
+  OP(SYS, CLEAR_INT),              // 0x5B until it is done
+  OP(SYS, DATA_IN),
+  OP(DEC, 0),                      // Z while DMA_BUSY
+  OP(BRCH, 3), 0x05, 0x00,
+  OP(EXT, WAIT),                   // 0x61
+  OP(JMP, 3), 0x5B, 0x00,
+};
+
+typedef struct {
+  uint8_t* data;
+  size_t length;
+  uint8_t sum;
+} INPUT;
+
+typedef struct {
+  MACHINE machine;
+  TASK task;
+  const INPUT* input;
+  _Atomic int* failures;
+  DMA dma; // -d only
+  _Atomic size_t ready; // input bytes the feeder has let the channel have
+  size_t taken; // by the channel, on the cpu's thread
+} JOB;
+
+void JOB_done(TASK* task) {
+  JOB* job = task->ctx;
+  if (job->machine.cpu.a != job->input->sum || job->machine.cpu.exit != EXIT_HALT) {
+    atomic_fetch_add(job->failures, 1);
+  }
+  // Frames and caches go now. The feeder may still be inside
+  // CPU_raiseInterrupt, which only touches fields of the CPU struct and,
+  // through the wake hook, the TASK, so the JOB holding both stays
+  // allocated until the feeder has joined.
+  MACHINE_free(&job->machine);
+}
+
+// The job's input as a DMA device.
+size_t JOB_transfer(void* ctx, enum DIRECTION dir, uint8_t* data, size_t length) {
+  JOB* job = ctx;
+  size_t ready = atomic_load_explicit(&job->ready, memory_order_acquire);
+  if (dir == WRITE || ready == job->taken) {
+    return 0;
+  }
+  if (length > ready - job->taken) {
+    length = ready - job->taken;
+  }
+  memcpy(data, job->input->data + job->taken, length);
+  job->taken += length;
+  return length;
+}
+
+typedef struct {
+  JOB** jobs;
+  int count;
+  bool dma;
+} FEEDER;
+
+void* BATCH_feeder(void* data) {
+  FEEDER* feeder = data;
+  if (feeder->dma) {
+    // A chunk for every job in turn, so each hears from the channel many
+    // times while the others run.
+    for (size_t offset = 0; offset < BATCH_INPUT_MAX; offset += BATCH_CHUNK) {
+      for (int n = 0; n < feeder->count; n++) {
+        JOB* job = feeder->jobs[n];
+        if (offset < job->input->length) {
+          size_t end = offset + BATCH_CHUNK;
+          atomic_store_explicit(&job->ready, end < job->input->length ? end
+              : job->input->length, memory_order_release);
+          DMA_ready(&job->dma);
+        }
+      }
+    }
+    return NULL;
+  }
+  for (int n = 0; n < feeder->count; n++) {
+    JOB* job = feeder->jobs[n];
+    const INPUT* input = job->input;
+    uint8_t length[2] = { input->length & 0xFF, input->length >> 8 };
+    MACHINE_write(&job->machine, BATCH_INPUT, input->data, input->length);
+    MACHINE_write(&job->machine, BATCH_LENGTH, length, sizeof(length));
+    CPU_raiseInterrupt(&job->machine.cpu, 0);
+  }
+  return NULL;
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs every job once on `workers` threads; returns guest MIPS.
+double BATCH_run(const INPUT* inputs, int inputCount, int jobCount, int workers,
+    CORE core, bool dma, int* failures) {
+  _Atomic int failed = 0;
+  JOB** jobs = calloc(jobCount, sizeof(JOB*));
+  SCHED sched;
+  SCHED_init(&sched, workers, SCHED_SLICE);
+
+  for (int n = 0; n < jobCount; n++) {
+    JOB* job = calloc(1, sizeof(JOB));
+    MACHINE_init(&job->machine, 0);
+    CPU_setCore(&job->machine.cpu, core);
+    MACHINE_load(&job->machine, BATCH_program, sizeof(BATCH_program));
+    job->input = &inputs[n % inputCount];
+    job->failures = &failed;
+    if (dma) {
+      const uint8_t start[] = { BATCH_PROLOGUE & 0xFF, BATCH_PROLOGUE >> 8 };
+      uint8_t length[2] = { job->input->length & 0xFF, job->input->length >> 8 };
+      MACHINE_share(&job->machine, 0, start, sizeof(start));
+      MACHINE_share(&job->machine, BATCH_PROLOGUE, BATCH_dmaPrologue, sizeof(BATCH_dmaPrologue));
+      MACHINE_write(&job->machine, BATCH_LENGTH, length, sizeof(length));
+      CPU_prime(&job->machine.cpu);
+      DMA_init(&job->dma, &job->machine.cpu, BATCH_DMA_PORT, JOB_transfer, job);
+      atomic_init(&job->ready, 0);
+    }
+    job->task.cpu = &job->machine.cpu;
+    job->task.done = JOB_done;
+    job->task.ctx = job;
+    jobs[n] = job;
+  }
+  double start = now();
+  for (int n = 0; n < jobCount; n++) {
+    SCHED_submit(&sched, &jobs[n]->task);
+  }
+  FEEDER feeder = { jobs, jobCount, dma };
+  pthread_t thread;
+  pthread_create(&thread, NULL, BATCH_feeder, &feeder);
+  pthread_join(thread, NULL);
+  SCHED_wait(&sched);
+  double elapsed = now() - start;
+
+  uint64_t retired = SCHED_retired(&sched);
+  uint64_t steals = 0, parks = 0;
+  for (int n = 0; n < workers; n++) {
+    steals += sched.workers[n].steals;
+    parks += sched.workers[n].parks;
+  }
+  SCHED_free(&sched);
+  for (int n = 0; n < jobCount; n++) {
+    free(jobs[n]);
+  }
+  free(jobs);
+
+  double mips = retired / elapsed / 1e6;
+  printf("%8i %8i %10.3f %12.1f %10llu %10llu", workers, jobCount, elapsed, mips,
+      (unsigned long long)steals, (unsigned long long)parks);
+  *failures += failed;
+  return mips;
+}
+
+bool BATCH_readFile(const char* path, INPUT* input) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  input->data = malloc(BATCH_INPUT_MAX);
+  input->length = fread(input->data, 1, BATCH_INPUT_MAX, file);
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  int jobCount = 2000;
+  size_t size = 2048;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int maxWorkers = cpus < 4 ? 4 : cpus;
+  CORE core = CORE_THREADED;
+  bool dma = false;
+  INPUT* inputs = calloc(argc, sizeof(INPUT));
+  int inputCount = 0;
+
+  for (int n = 1; n < argc; n++) {
+    if (strcmp(argv[n], "-d") == 0) {
+      dma = true;
+    } else if (strcmp(argv[n], "-n") == 0 && n + 1 < argc) {
+      jobCount = atoi(argv[++n]);
+    } else if (strcmp(argv[n], "-s") == 0 && n + 1 < argc) {
+      size = atoi(argv[++n]);
+    } else if (strcmp(argv[n], "-w") == 0 && n + 1 < argc) {
+      maxWorkers = atoi(argv[++n]);
+    } else if (strcmp(argv[n], "-c") == 0 && n + 1 < argc) {
+      n++;
+      if (strcmp(argv[n], "switch") == 0) {
+        core = CORE_SWITCH;
+      } else if (strcmp(argv[n], "jit") == 0) {
+        core = CORE_JIT;
+      } else {
+        core = CORE_THREADED;
+      }
+    } else if (BATCH_readFile(argv[n], &inputs[inputCount])) {
+      inputCount++;
+    } else {
+      return 1;
+    }
+  }
+  if (jobCount < 1 || maxWorkers < 1) {
+    fprintf(stderr, "batch: need at least one job and one worker\n");
+    return 1;
+  }
+  if (inputCount == 0) {
+    // Generated inputs, a different one per job up to 16.
+    if (size > BATCH_INPUT_MAX) {
+      size = BATCH_INPUT_MAX;
+    }
+    inputCount = 16;
+    inputs = realloc(inputs, inputCount * sizeof(INPUT));
+    for (int n = 0; n < inputCount; n++) {
+      inputs[n].data = malloc(size);
+      inputs[n].length = size;
+      for (size_t b = 0; b < size; b++) {
+        inputs[n].data[b] = (uint8_t)(b * 131 + n * 7 + (b >> 8));
+      }
+    }
+  }
+  for (int n = 0; n < inputCount; n++) {
+    uint8_t sum = 0;
+    for (size_t b = 0; b < inputs[n].length; b++) {
+      sum += inputs[n].data[b];
+    }
+    inputs[n].sum = sum;
+  }
+
+  const char* coreNames[] = { "switch", "threaded", "jit" };
+  printf("%ld cpus, %s core%s\n", cpus, coreNames[core], dma ? ", DMA input" : "");
+  printf("%8s %8s %10s %12s %10s %10s %8s\n", "workers", "jobs", "seconds", "M instr/s",
+      "steals", "parks", "scaling");
+  int failures = 0;
+  double baseline = 0;
+  for (int workers = 1; workers <= maxWorkers; workers *= 2) {
+    double mips = BATCH_run(inputs, inputCount, jobCount, workers, core, dma, &failures);
+    if (workers == 1) {
+      baseline = mips;
+    }
+    printf(" %7.2fx\n", mips / baseline);
+  }
+  printf("checksums %s\n", failures == 0 ? "ok" : "BROKEN");
+
+  for (int n = 0; n < inputCount; n++) {
+    free(inputs[n].data);
+  }
+  free(inputs);
+  return failures == 0 ? 0 : 1;
+}
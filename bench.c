@@ -0,0 +1,1245 @@
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "cpu.c"
+#include "ring.c"
+#include "machine.c"
+#include "dma.c"
+#include "serial.c"
+#include "mmu.c"
+
+/*
+   irx interpreter benchmark
+   Runs each guest workload on every core and reports guest MIPS, host
+   ns and cycles per guest instruction, then memcpy and checksum loops
+   with and without the 16-bit pair instructions, the multi-machine,
+   ring, snapshot, tenancy and bank switching benchmarks, serial output
+   throughput and interrupt latency.
+
+   usage: bench [-o baseline.csv] [-c baseline.csv]
+
+   Every workload gets one untimed warmup run and BENCH_RUNS timed ones;
+   the median is reported. -o saves the results as CSV, and -c compares
+   against a saved file, so `make bench BENCH_ARGS="-c old.csv"` shows
+   what a change did. Cycles come from the TSC on x86-64 and are left out
+   elsewhere.
+   */
+
+#define BENCH_RUNS 5
+
+typedef struct {
+  const char* name;
+  const uint8_t* program;
+  size_t size;
+  int repeat; // guest runs per measurement
+  void (*setup)(MACHINE* machine); // devices the workload talks to, or NULL
+} WORKLOAD;
+
+// The countdown program from vm.c.
+const uint8_t countdown[] = {
+  0x04, 0x00,
+  0x0C, 0x00,
+  OP(SET, 0), 0xFE,
+  OP(SET, 1), 0x02,
+  OP(SUB, 1),
+  OP(BRCH, 4), 0x0E, 0x00,
+  OP(SET, 1), 0x01,
+  OP(SYS, HALT)
+};
+
+// Three nested 256-iteration loops counting down through A.
+const uint8_t loop[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 2), 0x00,         // 0x04
+  OP(SET, 1), 0x00,         // 0x06
+  OP(SET, 0), 0x00,         // 0x08
+  OP(DEC, 0),               // 0x0A
+  OP(BRCH, 3), 0x0A, 0x00,  // 0x0B
+  OP(COPY_IN, 1),           // 0x0E
+  OP(DEC, 0),
+  OP(COPY_OUT, 1),
+  OP(BRCH, 3), 0x08, 0x00,  // 0x11
+  OP(COPY_IN, 2),           // 0x14
+  OP(DEC, 0),
+  OP(COPY_OUT, 2),
+  OP(BRCH, 3), 0x06, 0x00,  // 0x17
+  OP(SYS, HALT)             // 0x1A
+};
+
+// Copies the page at 0x2000 to 0x3000 256 times, a byte at a time
+// through LOAD_R/STORE_R.
+const uint8_t copy[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 3), 0x20,         // 0x04 D: source page
+  OP(SET, 5), 0x30,         // 0x06 H: destination page
+  OP(SET, 1), 0x00,         // 0x08 B: pass counter
+  OP(SET, 2), 0x00,         // 0x0A C: source offset
+  OP(SET, 4), 0x00,         // 0x0C G: destination offset
+  OP(LOAD_R, 0), 1,         // 0x0E A = [CD]
+  OP(STORE_R, 0), 2,        // 0x10 [GH] = A
+  OP(COPY_IN, 2),           // 0x12
+  OP(INC, 0),
+  OP(COPY_OUT, 2),
+  OP(COPY_OUT, 4),
+  OP(BRCH, 3), 0x0E, 0x00,  // 0x16
+  OP(COPY_IN, 1),           // 0x19
+  OP(DEC, 0),
+  OP(COPY_OUT, 1),
+  OP(BRCH, 3), 0x0A, 0x00,  // 0x1C
+  OP(SYS, HALT)             // 0x1F
+};
+
+// Two calls to an empty subroutine per iteration of a 64 K loop.
+const uint8_t call[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 2), 0x00,         // 0x04
+  OP(SET, 0), 0x00,         // 0x06
+  OP(JMP, 7), 0x20, 0x00,   // 0x08
+  OP(JMP, 7), 0x20, 0x00,   // 0x0B
+  OP(DEC, 0),               // 0x0E
+  OP(BRCH, 3), 0x08, 0x00,  // 0x0F
+  OP(COPY_IN, 2),           // 0x12
+  OP(DEC, 0),
+  OP(COPY_OUT, 2),
+  OP(BRCH, 3), 0x06, 0x00,  // 0x15
+  OP(SYS, HALT),            // 0x18
+  0, 0, 0, 0, 0, 0, 0,
+  OP(SYS, RET)              // 0x20
+};
+
+// DATA_IN then DATA_OUT on port 1, 64 K times.
+const uint8_t io[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 6), 0x01,         // 0x04 E: port
+  OP(SET, 2), 0x00,         // 0x06
+  OP(SET, 1), 0x00,         // 0x08
+  OP(SYS, DATA_IN),         // 0x0A
+  OP(SYS, DATA_OUT),
+  OP(COPY_IN, 1),           // 0x0C
+  OP(DEC, 0),
+  OP(COPY_OUT, 1),
+  OP(BRCH, 3), 0x0A, 0x00,  // 0x0F
+  OP(COPY_IN, 2),           // 0x12
+  OP(DEC, 0),
+  OP(COPY_OUT, 2),
+  OP(BRCH, 3), 0x08, 0x00,  // 0x15
+  OP(SYS, HALT)             // 0x18
+};
+
+// Like io, but port 1 raises an interrupt for every DATA_OUT, which the
+// handler acknowledges and returns from.
+const uint8_t interrupts[] = {
+  0x04, 0x00,
+  0x20, 0x00,
+  OP(SET, 6), 0x01,         // 0x04
+  OP(SEF, 4),               // 0x06 interrupts on
+  OP(SET, 2), 0x00,         // 0x07
+  OP(SET, 1), 0x00,         // 0x09
+  OP(SYS, DATA_OUT),        // 0x0B
+  OP(COPY_IN, 1),           // 0x0C
+  OP(DEC, 0),
+  OP(COPY_OUT, 1),
+  OP(BRCH, 3), 0x0B, 0x00,  // 0x0F
+  OP(COPY_IN, 2),           // 0x12
+  OP(DEC, 0),
+  OP(COPY_OUT, 2),
+  OP(BRCH, 3), 0x09, 0x00,  // 0x15
+  OP(CLF, 4),               // 0x18
+  OP(SYS, HALT),            // 0x19
+  0, 0, 0, 0, 0, 0,
+  OP(SYS, CLEAR_INT),       // 0x20
+  OP(SYS, RETI)
+};
+
+// Port 1 for io: reads count up, writes are summed.
+uint8_t BENCH_port(void* ctx, enum DIRECTION dir, uint8_t value) {
+  uint8_t* state = ctx;
+  if (dir == READ) {
+    return state[0]++;
+  }
+  state[1] += value;
+  return 0;
+}
+
+// Port 1 for interrupts.
+uint8_t BENCH_interruptPort(void* ctx, enum DIRECTION dir, uint8_t value) {
+  if (dir == WRITE) {
+    CPU_raiseInterrupt(ctx, 0);
+  }
+  return 0;
+}
+
+static uint8_t BENCH_portState[2];
+
+void BENCH_setupIO(MACHINE* machine) {
+  CPU_registerBusCallback(&machine->cpu, 1, BENCH_port, BENCH_portState);
+}
+
+void BENCH_setupInterrupts(MACHINE* machine) {
+  CPU_registerBusCallback(&machine->cpu, 1, BENCH_interruptPort, &machine->cpu);
+}
+
+const WORKLOAD workloads[] = {
+  { "countdown", countdown, sizeof(countdown), 2000000, NULL },
+  { "loop", loop, sizeof(loop), 1, NULL },
+  { "copy", copy, sizeof(copy), 4, NULL },
+  { "call", call, sizeof(call), 16, NULL },
+  { "io", io, sizeof(io), 16, BENCH_setupIO },
+  { "interrupts", interrupts, sizeof(interrupts), 8, BENCH_setupInterrupts },
+};
+
+const struct { const char* name; CORE core; } cores[] = {
+  { "switch", CORE_SWITCH },
+  { "threaded", CORE_THREADED },
+#if CPU_JIT
+  { "jit", CORE_JIT },
+#endif
+};
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t BENCH_cycles(void) {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+typedef struct {
+  double mips;
+  double ns; // per guest instruction
+  double cycles; // per guest instruction, 0 when unknown
+} RESULT;
+
+// One measurement: `repeat` runs of the workload from a clean start.
+RESULT BENCH_measure(MACHINE* machine, const WORKLOAD* workload) {
+  CPU* cpu = &machine->cpu;
+  uint64_t retired = cpu->retired;
+  double start = now();
+  uint64_t cycles = BENCH_cycles();
+  for (int n = 0; n < workload->repeat; n++) {
+    memset(cpu->registers, 0, sizeof(cpu->registers));
+    CPU_setFlags(cpu, 0);
+    atomic_store(&cpu->i, 0);
+    cpu->running = true;
+    CPU_prime(cpu);
+    CPU_run(cpu);
+  }
+  cycles = BENCH_cycles() - cycles;
+  double elapsed = now() - start;
+  retired = cpu->retired - retired;
+  RESULT result = {
+    .mips = retired / elapsed / 1e6,
+    .ns = elapsed * 1e9 / retired,
+    .cycles = (double)cycles / retired,
+  };
+  return result;
+}
+
+int BENCH_compareResults(const void* a, const void* b) {
+  double x = ((const RESULT*)a)->ns;
+  double y = ((const RESULT*)b)->ns;
+  return (x > y) - (x < y);
+}
+
+// With `fused` non-NULL, superinstructions are turned off unless it is
+// non-zero, and it returns the share of instructions each one covered.
+RESULT BENCH_runFused(const WORKLOAD* workload, CORE core, double* fused) {
+  MACHINE* machine = calloc(1, sizeof(MACHINE));
+  MACHINE_init(machine, 0);
+  CPU_setCore(&machine->cpu, core);
+  if (fused != NULL && fused[0] == 0) {
+    CPU_setFusion(&machine->cpu, false);
+  }
+  if (workload->setup != NULL) {
+    workload->setup(machine);
+  }
+  MACHINE_load(machine, workload->program, workload->size);
+
+  // Warm up caches, the block cache and the JIT before timing.
+  BENCH_measure(machine, workload);
+  RESULT results[BENCH_RUNS];
+  for (int n = 0; n < BENCH_RUNS; n++) {
+    results[n] = BENCH_measure(machine, workload);
+  }
+  qsort(results, BENCH_RUNS, sizeof(RESULT), BENCH_compareResults);
+  for (int f = 0; fused != NULL && f < F_COUNT; f++) {
+    int length = CPU_fusedPatterns[f][2] == H_COUNT ? 2 : 3;
+    fused[f] = (double)machine->cpu.fusedRuns[f] * length / machine->cpu.retired;
+  }
+  MACHINE_free(machine);
+  free(machine);
+  return results[BENCH_RUNS / 2];
+}
+
+RESULT BENCH_run(const WORKLOAD* workload, CORE core) {
+  return BENCH_runFused(workload, core, NULL);
+}
+
+// Each workload on the threaded core without and with superinstructions,
+// and which of them fired.
+void BENCH_fusion(void) {
+  printf("%-12s%10s%10s%10s  %s\n", "fusion", "off M/s", "on M/s", "speedup", "instructions fused");
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    double fused[F_COUNT] = { 0 };
+    RESULT off = BENCH_runFused(&workloads[w], CORE_THREADED, fused);
+    fused[0] = 1;
+    RESULT on = BENCH_runFused(&workloads[w], CORE_THREADED, fused);
+    printf("%-12s%10.1f%10.1f%9.2fx ", workloads[w].name, off.mips, on.mips, on.mips / off.mips);
+    for (int f = 0; f < F_COUNT; f++) {
+      if (fused[f] > 0) {
+        printf(" %s %.0f%%", CPU_fusedNames[f], fused[f] * 100);
+      }
+    }
+    printf("\n");
+  }
+}
+
+/*
+   Baselines are CSV, one row per workload and core:
+     workload,core,mips,ns,cycles
+   */
+
+#define BASELINE_MAX 64
+
+typedef struct {
+  char workload[32];
+  char core[16];
+  RESULT result;
+} BASELINE;
+
+size_t BENCH_loadBaseline(const char* path, BASELINE* baseline) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return 0;
+  }
+  char line[256];
+  size_t count = 0;
+  while (count < BASELINE_MAX && fgets(line, sizeof(line), file) != NULL) {
+    BASELINE* row = &baseline[count];
+    if (sscanf(line, "%31[^,],%15[^,],%lf,%lf,%lf", row->workload, row->core,
+          &row->result.mips, &row->result.ns, &row->result.cycles) == 5) {
+      count++;
+    }
+  }
+  fclose(file);
+  return count;
+}
+
+const RESULT* BENCH_findBaseline(const BASELINE* baseline, size_t count,
+    const char* workload, const char* core) {
+  for (size_t n = 0; n < count; n++) {
+    if (strcmp(baseline[n].workload, workload) == 0 && strcmp(baseline[n].core, core) == 0) {
+      return &baseline[n].result;
+    }
+  }
+  return NULL;
+}
+
+/*
+   Pair instructions: a 16 KiB memcpy and a checksum of the same block as
+   16-bit words, each written with 8-bit carry chains and with INC16 and
+   friends. Reports guest instructions and MB/s per byte of the block on
+   every core.
+   */
+
+#define PAIR_DATA 0x2000
+#define PAIR_COPY 0x6000
+#define PAIR_SIZE (16 * 1024)
+
+// Copies [0x2000, 0x6000) to 0x6000, stepping CD and GH by hand.
+const uint8_t memcpy8[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 2), 0x00,         // 0x04 CD: source
+  OP(SET, 3), 0x20,
+  OP(SET, 4), 0x00,         // 0x08 GH: destination
+  OP(SET, 5), 0x60,
+  OP(SET, 6), 0x40,         // 0x0C E: pages left
+  OP(LOAD_R, 1), 1,         // 0x0E
+  OP(STORE_R, 1), 2,
+  OP(COPY_IN, 2),           // 0x12 C and G step together
+  OP(INC, 0),
+  OP(COPY_OUT, 2),
+  OP(COPY_OUT, 4),
+  OP(BRCH, 3), 0x0E, 0x00,  // 0x16
+  OP(COPY_IN, 3),           // 0x19
+  OP(INC, 0),
+  OP(COPY_OUT, 3),
+  OP(COPY_IN, 5),
+  OP(INC, 0),
+  OP(COPY_OUT, 5),
+  OP(COPY_IN, 6),
+  OP(DEC, 0),
+  OP(COPY_OUT, 6),
+  OP(BRCH, 3), 0x0E, 0x00,  // 0x22
+  OP(SYS, HALT)             // 0x25
+};
+
+// The same copy with post-increment and CMP16 against the end in AB.
+const uint8_t memcpy16[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 0), 0x00,         // 0x04 AB: end
+  OP(SET, 1), 0x60,
+  OP(SET, 2), 0x00,         // 0x08 CD: source
+  OP(SET, 3), 0x20,
+  OP(SET, 4), 0x00,         // 0x0C GH: destination
+  OP(SET, 5), 0x60,
+  OP(LOAD_R, 6), POST_INC | 1, // 0x10
+  OP(STORE_R, 6), POST_INC | 2,
+  OP(EXT, CMP16), 0x10,
+  OP(BRCH, 3), 0x10, 0x00,  // 0x16
+  OP(SYS, HALT)             // 0x19
+};
+
+// Sums the words of [0x2000, 0x6000) into GH with ADD carrying into H.
+const uint8_t sum8[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 2), 0x00,         // 0x04 CD: words
+  OP(SET, 3), 0x20,
+  OP(SET, 4), 0x00,         // 0x08 GH: sum
+  OP(SET, 5), 0x00,
+  OP(LOAD_R, 1), 1,         // 0x0C B: low byte
+  OP(COPY_IN, 2),
+  OP(INC, 0),
+  OP(COPY_OUT, 2),
+  OP(LOAD_R, 6), 1,         // 0x11 E: high byte
+  OP(COPY_IN, 2),
+  OP(INC, 0),
+  OP(COPY_OUT, 2),
+  OP(COPY_IN, 4),           // 0x16 G += B
+  OP(CLF, 0),
+  OP(ADD, 1),
+  OP(COPY_OUT, 4),
+  OP(COPY_IN, 5),           // 0x1A H += E + carry
+  OP(ADD, 6),
+  OP(COPY_OUT, 5),
+  OP(COPY_IN, 2),           // 0x1D until C wraps
+  OP(OR, 0),
+  OP(BRCH, 3), 0x0C, 0x00,
+  OP(COPY_IN, 3),           // 0x22 next page, up to 0x6000
+  OP(INC, 0),
+  OP(COPY_OUT, 3),
+  OP(SET, 1), 0x60,
+  OP(XOR, 1),
+  OP(BRCH, 3), 0x0C, 0x00,  // 0x28
+  OP(SYS, HALT)             // 0x2B
+};
+
+// The same sum, loading AB with post-increment and adding it with ADD16.
+const uint8_t sum16[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 2), 0x00,         // 0x04 CD: words
+  OP(SET, 3), 0x20,
+  OP(SET, 4), 0x00,         // 0x08 GH: sum
+  OP(SET, 5), 0x00,
+  OP(LOAD_R, 0), POST_INC | 1, // 0x0C
+  OP(LOAD_R, 1), POST_INC | 1,
+  OP(EXT, ADD16), 0x20,
+  OP(COPY_IN, 2),           // 0x12 until C wraps
+  OP(OR, 0),
+  OP(BRCH, 3), 0x0C, 0x00,
+  OP(COPY_IN, 3),           // 0x17 up to 0x6000
+  OP(SET, 1), 0x60,
+  OP(XOR, 1),
+  OP(BRCH, 3), 0x0C, 0x00,  // 0x1B
+  OP(SYS, HALT)             // 0x1E
+};
+
+static uint8_t BENCH_pairByte(size_t n) {
+  return (uint8_t)(n * 31 + (n >> 8));
+}
+
+void BENCH_pairData(MACHINE* machine) {
+  uint8_t* data = malloc(PAIR_SIZE);
+  for (size_t n = 0; n < PAIR_SIZE; n++) {
+    data[n] = BENCH_pairByte(n);
+  }
+  MACHINE_write(machine, PAIR_DATA, data, PAIR_SIZE);
+  free(data);
+}
+
+const WORKLOAD pairs[] = {
+  { "memcpy 8", memcpy8, sizeof(memcpy8), 4, BENCH_pairData },
+  { "memcpy 16", memcpy16, sizeof(memcpy16), 4, BENCH_pairData },
+  { "sum 8", sum8, sizeof(sum8), 4, BENCH_pairData },
+  { "sum 16", sum16, sizeof(sum16), 4, BENCH_pairData },
+};
+
+// Runs `workload` once on `core` and checks what it did. Returns the
+// instructions it took, 0 when the result is wrong.
+uint64_t BENCH_pairCheck(const WORKLOAD* workload, CORE core) {
+  MACHINE* machine = calloc(1, sizeof(MACHINE));
+  MACHINE_init(machine, 0);
+  CPU_setCore(&machine->cpu, core);
+  BENCH_pairData(machine);
+  MACHINE_load(machine, workload->program, workload->size);
+  CPU* cpu = &machine->cpu;
+  CPU_run(cpu);
+  bool same = cpu->exit == EXIT_HALT;
+  uint16_t sum = 0;
+  for (size_t n = 0; n < PAIR_SIZE; n++) {
+    if (workload->program == memcpy8 || workload->program == memcpy16) {
+      same &= CPU_read(cpu, PAIR_COPY + n) == BENCH_pairByte(n);
+    } else {
+      sum += BENCH_pairByte(n) << (n % 2 * 8);
+    }
+  }
+  if (workload->program == sum8 || workload->program == sum16) {
+    same &= CPU_pair(cpu, 2) == sum;
+  }
+  uint64_t retired = same ? cpu->retired : 0;
+  MACHINE_free(machine);
+  free(machine);
+  return retired;
+}
+
+void BENCH_pairs(void) {
+  size_t coreCount = sizeof(cores) / sizeof(cores[0]);
+  printf("%-12s%10s", "pairs", "ins/B");
+  for (size_t c = 0; c < coreCount; c++) {
+    printf("%10s", cores[c].name);
+  }
+  printf("  MB/s\n");
+  for (size_t w = 0; w < sizeof(pairs) / sizeof(pairs[0]); w++) {
+    uint64_t retired = BENCH_pairCheck(&pairs[w], CORE_SWITCH);
+    bool same = retired != 0;
+    printf("%-12s%10.2f", pairs[w].name, (double)retired / PAIR_SIZE);
+    for (size_t c = 0; c < coreCount; c++) {
+      same &= BENCH_pairCheck(&pairs[w], cores[c].core) == retired;
+      RESULT result = BENCH_run(&pairs[w], cores[c].core);
+      printf("%10.1f", result.mips * PAIR_SIZE / retired);
+    }
+    printf("  state %s\n", same ? "ok" : "BROKEN");
+  }
+}
+
+/*
+   Many machines in one process: each thread interleaves its own set of
+   machines in CPU_runFor slices, and every machine must finish with the
+   same state as a machine run alone.
+   */
+
+#define MACHINE_THREADS 4
+#define MACHINES_PER_THREAD 64
+#define MACHINE_SLICE 10000
+
+typedef struct {
+  MACHINE* machines[MACHINES_PER_THREAD];
+  CORE core;
+  uint64_t retired;
+} MACHINE_GROUP;
+
+void* BENCH_machineGroup(void* data) {
+  MACHINE_GROUP* group = data;
+  int running = MACHINES_PER_THREAD;
+  for (int n = 0; n < MACHINES_PER_THREAD; n++) {
+    MACHINE* machine = calloc(1, sizeof(MACHINE));
+    MACHINE_init(machine, 0);
+    CPU_setCore(&machine->cpu, group->core);
+    MACHINE_load(machine, loop, sizeof(loop));
+    group->machines[n] = machine;
+  }
+  while (running > 0) {
+    running = 0;
+    for (int n = 0; n < MACHINES_PER_THREAD; n++) {
+      CPU* cpu = &group->machines[n]->cpu;
+      if (cpu->running) {
+        CPU_runFor(cpu, MACHINE_SLICE, NULL);
+        running += cpu->running;
+      }
+    }
+  }
+  return NULL;
+}
+
+void BENCH_machines(CORE core) {
+  MACHINE_GROUP groups[MACHINE_THREADS];
+  pthread_t threads[MACHINE_THREADS];
+
+  double start = now();
+  for (int t = 0; t < MACHINE_THREADS; t++) {
+    groups[t].core = core;
+    pthread_create(&threads[t], NULL, BENCH_machineGroup, &groups[t]);
+  }
+  for (int t = 0; t < MACHINE_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  double elapsed = now() - start;
+
+  MACHINE* reference = calloc(1, sizeof(MACHINE));
+  MACHINE_init(reference, 0);
+  MACHINE_load(reference, loop, sizeof(loop));
+  CPU_run(&reference->cpu);
+
+  uint64_t retired = 0;
+  bool same = true;
+  for (int t = 0; t < MACHINE_THREADS; t++) {
+    for (int n = 0; n < MACHINES_PER_THREAD; n++) {
+      MACHINE* machine = groups[t].machines[n];
+      retired += machine->cpu.retired;
+      same &= machine->cpu.retired == reference->cpu.retired
+        && machine->cpu.ip == reference->cpu.ip
+        && memcmp(machine->cpu.registers, reference->cpu.registers,
+            sizeof(machine->cpu.registers)) == 0;
+      MACHINE_free(machine);
+      free(machine);
+    }
+  }
+  MACHINE_free(reference);
+  free(reference);
+
+  printf("machines: %i on %i threads, %.1f M/s, state %s\n",
+      MACHINE_THREADS * MACHINES_PER_THREAD, MACHINE_THREADS,
+      retired / elapsed / 1e6, same ? "ok" : "BROKEN");
+}
+
+/*
+   Snapshots: fork many machines from one warmed-up machine with 32 KiB
+   of data, let each one write a few pages, then rewind them all. Reports
+   the latencies and how much memory the forks add over the original.
+   */
+
+#define SNAPSHOT_FORKS 1000
+#define SNAPSHOT_DATA 0x1000
+#define SNAPSHOT_DATA_SIZE (32 * 1024)
+
+// Stores A into four data pages.
+const uint8_t scribble[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(STORE_I, 0), 0x00, 0x20,
+  OP(STORE_I, 0), 0x00, 0x30,
+  OP(STORE_I, 0), 0x00, 0x40,
+  OP(STORE_I, 0), 0x00, 0x50,
+  OP(SYS, HALT)
+};
+
+void BENCH_snapshots(void) {
+  MACHINE* origin = calloc(1, sizeof(MACHINE));
+  MACHINE_init(origin, 0);
+  MACHINE_load(origin, scribble, sizeof(scribble));
+  uint8_t* data = malloc(SNAPSHOT_DATA_SIZE);
+  for (size_t n = 0; n < SNAPSHOT_DATA_SIZE; n++) {
+    data[n] = (uint8_t)(n * 7 + 1);
+  }
+  MACHINE_write(origin, SNAPSHOT_DATA, data, SNAPSHOT_DATA_SIZE);
+  size_t originFrames = CPU_framesInUse();
+
+  SNAPSHOT* snapshot = malloc(sizeof(SNAPSHOT));
+  double start = now();
+  for (int n = 0; n < SNAPSHOT_FORKS; n++) {
+    CPU_snapshot(&origin->cpu, snapshot);
+    CPU_freeSnapshot(snapshot);
+  }
+  double snapshotTime = (now() - start) / SNAPSHOT_FORKS;
+  CPU_snapshot(&origin->cpu, snapshot);
+
+  MACHINE** forks = calloc(SNAPSHOT_FORKS, sizeof(MACHINE*));
+  for (int n = 0; n < SNAPSHOT_FORKS; n++) {
+    forks[n] = calloc(1, sizeof(MACHINE));
+    MACHINE_init(forks[n], 0);
+  }
+  start = now();
+  for (int n = 0; n < SNAPSHOT_FORKS; n++) {
+    CPU_restore(&forks[n]->cpu, snapshot);
+  }
+  double forkTime = (now() - start) / SNAPSHOT_FORKS;
+
+  bool same = true;
+  for (int n = 0; n < SNAPSHOT_FORKS; n++) {
+    CPU* cpu = &forks[n]->cpu;
+    cpu->a = n;
+    CPU_run(cpu);
+    same &= CPU_read(cpu, 0x4000) == (uint8_t)n && CPU_read(cpu, 0x4001) == data[0x3001];
+  }
+  size_t forkFrames = CPU_framesInUse() - originFrames;
+
+  start = now();
+  for (int n = 0; n < SNAPSHOT_FORKS; n++) {
+    CPU_restore(&forks[n]->cpu, snapshot);
+  }
+  double rewindTime = (now() - start) / SNAPSHOT_FORKS;
+
+  for (int n = 0; n < SNAPSHOT_FORKS; n++) {
+    CPU* cpu = &forks[n]->cpu;
+    same &= cpu->running && cpu->ip == origin->cpu.ip && CPU_read(cpu, 0x4000) == data[0x3000];
+    MACHINE_free(forks[n]);
+    free(forks[n]);
+  }
+  same &= CPU_read(&origin->cpu, 0x2000) == data[0x1000];
+  free(forks);
+  CPU_freeSnapshot(snapshot);
+  free(snapshot);
+  MACHINE_free(origin);
+  free(origin);
+  free(data);
+
+  printf("snapshots: snapshot %.2f us, fork %.2f us, rewind %.2f us\n",
+      snapshotTime * 1e6, forkTime * 1e6, rewindTime * 1e6);
+  printf("snapshots: %i forks add %zu KiB to %zu KiB (%.2f KiB each, 64 KiB copied), state %s\n",
+      SNAPSHOT_FORKS, forkFrames * sizeof(FRAME) / 1024, originFrames * sizeof(FRAME) / 1024,
+      (double)forkFrames * sizeof(FRAME) / 1024 / SNAPSHOT_FORKS, same ? "ok" : "BROKEN");
+}
+
+/*
+   Tenancy: TENANTS machines loading the same program, each run long
+   enough to touch a data page and its stack, then freed. Reports the
+   resident memory each one adds, most of it the CPU struct, the frames
+   each one owns, and the resident memory left once they are gone, then
+   frame allocation throughput from the pool against malloc.
+   */
+
+#define TENANTS 10000
+#define TENANT_CODE (4 * 1024) // shared by every tenant
+#define TENANT_FRAMES (1024 * 1024)
+#define TENANT_BATCH 256
+
+// Stores A into page 0x20 and calls a subroutine, then halts.
+const uint8_t tenant[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(STORE_I, 0), 0x00, 0x20,
+  OP(JMP, 7), 0x0B, 0x00,
+  OP(SYS, HALT),
+  OP(SYS, RET)
+};
+
+static size_t BENCH_resident(void) {
+  unsigned long size = 0, resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm != NULL) {
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+void BENCH_tenancy(void) {
+  uint8_t* code = malloc(TENANT_CODE);
+  for (size_t n = 0; n < TENANT_CODE; n++) {
+    code[n] = (uint8_t)(n * 13 + 5);
+  }
+  memcpy(code, tenant, sizeof(tenant));
+  MACHINE** machines = calloc(TENANTS, sizeof(MACHINE*));
+  size_t before = BENCH_resident();
+  size_t beforeFrames = CPU_framesInUse();
+
+  double start = now();
+  for (int n = 0; n < TENANTS; n++) {
+    machines[n] = calloc(1, sizeof(MACHINE));
+    MACHINE_init(machines[n], 0);
+    MACHINE_load(machines[n], code, TENANT_CODE);
+  }
+  double createTime = now() - start;
+  bool same = true;
+  for (int n = 0; n < TENANTS; n++) {
+    CPU* cpu = &machines[n]->cpu;
+    cpu->a = n;
+    CPU_run(cpu);
+    same &= CPU_read(cpu, 0x2000) == (uint8_t)n;
+  }
+  size_t frames = CPU_framesInUse() - beforeFrames;
+  size_t resident = BENCH_resident() - before;
+  size_t slabs = CPU_slabsInUse();
+
+  start = now();
+  for (int n = 0; n < TENANTS; n++) {
+    same &= CPU_read(&machines[n]->cpu, 0x0F00) == code[0x0F00];
+    MACHINE_free(machines[n]);
+    free(machines[n]);
+  }
+  double freeTime = now() - start;
+  size_t after = BENCH_resident();
+  free(machines);
+  free(code);
+
+  printf("tenancy: %i machines, %.0f creates/s, %.0f frees/s, state %s\n", TENANTS,
+      TENANTS / createTime, TENANTS / freeTime, same ? "ok" : "BROKEN");
+  printf("tenancy: %.1f KiB resident each (CPU %zu B), %.2f frames each, %zu KiB of slabs\n",
+      (double)resident / 1024 / TENANTS, sizeof(CPU), (double)frames / TENANTS,
+      slabs * CPU_SLAB_SIZE / 1024);
+  printf("tenancy: %zd KiB more resident after freeing them\n",
+      ((ssize_t)after - (ssize_t)before) / 1024);
+
+  FRAME** batch = malloc(TENANT_BATCH * sizeof(FRAME*));
+  start = now();
+  for (int n = 0; n < TENANT_FRAMES; n += TENANT_BATCH) {
+    for (int k = 0; k < TENANT_BATCH; k++) {
+      batch[k] = CPU_allocFrame();
+      batch[k]->data[0] = k;
+    }
+    for (int k = 0; k < TENANT_BATCH; k++) {
+      CPU_freeFrame(batch[k]);
+    }
+  }
+  double poolTime = now() - start;
+  start = now();
+  for (int n = 0; n < TENANT_FRAMES; n += TENANT_BATCH) {
+    for (int k = 0; k < TENANT_BATCH; k++) {
+      batch[k] = malloc(sizeof(FRAME));
+      batch[k]->data[0] = k;
+    }
+    for (int k = 0; k < TENANT_BATCH; k++) {
+      free(batch[k]);
+    }
+  }
+  double mallocTime = now() - start;
+  free(batch);
+  printf("tenancy: frame alloc+free %.1f ns from the pool, %.1f ns with malloc\n",
+      poolTime * 1e9 / TENANT_FRAMES, mallocTime * 1e9 / TENANT_FRAMES);
+}
+
+/*
+   Bank switching: the guest maps bank after bank of a 16 MiB store into
+   a 16 KiB window and reads from each one, on every core. Reports the
+   cost of a switch next to a host copy of the window it saves.
+   */
+
+#define BANK_SIZE (16 * 1024)
+#define BANK_STORE (16 * 1024 * 1024)
+#define BANK_SWITCHES 1000000
+
+// Maps banks 1, 2, ... 255, 0, ... and loads the first byte of each.
+const uint8_t banks[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 6), 12,                // 0x04 the bank's low byte
+  OP(INC, 0),                    // 0x06
+  OP(SYS, DATA_OUT),
+  OP(LOAD_I, 1), 0x00, 0x40,
+  OP(JMP, 3), 0x06, 0x00
+};
+
+void BENCH_banks(void) {
+  for (size_t c = 0; c < sizeof(cores) / sizeof(cores[0]); c++) {
+    MACHINE* machine = calloc(1, sizeof(MACHINE));
+    MACHINE_init(machine, 0);
+    CPU_setCore(&machine->cpu, cores[c].core);
+    MACHINE_load(machine, banks, sizeof(banks));
+    MMU mmu;
+    if (!MMU_init(&mmu, &machine->cpu, 10, BANK_SIZE, BANK_STORE, NULL)
+        || !MMU_addWindow(&mmu, 0x4000)) {
+      fprintf(stderr, "bench: no mmu\n");
+      exit(1);
+    }
+    for (int n = 0; n < 256; n++) {
+      mmu.store[n * BANK_SIZE] = n;
+    }
+    double start = now();
+    CPU_runFor(&machine->cpu, 1 + BANK_SWITCHES * 4, NULL);
+    double elapsed = now() - start;
+    bool same = mmu.switches == BANK_SWITCHES
+      && machine->cpu.b == (uint8_t)BANK_SWITCHES;
+    printf("banks: %-10s%8.1f ns per switch, state %s\n", cores[c].name,
+        elapsed * 1e9 / mmu.switches, same ? "ok" : "BROKEN");
+    MMU_free(&mmu);
+    MACHINE_free(machine);
+    free(machine);
+  }
+  uint8_t* store = calloc(1, BANK_STORE);
+  uint8_t* window = malloc(BANK_SIZE);
+  unsigned sum = 0;
+  double start = now();
+  for (int n = 0; n < BANK_STORE / BANK_SIZE * 16; n++) {
+    memcpy(window, store + (n % (BANK_STORE / BANK_SIZE)) * BANK_SIZE, BANK_SIZE);
+    sum += window[n % BANK_SIZE];
+  }
+  double elapsed = now() - start;
+  printf("banks: copying the window instead %.1f ns%s\n",
+      elapsed * 1e9 / (BANK_STORE / BANK_SIZE * 16), sum == 0 ? "" : "?");
+  free(window);
+  free(store);
+}
+
+/*
+   Ring stress: a producer thread streams a byte sequence through a small
+   SPSC ring in uneven chunks while the consumer checks every byte
+   arrives in order.
+   */
+
+#define RING_BYTES (64u * 1024 * 1024)
+
+static inline uint8_t BENCH_ringByte(size_t n) {
+  return (uint8_t)(n * 131 + (n >> 8));
+}
+
+void* BENCH_ringProducer(void* data) {
+  RING* ring = data;
+  uint8_t chunk[512];
+  size_t sent = 0;
+  while (sent < RING_BYTES) {
+    size_t length = 1 + (sent % sizeof(chunk));
+    if (length > RING_BYTES - sent) {
+      length = RING_BYTES - sent;
+    }
+    for (size_t n = 0; n < length; n++) {
+      chunk[n] = BENCH_ringByte(sent + n);
+    }
+    size_t written = 0;
+    while (written < length) {
+      size_t count = RING_write(ring, chunk + written, length - written);
+      if (count == 0) {
+        sched_yield();
+      }
+      written += count;
+    }
+    sent += length;
+  }
+  return NULL;
+}
+
+void BENCH_ring(void) {
+  RING ring;
+  RING_init(&ring, 4096);
+  pthread_t producer;
+  uint8_t chunk[300];
+  size_t received = 0;
+  bool ordered = true;
+
+  double start = now();
+  pthread_create(&producer, NULL, BENCH_ringProducer, &ring);
+  while (received < RING_BYTES) {
+    size_t count = RING_read(&ring, chunk, sizeof(chunk));
+    if (count == 0) {
+      sched_yield();
+    }
+    for (size_t n = 0; n < count; n++) {
+      ordered &= chunk[n] == BENCH_ringByte(received + n);
+    }
+    received += count;
+  }
+  pthread_join(producer, NULL);
+  double elapsed = now() - start;
+  RING_free(&ring);
+
+  printf("ring: %u MiB in %.3fs, %.1f MB/s, order %s\n", RING_BYTES >> 20,
+      elapsed, RING_BYTES / elapsed / 1e6, ordered ? "ok" : "BROKEN");
+}
+
+/*
+   Serial output: a guest writes 64 KiB through DATA_OUT, a '\n' every
+   256 bytes, into a pipe drained by another thread. Unbuffered is a
+   write per byte, as SERIAL_io used to do.
+   */
+
+#define SERIAL_RUNS 16
+
+// Writes A counting down from 0 to port 0, 256 times over.
+const uint8_t serialOutput[] = {
+  0x04, 0x00,
+  0x00, 0x00,
+  OP(SET, 6), 0x00,         // 0x04 E: port
+  OP(SET, 2), 0x00,         // 0x06 C: lines
+  OP(SET, 0), 0x00,         // 0x08
+  OP(SYS, DATA_OUT),        // 0x0A
+  OP(DEC, 0),
+  OP(BRCH, 3), 0x0A, 0x00,  // 0x0C
+  OP(COPY_IN, 2),           // 0x0F
+  OP(DEC, 0),
+  OP(COPY_OUT, 2),
+  OP(BRCH, 3), 0x08, 0x00,  // 0x12
+  OP(SYS, HALT)             // 0x15
+};
+
+void* BENCH_drain(void* data) {
+  int fd = *(int*)data;
+  uint8_t chunk[65536];
+  while (read(fd, chunk, sizeof(chunk)) > 0) {
+  }
+  return NULL;
+}
+
+void BENCH_serial(void) {
+  const struct { const char* name; uint64_t latency; bool lineBuffered; } modes[] = {
+    { "unbuffered", 0, false },
+    { "line", SERIAL_LATENCY, true },
+    { "block", SERIAL_LATENCY, false },
+  };
+  printf("%-12s%10s%12s\n", "serial", "MB/s", "bytes/write");
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+      perror("pipe");
+      return;
+    }
+    pthread_t drain;
+    pthread_create(&drain, NULL, BENCH_drain, &fds[0]);
+    MACHINE* machine = calloc(1, sizeof(MACHINE));
+    MACHINE_init(machine, 0);
+    CPU_setCore(&machine->cpu, CORE_THREADED);
+    SERIAL serial;
+    SERIAL_init(&serial, &machine->cpu, 0, fds[0], fds[1], SERIAL_BUFFER_SIZE);
+    serial.latency = modes[m].latency;
+    serial.lineBuffered = modes[m].lineBuffered;
+    double start = now();
+    for (int run = 0; run < SERIAL_RUNS; run++) {
+      MACHINE_load(machine, serialOutput, sizeof(serialOutput));
+      machine->cpu.running = true;
+      while (machine->cpu.running) {
+        CPU_runFor(&machine->cpu, 100000, NULL);
+        SERIAL_poll(&serial);
+      }
+    }
+    SERIAL_flush(&serial);
+    double elapsed = now() - start;
+    printf("%-12s%10.1f%12.1f\n", modes[m].name, serial.outputBytes / elapsed / 1e6,
+        (double)serial.outputBytes / serial.outputWrites);
+    SERIAL_free(&serial);
+    close(fds[1]);
+    pthread_join(drain, NULL);
+    close(fds[0]);
+    MACHINE_free(machine);
+    free(machine);
+  }
+}
+
+/*
+   Interrupt latency: INTERRUPT_SOURCES device threads each raise their
+   own line, note the time, and wait for the guest's handler to report
+   back on port 0x20 before raising it again. With the single vector the
+   handler polls every source's status port to find out which fired;
+   vectored, each line has its own handler. Reported in us from
+   CPU_raiseInterrupt to the handler's DATA_OUT, and as guest
+   instructions run per interrupt.
+   */
+
+#define INTERRUPT_SOURCES 4
+#define INTERRUPT_ROUNDS 2000
+
+#define INTERRUPT_POLL(n) \
+  OP(SET, 6), 0x10 + n, OP(SYS, DATA_IN), OP(DEC, 0), \
+  OP(BRCH, 3), 0x8D + 12 * n, 0x00, \
+  OP(SET, 0), n, OP(SET, 6), 0x20, OP(SYS, DATA_OUT)
+
+#define INTERRUPT_HANDLER(n) \
+  OP(SET, 0), n, OP(SET, 6), 0x20, OP(SYS, DATA_OUT), OP(SYS, RETI), 0, 0
+
+// Waits for interrupts forever; vectors at 0x10, line n handled at
+// 0x40 + 8n, and the single vector's polling handler at 0x80.
+const uint8_t interruptLatency[] = {
+  0x04, 0x00,
+  0x80, 0x00,
+  OP(SEF, 4),               // 0x04
+  OP(EXT, WAIT),            // 0x05
+  OP(JMP, 3), 0x05, 0x00,
+  0, 0, 0, 0, 0, 0, 0,
+  0x40, 0x00, 0x48, 0x00, 0x50, 0x00, 0x58, 0x00,  // 0x10
+  0x60, 0x00, 0x68, 0x00, 0x70, 0x00, 0x78, 0x00,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x20
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  INTERRUPT_HANDLER(0),     // 0x40
+  INTERRUPT_HANDLER(1),
+  INTERRUPT_HANDLER(2),
+  INTERRUPT_HANDLER(3),
+  INTERRUPT_HANDLER(4),
+  INTERRUPT_HANDLER(5),
+  INTERRUPT_HANDLER(6),
+  INTERRUPT_HANDLER(7),
+  OP(SYS, CLEAR_INT),       // 0x80
+  INTERRUPT_POLL(0),        // 0x81
+  INTERRUPT_POLL(1),
+  INTERRUPT_POLL(2),
+  INTERRUPT_POLL(3),
+  OP(SYS, RETI)             // 0xB1
+};
+
+typedef struct {
+  CPU* cpu;
+  uint8_t line;
+  _Atomic bool raised; // read back by the polling handler
+  _Atomic bool handled;
+  uint64_t raisedAt;
+  uint64_t latency[INTERRUPT_ROUNDS]; // ns
+  int rounds;
+} INTERRUPT_SOURCE;
+
+static INTERRUPT_SOURCE BENCH_sources[INTERRUPT_SOURCES];
+
+void* BENCH_source(void* data) {
+  INTERRUPT_SOURCE* source = data;
+  unsigned seed = source->line;
+  for (int n = 0; n < INTERRUPT_ROUNDS; n++) {
+    atomic_store(&source->handled, false);
+    source->raisedAt = SERIAL_now();
+    atomic_store(&source->raised, true);
+    CPU_raiseInterrupt(source->cpu, source->line);
+    while (!atomic_load(&source->handled)) {
+      sched_yield();
+    }
+    // Apart for a while, so sources overlap at random.
+    usleep(rand_r(&seed) % 50);
+  }
+  return NULL;
+}
+
+// Ports 0x10 + n: source n's status, cleared by reading it.
+uint8_t BENCH_sourceStatus(void* ctx, enum DIRECTION dir, uint8_t value) {
+  INTERRUPT_SOURCE* source = ctx;
+  return dir == READ ? atomic_exchange(&source->raised, false) : 0;
+}
+
+// Port 0x20: the handler for source `value` got there.
+uint8_t BENCH_sourceHandled(void* ctx, enum DIRECTION dir, uint8_t value) {
+  if (dir == WRITE && value < INTERRUPT_SOURCES) {
+    INTERRUPT_SOURCE* source = &BENCH_sources[value];
+    atomic_store(&source->raised, false);
+    source->latency[source->rounds++] = SERIAL_now() - source->raisedAt;
+    atomic_store(&source->handled, true);
+  }
+  return 0;
+}
+
+int BENCH_compareLatency(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+void BENCH_interrupts(void) {
+  static uint64_t latency[INTERRUPT_SOURCES * INTERRUPT_ROUNDS];
+  printf("%-12s%10s%10s%10s%10s%10s\n", "interrupts", "sources", "p50 us", "p99 us", "max us",
+      "instr");
+  for (int vectored = 0; vectored < 2; vectored++) {
+    for (int sources = 1; sources <= INTERRUPT_SOURCES; sources += INTERRUPT_SOURCES - 1) {
+      MACHINE* machine = calloc(1, sizeof(MACHINE));
+      MACHINE_init(machine, 0);
+      CPU* cpu = &machine->cpu;
+      CPU_setCore(cpu, CORE_THREADED);
+      MACHINE_load(machine, interruptLatency, sizeof(interruptLatency));
+      CPU_setInterruptVectors(cpu, vectored ? 0x10 : 0);
+      CPU_registerBusCallback(cpu, 0x20, BENCH_sourceHandled, NULL);
+      pthread_t threads[INTERRUPT_SOURCES];
+      for (int n = 0; n < sources; n++) {
+        INTERRUPT_SOURCE* source = &BENCH_sources[n];
+        source->cpu = cpu;
+        source->line = n;
+        atomic_init(&source->raised, false);
+        atomic_init(&source->handled, false);
+        source->rounds = 0;
+        CPU_registerBusCallback(cpu, 0x10 + n, BENCH_sourceStatus, source);
+      }
+      for (int n = 0; n < sources; n++) {
+        pthread_create(&threads[n], NULL, BENCH_source, &BENCH_sources[n]);
+      }
+      size_t count = 0;
+      while (true) {
+        EXIT exit = CPU_runFor(cpu, 100000, NULL);
+        count = 0;
+        for (int n = 0; n < sources; n++) {
+          count += BENCH_sources[n].rounds;
+        }
+        if (count == (size_t)sources * INTERRUPT_ROUNDS) {
+          break;
+        }
+        if (exit == EXIT_WAIT) {
+          CPU_idle(cpu);
+        }
+      }
+      for (int n = 0; n < sources; n++) {
+        pthread_join(threads[n], NULL);
+        memcpy(latency + n * INTERRUPT_ROUNDS, BENCH_sources[n].latency,
+            sizeof(BENCH_sources[n].latency));
+      }
+      qsort(latency, count, sizeof(uint64_t), BENCH_compareLatency);
+      printf("%-12s%10d%10.1f%10.1f%10.1f%10.1f\n", vectored ? "vectored" : "polled", sources,
+          latency[count / 2] / 1e3, latency[count * 99 / 100] / 1e3, latency[count - 1] / 1e3,
+          (double)cpu->retired / count);
+      MACHINE_free(machine);
+      free(machine);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t workloadCount = sizeof(workloads) / sizeof(workloads[0]);
+  size_t coreCount = sizeof(cores) / sizeof(cores[0]);
+  const char* savePath = NULL;
+  BASELINE* baseline = calloc(BASELINE_MAX, sizeof(BASELINE));
+  size_t baselineCount = 0;
+  for (int n = 1; n < argc; n++) {
+    if (strcmp(argv[n], "-o") == 0 && n + 1 < argc) {
+      savePath = argv[++n];
+    } else if (strcmp(argv[n], "-c") == 0 && n + 1 < argc) {
+      baselineCount = BENCH_loadBaseline(argv[++n], baseline);
+    } else {
+      fprintf(stderr, "usage: bench [-o baseline.csv] [-c baseline.csv]\n");
+      return 1;
+    }
+  }
+  FILE* save = NULL;
+  if (savePath != NULL && (save = fopen(savePath, "w")) == NULL) {
+    perror(savePath);
+    return 1;
+  }
+  if (save != NULL) {
+    fprintf(save, "workload,core,mips,ns,cycles\n");
+  }
+
+  printf("%-12s%-10s%10s%10s%10s%10s", "workload", "core", "M/s", "ns/i", "cyc/i", "speedup");
+  printf("%s\n", baselineCount > 0 ? "  vs base" : "");
+  for (size_t w = 0; w < workloadCount; w++) {
+    double reference = 0;
+    for (size_t c = 0; c < coreCount; c++) {
+      RESULT result = BENCH_run(&workloads[w], cores[c].core);
+      if (c == 0) {
+        reference = result.mips;
+      }
+      printf("%-12s%-10s%10.1f%10.2f", workloads[w].name, cores[c].name, result.mips, result.ns);
+      if (result.cycles > 0) {
+        printf("%10.1f", result.cycles);
+      } else {
+        printf("%10s", "-");
+      }
+      printf("%9.2fx", result.mips / reference);
+      const RESULT* base = BENCH_findBaseline(baseline, baselineCount,
+          workloads[w].name, cores[c].name);
+      if (base != NULL) {
+        printf("%+8.1f%%", (result.mips / base->mips - 1) * 100);
+      }
+      printf("\n");
+      if (save != NULL) {
+        fprintf(save, "%s,%s,%.3f,%.4f,%.3f\n", workloads[w].name, cores[c].name,
+            result.mips, result.ns, result.cycles);
+      }
+    }
+  }
+  if (save != NULL) {
+    fclose(save);
+  }
+  free(baseline);
+  printf("\n");
+  BENCH_fusion();
+  printf("\n");
+  BENCH_pairs();
+  printf("\n");
+  BENCH_ring();
+  BENCH_machines(CORE_THREADED);
+  BENCH_snapshots();
+  BENCH_tenancy();
+  BENCH_banks();
+  printf("\n");
+  BENCH_serial();
+  printf("\n");
+  BENCH_interrupts();
+  return 0;
+}
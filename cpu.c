@@ -1,7 +1,18 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /*
    irx cpu core
@@ -9,19 +20,291 @@
    */
 
 #define STACK_SIZE 256
-#define POP_STACK(dest) do { cpu->sp--; dest = cpu->memory(READ, 0xFFFF - cpu->sp, 0); } while(0)
-#define PUSH_STACK(src) do { cpu->memory(WRITE, 0xFFFF - cpu->sp, src); cpu->sp++; } while(0)
+#define POP_STACK(dest) do { cpu->sp--; dest = CPU_read(cpu, 0xFFFF - cpu->sp); } while(0)
+#define PUSH_STACK(src) do { CPU_write(cpu, 0xFFFF - cpu->sp, src); cpu->sp++; } while(0)
 #define SET_IP(low, high) do { cpu->ip = ((high) << 8) | low; } while(0)
 
+// The threaded core uses computed goto where the compiler supports it,
+// and falls back to a switch over handler indices everywhere else.
+#if defined(__GNUC__) && !defined(CPU_NO_COMPUTED_GOTO)
+#define CPU_COMPUTED_GOTO 1
+#else
+#define CPU_COMPUTED_GOTO 0
+#endif
+
+// The JIT core is only available on x86-64 hosts.
+#if defined(__x86_64__) && !defined(CPU_NO_JIT)
+#define CPU_JIT 1
+#else
+#define CPU_JIT 0
+#endif
+
+// Profiling counters are only compiled in with CPU_PROFILE, so that other
+// builds pay nothing for them; see CPU_enableProfile.
+#if defined(CPU_PROFILE)
+#define CPU_PROFILING 1
+#else
+#define CPU_PROFILING 0
+#endif
+
+// Likewise for the execution trace with CPU_TRACE; see CPU_setTracer.
+#if defined(CPU_TRACE)
+#define CPU_TRACING 1
+#else
+#define CPU_TRACING 0
+#endif
+
 enum DIRECTION { READ, WRITE };
-typedef uint8_t (*MEM_callback)(enum DIRECTION, uint16_t, uint8_t);
-typedef uint8_t (*BUS_callback)(enum DIRECTION, uint8_t);
+// Callbacks get back the `ctx` pointer they were registered with, so
+// memory and devices can live in a per-machine struct instead of globals.
+typedef uint8_t (*MEM_callback)(void* ctx, enum DIRECTION, uint16_t, uint8_t);
+typedef uint8_t (*BUS_callback)(void* ctx, enum DIRECTION, uint8_t);
 typedef struct BUS_t {
   BUS_callback callback[256];
+  void* ctx[256];
+  bool trap[256]; // end CPU_runFor after I/O on this port
 } BUS;
 
+/*
+   Services are work a device has to do on the cpu's own thread, like a
+   DMA transfer writing guest memory. A device thread asks for its service
+   with CPU_requestService; the cpu runs it before its next CPU_runFor
+   slice, or straight away when it is parked in CPU_idle.
+   */
+#define CPU_SERVICES 8
+typedef void (*SERVICE_callback)(void* ctx);
+
+/*
+   Interrupts come in on eight lines, each with a pending bit that a
+   device sets from its own thread with CPU_raiseInterrupt. A masked line
+   stays pending but held back until it is unmasked. Without a vector
+   table every line goes to the vector at 0x02 and the handler clears
+   them all with CLEAR_INT. With one, the pending line of highest
+   priority goes straight to its own vector, two bytes per line from the
+   table, and is acknowledged on the way in; the handler runs with I
+   clear until RETI. intc.c lets the guest program all of this.
+   */
+#define CPU_LINES 8
+
+/*
+   A cpu parked in an idle loop is taken to go on round it at
+   CPU_IDLE_RATE instructions a second of host time, so that `retired`
+   keeps counting guest time while the host sleeps; see CPU_idleLoop.
+   */
+#define CPU_IDLE_RATE 100000000ull
+
+/*
+   The 64 KiB address space is split into 256 pages of 256 bytes. A page
+   with a host pointer is accessed directly; a page without one traps to
+   its MMIO callback. ROM is a page with a read pointer only, so writes to
+   it trap.
+   */
+#define PAGE_SIZE 256
+#define PAGE_COUNT 256
+
+typedef enum {
+  PAGE_READ = 1,
+  PAGE_WRITE = 2,
+} PAGE_MODE;
+
+typedef struct PAGE_t {
+  uint8_t* read; // base of the page for direct reads, or NULL to trap
+  uint8_t* write; // base of the page for direct writes, or NULL to trap
+  MEM_callback mmio;
+  void* ctx;
+} PAGE;
+
+/*
+   Pages can also be backed by frames the cpu owns instead of host memory.
+   Frames are reference counted and shared copy-on-write between a cpu and
+   its snapshots: a shared frame is mapped without its write pointer, and
+   the first write to it copies the frame unless nobody else holds it.
+   Fresh frames all start out as one shared zero frame, and loaded ones
+   can be shared between cpus by content, see CPU_shareFrame.
+   */
+typedef struct FRAME_t {
+  _Atomic uint32_t refs;
+  uint32_t hash; // of data, for a shared frame
+  bool shared; // found by content; copied on write however many hold it
+  struct FRAME_t* next; // in a free list, or a CPU_sharedFrames bucket
+  uint8_t data[PAGE_SIZE];
+} FRAME;
+
+struct CPU_t;
+
+/*
+   Superinstructions
+
+   Common runs of instructions which the threaded core executes with one
+   handler, without dispatching or checking for interrupts in between.
+   Only an instruction which can call into the host (a memory or bus
+   callback) could make an interrupt pending or cached code stale in the
+   middle of a run, so those are still followed by the usual checks and
+   every boundary anything can observe stays exact.
+
+   X(first, second) and X(first, second, third), in handler names.
+   */
+#define CPU_FUSIONS2(X) \
+  X(SUB, BRCH) X(CMP, BRCH) X(DEC, BRCH) X(DEC16, BRCH) X(CMP16, BRCH) \
+  X(COPY_OUT, DATA_OUT) X(PUSH, PUSH) X(POP, POP)
+#define CPU_FUSIONS3(X) \
+  X(SET, SUB, BRCH) X(SET, CMP, BRCH)
+
+// Longer runs first, so that they win when matching.
+#define X_FUSED_ENUM2(a, b) F_##a##_##b,
+#define X_FUSED_ENUM3(a, b, c) F_##a##_##b##_##c,
+typedef enum { CPU_FUSIONS3(X_FUSED_ENUM3) CPU_FUSIONS2(X_FUSED_ENUM2) F_COUNT } FUSED;
+#undef X_FUSED_ENUM2
+#undef X_FUSED_ENUM3
+
+// Predecoded instruction: handler, field and immediate already extracted.
+typedef struct DECODED_t {
+  const void* handler; // label in the threaded core (computed goto only)
+  uint8_t kind; // HANDLER index
+  uint8_t entry; // what the threaded core runs: `kind`, or a superinstruction
+  uint8_t field;
+  uint16_t operand;
+  uint16_t next; // ip of the following instruction
+} DECODED;
+
+#define BLOCK_MAX 16
+#define BLOCK_CACHE_SIZE 256
+
+// A straight-line run of instructions starting at `start`, ending at the
+// first control transfer or after BLOCK_MAX instructions. The op after
+// the last instruction is a sentinel which leaves the block.
+typedef struct BLOCK_t {
+  bool valid;
+  uint8_t length;
+  uint16_t start;
+  uint16_t size; // bytes of guest code covered
+  uint16_t hits; // entries, counted up to JIT_THRESHOLD
+  uint8_t nativeLength; // instructions covered by the translation
+  void (*native)(struct CPU_t*); // JIT translation, if any
+  DECODED ops[BLOCK_MAX + 1];
+} BLOCK;
+
+// Why CPU_runFor returned.
+typedef enum {
+  EXIT_BUDGET, // ran the requested number of instructions
+  EXIT_HALT, // SYS HALT, or the host stopped the cpu
+  EXIT_INTERRUPT, // an interrupt became pending; it is serviced on the next run
+  EXIT_IO, // SYS DATA_IN/DATA_OUT on a trapping bus port
+  EXIT_INVALID, // invalid opcode
+  EXIT_WAIT, // WAIT with no interrupt raised; see CPU_idle
+} EXIT;
+
+// Interpreter cores, selectable at runtime with CPU_setCore.
+typedef enum {
+  CORE_SWITCH, // reference: CPU_step -> CPU_execute
+  CORE_THREADED, // direct-threaded dispatch over predecoded blocks
+  CORE_JIT, // threaded, with hot blocks translated to native code
+} CORE;
+
+/*
+   Lazy flags
+
+   ALU instructions keep what each flag is derived from instead of the
+   flag itself. Z and N are cheap and tested by most loops, so they get a
+   source each that every writer overwrites: Z is set when `zero` is 0 and
+   N when bit 7 of `sign` is. C and O need the operands, so ADD/SUB/CMP/MUL
+   record those and leave the arithmetic to whoever reads the flags; the
+   next ALU instruction usually makes that unnecessary. CPU_flags folds
+   everything into `f` for CLF/SEF, shifts, interrupt entry and the host.
+   Flags outside Z/C/N/O are never pending, so FLAG_I can be tested on `f`
+   directly.
+   */
+typedef enum {
+  LAZY_NONE,
+  LAZY_ADD, // C O from a + b + carry
+  LAZY_SUB, // C O from a - (b + carry), for SUB and CMP
+  LAZY_MUL, // O from a * b
+} LAZY_OP;
+
+typedef struct LAZY_t {
+  uint8_t op; // LAZY_OP
+  uint8_t a;
+  uint8_t b;
+  uint16_t result;
+  uint8_t zero; // Z source
+  uint8_t sign; // N source
+} LAZY;
+
+/*
+   Profile
+
+   Execution counters for finding out where a guest program spends its
+   time. Data reads exclude instruction fetches. Not-taken branches are
+   the executions of a BRCH that weren't taken.
+   */
+typedef struct PROFILE_t {
+  uint64_t opcodes[256]; // by instruction byte, i.e. opcode and field
+  uint64_t ips[0x10000]; // by instruction address
+  uint64_t taken[0x10000]; // BRCH taken, by instruction address
+  uint8_t instructions[0x10000]; // last instruction byte retired at each address
+  uint64_t reads[PAGE_COUNT];
+  uint64_t writes[PAGE_COUNT];
+  uint64_t dataIn[256]; // DATA_IN by bus port
+  uint64_t dataOut[256]; // DATA_OUT by bus port
+} PROFILE;
+
+typedef enum {
+  PROFILE_CSV,
+  PROFILE_JSON,
+} PROFILE_FORMAT;
+
+// Bumps a profile counter in CPU_PROFILE builds, and compiles to nothing
+// in the others.
+#define PROFILE_COUNT(cpu, counter, index) do { \
+  if (CPU_PROFILING && (cpu)->profile != NULL) { \
+    (cpu)->profile->counter[index]++; \
+  } \
+} while(0)
+
+/*
+   Trace
+
+   One fixed-size record per retired instruction, handed to the tracer's
+   `emit` callback as soon as the instruction completes. `address` is the
+   last data address the instruction (or the interrupt entry before it)
+   read or wrote.
+   */
+typedef enum {
+  TRACE_READ = 1,
+  TRACE_WRITE = 2,
+  TRACE_INTERRUPT = 4, // an interrupt was entered before this instruction
+} TRACE_ACCESS;
+
+typedef struct TRACE_RECORD_t {
+  uint16_t ip;
+  uint8_t instruction;
+  uint8_t f; // flags after the instruction
+  uint16_t operand; // immediate operand, if the instruction has one
+  uint16_t address;
+  uint8_t access; // TRACE_ACCESS bits
+  uint8_t changed; // bit n set when registers[n] changed
+  uint8_t values[6]; // new values of the changed registers, lowest first
+} TRACE_RECORD;
+
+typedef struct TRACER_t {
+  void (*emit)(void* ctx, const TRACE_RECORD* record);
+  void* ctx;
+  // The record being built.
+  uint8_t registers[8]; // before the instruction
+  uint16_t address;
+  uint8_t access;
+} TRACER;
+
+// Notes a data access in CPU_TRACE builds, like PROFILE_COUNT does.
+#define TRACE_TOUCH(cpu, addr, kind) do { \
+  if (CPU_TRACING && (cpu)->tracer != NULL) { \
+    (cpu)->tracer->address = (addr); \
+    (cpu)->tracer->access |= (kind); \
+  } \
+} while(0)
+
 typedef struct CPU_t {
-  bool running;
+  _Atomic bool running; // cleared by HALT, or by the host from any thread
 
   // General purpose registers
   union {
@@ -41,11 +324,52 @@ typedef struct CPU_t {
   };
 
   uint16_t ip;
-  uint8_t f; // flags
-  uint8_t i; // interupt status
+  uint8_t f; // flags, less Z/N and anything pending in `lazy`; read with CPU_flags
+  LAZY lazy;
+  _Atomic uint8_t i; // bit n: line n pending and not masked, raised from any thread
+  _Atomic uint8_t held; // lines raised while masked
+  _Atomic uint8_t interruptMask; // bit n holds back line n
+  uint8_t vectors; // vector table address, 0 for the single vector at 0x02
+  uint8_t priorities[CPU_LINES]; // higher first, ties to the lower line
+  uint8_t lineOrder[CPU_LINES]; // lines by priority, highest first
+  bool waiting; // parked by WAIT until an interrupt is raised
+  bool idleLoop; // parked for spinning in an idle loop, see CPU_idleLoop
+  bool idleDetect; // look for idle loops, see CPU_setIdleDetection
+  uint64_t idleSkipped; // instructions of idle loops accounted, not run
+  uint64_t idleRate; // instructions a second while parked, see CPU_setIdleRate
+  uint64_t idleSince; // CLOCK_MONOTONIC ns when the cpu parked in an idle loop
+  uint64_t idleLength; // instructions once round it
+  _Atomic uint32_t wakeups; // futex word, bumped by CPU_wake
+  _Atomic bool sleeping; // a thread is blocked in CPU_idle
+  void (*wakeHook)(void* ctx); // called by CPU_wake, see CPU_setWakeHook
+  void* wakeCtx;
+  _Atomic uint8_t serviceRequests; // bit n: run services[n]
+  SERVICE_callback services[CPU_SERVICES];
+  void* serviceCtx[CPU_SERVICES];
+  uint8_t serviceCount;
+
+  uint64_t retired; // instructions executed
+  uint64_t budgetEnd; // CPU_runFor stops once retired reaches this
+  CORE core;
+  EXIT exit; // why the cpu stopped running
+  bool ioTrap; // I/O on a trapping bus port
+
+  // Block cache, allocated on first use by the threaded core.
+  BLOCK* blocks;
+  uint16_t codePages[256]; // cached blocks touching each page, up to BLOCK_CACHE_SIZE
+  bool yield; // leave the current block: cached code was written, or an I/O trap
+  struct JIT_t* jit;
+  bool fuse; // predecode superinstructions, see CPU_setFusion
+  uint64_t fusedRuns[F_COUNT]; // superinstructions executed
+  PROFILE* profile; // NULL unless CPU_enableProfile was called
+  TRACER* tracer; // NULL unless CPU_setTracer was called
 
   BUS bus;
-  MEM_callback memory;
+  MEM_callback memory; // default for trapping pages
+  void* memoryCtx;
+  PAGE pages[PAGE_COUNT];
+  FRAME* frames[PAGE_COUNT]; // backing of frame pages, NULL for the rest
+  uint8_t frameModes[PAGE_COUNT]; // PAGE_MODE of frame pages
 } CPU;
 
 typedef enum {
@@ -86,10 +410,17 @@ typedef enum {
   STORE_I = 0x08,
   STORE_R = 0x88,
 
-  U1 = 0x89,
+  MOVE = 0x89, // field 0 only, was U1
 
-  U2 = 0x0A,
-  U3 = 0x8A,
+  EXT = 0x09,
+  WAIT = 0x00,
+  INC16 = 0x01,
+  DEC16 = 0x02,
+  ADD16 = 0x03,
+  CMP16 = 0x04,
+
+  FILL = 0x0A, // field 0 only, was U2
+  COMPARE = 0x8A, // field 0 only, was U3
 
   BRCH = 0x0B,
   SET = 0x8B,
@@ -120,581 +451,2479 @@ typedef enum {
 } FLAG;
 
 #define OPZ(opcode) opcode
-#define OP(opcode, flag) (opcode | (flag << 4))
+#define OP(opcode, flag) ((opcode) | ((flag) << 4))
+// LOAD_R/STORE_R operand bit: step the pair on after the access.
+#define POST_INC 0x80
+
+void CPU_invalidatePage(CPU* cpu, uint8_t page);
+uint8_t* CPU_pageForWrite(CPU* cpu, uint8_t page);
+
+// A read which isn't counted as data; used for instruction fetches.
+static inline uint8_t CPU_load(CPU* cpu, uint16_t addr) {
+  const PAGE* page = &cpu->pages[addr >> 8];
+  if (page->read != NULL) {
+    return page->read[addr & 0xFF];
+  }
+  return page->mmio(page->ctx, READ, addr, 0);
+}
+
+static inline uint8_t CPU_read(CPU* cpu, uint16_t addr) {
+  PROFILE_COUNT(cpu, reads, addr >> 8);
+  TRACE_TOUCH(cpu, addr, TRACE_READ);
+  return CPU_load(cpu, addr);
+}
+
+// Every guest write goes through here so cached code stays coherent.
+static inline void CPU_write(CPU* cpu, uint16_t addr, uint8_t value) {
+  const PAGE* page = &cpu->pages[addr >> 8];
+  PROFILE_COUNT(cpu, writes, addr >> 8);
+  TRACE_TOUCH(cpu, addr, TRACE_WRITE);
+  if (cpu->codePages[addr >> 8] != 0) {
+    CPU_invalidatePage(cpu, addr >> 8);
+  }
+  if (page->write != NULL) {
+    page->write[addr & 0xFF] = value;
+  } else if (cpu->frameModes[addr >> 8] & PAGE_WRITE) {
+    // A shared frame: copy it, then write.
+    CPU_pageForWrite(cpu, addr >> 8)[addr & 0xFF] = value;
+  } else {
+    page->mmio(page->ctx, WRITE, addr, value);
+  }
+}
 
 uint8_t CPU_fetch(CPU* cpu) {
-  uint8_t data = cpu->memory(READ, cpu->ip++, 0);
+  uint8_t data = CPU_load(cpu, cpu->ip++);
   return data;
 }
 
+// Little-endian 16-bit immediate.
+uint16_t CPU_fetch16(CPU* cpu) {
+  uint8_t lo = CPU_fetch(cpu);
+  uint8_t hi = CPU_fetch(cpu);
+  return (hi << 8) | lo;
+}
+
 bool isBitSet(uint16_t value, uint8_t position) {
   return (value & (1 << position)) != 0;
 }
 
+static inline void CPU_busAccessed(CPU* cpu, uint8_t addr) {
+  if (cpu->bus.trap[addr]) {
+    cpu->ioTrap = true;
+    cpu->yield = true;
+  }
+}
+
 void CPU_writeData(CPU* cpu) {
   uint8_t addr = cpu->e;
+  PROFILE_COUNT(cpu, dataOut, addr);
+  CPU_busAccessed(cpu, addr);
   if (cpu->bus.callback[addr] != NULL) {
-    cpu->bus.callback[addr](WRITE, cpu->a);
+    cpu->bus.callback[addr](cpu->bus.ctx[addr], WRITE, cpu->a);
   }
 }
 
 void CPU_readData(CPU* cpu) {
   uint8_t addr = cpu->e;
+  PROFILE_COUNT(cpu, dataIn, addr);
+  CPU_busAccessed(cpu, addr);
   if (cpu->bus.callback[addr] == NULL) {
     cpu->a = 0;
   } else {
-    cpu->a = cpu->bus.callback[addr](READ, 0);
+    cpu->a = cpu->bus.callback[addr](cpu->bus.ctx[addr], READ, 0);
   }
 }
 
-void CPU_execute(CPU* cpu, uint8_t opcode, uint8_t field) {
-  switch (opcode) {
-    case COPY_IN:
-      // A->A
-      // B->A
-      // C->A
-      // D->A
-      // G->A
-      // H->A
-      {
-        cpu->registers[0] = cpu->registers[field];
-      }
-      break;
-    case COPY_OUT:
-      // register to register
-      {
-        // A->A
-        // A->B
-        // A->C
-        // A->D
-        // A->G
-        // A->H
-        cpu->registers[field] = cpu->registers[0];
-      }
-      break;
-
-    case SHL:
-      {
-        uint8_t value = cpu->registers[field];
-        if (((value >> 8) & 0x01) == 1) {
-          cpu->f |= FLAG_C;
-        }
-        cpu->registers[field] = value << 1;
-      }
-      break;
-    case SHR:
-      {
-        uint8_t value = cpu->registers[field];
-        cpu->registers[field] = value >> 1;
-        cpu->f &= ~FLAG_C;
-      }
-      break;
-    case RTL:
-      {
-        uint8_t value = cpu->registers[field];
-        uint8_t i = value << 1;
-        uint8_t j = value >> 7;
-        if (((value >> 8) & 0x01) == 1) {
-          cpu->f |= FLAG_C;
-        }
-        cpu->registers[field] = i | j;
-      }
-      break;
-    case RTR:
-      {
-        uint8_t value = cpu->registers[field];
-        uint8_t i = value >> 1;
-        uint8_t j = value << 7;
-        if ((value & 0x01) == 1) {
-          cpu->f |= FLAG_C;
-        }
-        cpu->registers[field] = i | j;
-      }
-      break;
-    case CLF:
-      {
-        cpu->f &= ~(1 << field);
-      }
-      break;
-    case SEF:
-      {
-        cpu->f |= (1 << field);
-      }
-      break;
-    case JMP:
-      {
-        if (field & 0x4) {
-          PUSH_STACK((cpu->ip >> 8));
-          PUSH_STACK((uint8_t)(cpu->ip & 0x00FF));
-        }
-        uint8_t lo, hi;
-        if ((field & 0x3) == 0x3) {
-          lo = CPU_fetch(cpu);
-          hi = CPU_fetch(cpu);
-        } else {
-          int pair = (field & 0x3) * 2;
-          lo = cpu->registers[pair];
-          hi = cpu->registers[pair+1];
-        }
-        uint16_t addr = (hi << 8) | lo;
-        cpu->ip = addr;
-      }
+#define FLAGS_ALU (FLAG_Z | FLAG_C | FLAG_N | FLAG_O)
+
+// Flags each LAZY_OP leaves pending.
+static const uint8_t CPU_lazyMask[] = {
+  [LAZY_NONE] = 0,
+  [LAZY_ADD] = FLAG_C | FLAG_O,
+  [LAZY_SUB] = FLAG_C | FLAG_O,
+  [LAZY_MUL] = FLAG_O,
+};
+
+uint8_t CPU_lazyFlags(const LAZY* lazy) {
+  uint8_t a = lazy->a;
+  uint8_t b = lazy->b;
+  uint16_t result = lazy->result;
+  uint8_t f = 0;
+  switch (lazy->op) {
+    case LAZY_ADD:
+      f |= (~(a ^ b) & (a ^ result) & 0x80) ? FLAG_O : 0;
+      f |= (result & 0x100) ? FLAG_C : 0;
       break;
-    case PUSH:
-      {
-        PUSH_STACK(cpu->registers[field]);
-      }
+    case LAZY_SUB:
+      f |= ((a ^ b) & (a ^ result) & 0x80) ? FLAG_O : 0;
+      f |= (result & 0x8000) ? FLAG_C : 0;
       break;
-    case POP:
-      {
-        POP_STACK(cpu->registers[field]);
-      }
+    case LAZY_MUL:
+      f |= (~(a ^ b) & (a ^ result) & 0x80) ? FLAG_O : 0;
       break;
-    case BRCH:
-      {
-        uint8_t lo = CPU_fetch(cpu);
-        uint8_t hi = CPU_fetch(cpu);
-        uint16_t addr = (hi << 8) | lo;
-        uint8_t flag = (field / 2);
-        uint8_t mode = (field % 2);
-        if ((cpu->f & (1 << flag)) != (mode << flag)) {
-          cpu->ip = addr;
-        }
+  }
+  return f;
+}
 
-        /*
-        switch(field) {
-          case 0: // check Z flag set
-            {
-              if ((cpu->f & FLAG_Z) != 0) {
-                cpu->ip = addr;
-              }
-            }
-            break;
-          case 1: // check Z flag clear
-            {
-              if ((cpu->f & FLAG_Z) == 0) {
-                cpu->ip = addr;
-              }
-            }
-            break;
-          case 2: // check N flag
-            {
-              if ((cpu->f & FLAG_N) != 0) {
-                cpu->ip = addr;
-              }
-            }
-            break;
-          case 3: // check N flag
-            {
-              if ((cpu->f & FLAG_N) == 0) {
-                cpu->ip = addr;
-              }
-            }
-            break;
-          case 4: // check C flag
-            {
-              if ((cpu->f & FLAG_C) != 0) {
-                cpu->ip = addr;
-              }
-            }
-            break;
-          case 5: // check C flag
-            {
-              if ((cpu->f & FLAG_C) == 0) {
-                cpu->ip = addr;
-              }
-            }
-            break;
-          case 6: // check O flag
-            {
-              if ((cpu->f & FLAG_O) != 0) {
-                cpu->ip = addr;
-              }
-            }
-            break;
-          case 7: // check O flag
-            {
-              if ((cpu->f & FLAG_O) == 0) {
-                cpu->ip = addr;
-              }
-            }
-            break;
-        }
-        */
-      }
-      break;
-    case CMP:
-      {
-        uint8_t a = cpu->a;
-        uint8_t b = cpu->registers[field];
-        uint16_t carry = ((cpu->f & FLAG_C) != 0);
-        int16_t result = a - (b+carry);
-        if (result == 0) {
-          cpu->f |= FLAG_Z;
-        } else {
-          cpu->f &= ~FLAG_Z;
-        }
+// Kept out of line so the inline fast paths stay small in the cores.
+void CPU_foldFlags(CPU* cpu) {
+  cpu->f = (cpu->f & ~CPU_lazyMask[cpu->lazy.op]) | CPU_lazyFlags(&cpu->lazy);
+  cpu->lazy.op = LAZY_NONE;
+}
 
-        if (isBitSet(((a ^ b) & (a ^ result) & 0x80), 7)) {
-          cpu->f |= FLAG_O;
-        } else {
-          cpu->f &= ~FLAG_O;
-        }
+// The complete flags register, with pending flags folded in.
+static inline uint8_t CPU_flags(CPU* cpu) {
+  if (cpu->lazy.op != LAZY_NONE) {
+    CPU_foldFlags(cpu);
+  }
+  cpu->f &= ~(FLAG_Z | FLAG_N);
+  cpu->f |= cpu->lazy.zero == 0 ? FLAG_Z : 0;
+  cpu->f |= (cpu->lazy.sign & 0x80) ? FLAG_N : 0;
+  return cpu->f;
+}
 
-        if (result < 0) {
-          cpu->f |= FLAG_C;
-        } else {
-          cpu->f &= ~FLAG_C;
-        }
+// Replaces the whole flags register, dropping anything pending.
+static inline void CPU_setFlags(CPU* cpu, uint8_t f) {
+  cpu->f = f;
+  cpu->lazy.op = LAZY_NONE;
+  cpu->lazy.zero = (f & FLAG_Z) ? 0 : 1;
+  cpu->lazy.sign = (f & FLAG_N) ? 0x80 : 0;
+}
 
-        if (isBitSet(result, 7)) {
-          cpu->f |= FLAG_N;
-        } else {
-          cpu->f &= ~FLAG_N;
-        }
-      }
-      break;
-    case STORE_I:
-      // register to memory - operand
-      {
-        uint8_t lo = CPU_fetch(cpu);
-        uint8_t hi = CPU_fetch(cpu);
-        uint16_t addr = (hi << 8) | lo;
-        cpu->memory(WRITE, addr, cpu->registers[field]);
-        cpu->f &= ~FLAG_Z;
-        cpu->f &= ~FLAG_C;
-        cpu->f &= ~FLAG_N;
-        cpu->f &= ~FLAG_O;
-      }
+// Carry-in for ADD/SUB/CMP without materialising the other flags.
+static inline uint8_t CPU_carry(const CPU* cpu) {
+  switch (cpu->lazy.op) {
+    case LAZY_ADD:
+      return (cpu->lazy.result >> 8) & 1;
+    case LAZY_SUB:
+      return (cpu->lazy.result >> 15) & 1;
+  }
+  return (cpu->f & FLAG_C) != 0;
+}
+
+// Makes `op` the pending C/O computation. Pending flags it would not
+// redefine are folded in first.
+static inline void CPU_setLazy(CPU* cpu, LAZY_OP op, uint8_t a, uint8_t b, uint16_t result) {
+  if ((CPU_lazyMask[cpu->lazy.op] & ~CPU_lazyMask[op]) != 0) {
+    CPU_foldFlags(cpu);
+  }
+  cpu->lazy.op = op;
+  cpu->lazy.a = a;
+  cpu->lazy.b = b;
+  cpu->lazy.result = result;
+}
+
+// Loads, stores and SWAP clear Z/C/N/O, which covers anything pending.
+static inline void CPU_clearAluFlags(CPU* cpu) {
+  cpu->lazy.op = LAZY_NONE;
+  cpu->lazy.zero = 1;
+  cpu->lazy.sign = 0;
+  cpu->f &= ~FLAGS_ALU;
+}
+
+/*
+   Instruction semantics
+
+   Every core executes instructions through these functions, so the cores
+   cannot drift apart. Immediate operands are fetched by the caller and
+   passed in `operand` (one byte, or a little-endian 16-bit word).
+   */
+
+static inline void CPU_opCOPY_IN(CPU* cpu, uint8_t field, uint16_t operand) {
+  // A->A
+  // B->A
+  // C->A
+  // D->A
+  // G->A
+  // H->A
+  cpu->registers[0] = cpu->registers[field];
+}
+
+static inline void CPU_opCOPY_OUT(CPU* cpu, uint8_t field, uint16_t operand) {
+  // register to register
+  // A->A
+  // A->B
+  // A->C
+  // A->D
+  // A->G
+  // A->H
+  cpu->registers[field] = cpu->registers[0];
+}
+
+static inline void CPU_opSHL(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t value = cpu->registers[field];
+  if (((value >> 8) & 0x01) == 1) {
+    CPU_setFlags(cpu, CPU_flags(cpu) | FLAG_C);
+  }
+  cpu->registers[field] = value << 1;
+}
+
+static inline void CPU_opSHR(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t value = cpu->registers[field];
+  cpu->registers[field] = value >> 1;
+  CPU_setFlags(cpu, CPU_flags(cpu) & ~FLAG_C);
+}
+
+static inline void CPU_opRTL(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t value = cpu->registers[field];
+  uint8_t i = value << 1;
+  uint8_t j = value >> 7;
+  if (((value >> 8) & 0x01) == 1) {
+    CPU_setFlags(cpu, CPU_flags(cpu) | FLAG_C);
+  }
+  cpu->registers[field] = i | j;
+}
+
+static inline void CPU_opRTR(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t value = cpu->registers[field];
+  uint8_t i = value >> 1;
+  uint8_t j = value << 7;
+  if ((value & 0x01) == 1) {
+    CPU_setFlags(cpu, CPU_flags(cpu) | FLAG_C);
+  }
+  cpu->registers[field] = i | j;
+}
+
+static inline void CPU_opCLF(CPU* cpu, uint8_t field, uint16_t operand) {
+  CPU_setFlags(cpu, CPU_flags(cpu) & ~(1 << field));
+}
+
+static inline void CPU_opSEF(CPU* cpu, uint8_t field, uint16_t operand) {
+  CPU_setFlags(cpu, CPU_flags(cpu) | (1 << field));
+}
+
+// `operand` is only used when the field selects an immediate address.
+static inline void CPU_opJMP(CPU* cpu, uint8_t field, uint16_t operand) {
+  if (field & 0x4) {
+    PUSH_STACK((cpu->ip >> 8));
+    PUSH_STACK((uint8_t)(cpu->ip & 0x00FF));
+  }
+  uint8_t lo, hi;
+  if ((field & 0x3) == 0x3) {
+    lo = operand & 0xFF;
+    hi = operand >> 8;
+  } else {
+    int pair = (field & 0x3) * 2;
+    lo = cpu->registers[pair];
+    hi = cpu->registers[pair+1];
+  }
+  uint16_t addr = (hi << 8) | lo;
+  cpu->ip = addr;
+}
+
+static inline void CPU_opPUSH(CPU* cpu, uint8_t field, uint16_t operand) {
+  PUSH_STACK(cpu->registers[field]);
+}
+
+static inline void CPU_opPOP(CPU* cpu, uint8_t field, uint16_t operand) {
+  POP_STACK(cpu->registers[field]);
+}
+
+static inline bool CPU_branchTaken(CPU* cpu, uint8_t field) {
+  uint8_t flag = (field / 2);
+  uint8_t mode = (field % 2);
+  bool set;
+  switch (flag) {
+    case 1:
+      set = cpu->lazy.zero == 0;
       break;
-    case STORE_R:
-      // Pick memory address from register pair
-      // store register value to memory at address
-      {
-        uint8_t src = CPU_fetch(cpu);
-        uint8_t pair = src * 2;
-        uint8_t lo = cpu->registers[pair];
-        uint8_t hi = cpu->registers[pair+1];
-        uint16_t addr = (hi << 8) | lo;
-        cpu->memory(WRITE, addr, cpu->registers[field]);
-
-        cpu->f &= ~FLAG_Z;
-        cpu->f &= ~FLAG_C;
-        cpu->f &= ~FLAG_N;
-        cpu->f &= ~FLAG_O;
-      }
+    case 2:
+      set = (cpu->lazy.sign & 0x80) != 0;
       break;
-    case LOAD_I:
-      // memory (operand) to register
-      // addressing
-      {
-        uint8_t lo = CPU_fetch(cpu);
-        uint8_t hi = CPU_fetch(cpu);
-        uint16_t addr = (hi << 8) | lo;
-        cpu->registers[field] = cpu->memory(READ, addr, 0);
-        cpu->f &= ~FLAG_Z;
-        cpu->f &= ~FLAG_C;
-        cpu->f &= ~FLAG_N;
-        cpu->f &= ~FLAG_O;
+    default:
+      // C and O: computed only when the pending op defines them.
+      if (CPU_lazyMask[cpu->lazy.op] & (1 << flag)) {
+        set = CPU_lazyFlags(&cpu->lazy) & (1 << flag);
+      } else {
+        set = cpu->f & (1 << flag);
       }
       break;
-    case LOAD_R:
-      // Pick memory address from register pair
-      // read the contents of address to register
+  }
+  return set != mode;
+}
+
+static inline void CPU_opBRCH(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint16_t addr = operand;
+  if (CPU_branchTaken(cpu, field)) {
+    cpu->ip = addr;
+  }
+
+  /*
+  switch(field) {
+    case 0: // check Z flag set
       {
-        uint8_t src = CPU_fetch(cpu);
-        uint8_t pair = src * 2;
-        uint8_t lo = cpu->registers[pair];
-        uint8_t hi = cpu->registers[pair+1];
-        uint16_t addr = (hi << 8) | lo;
-
-        cpu->registers[field] = cpu->memory(READ, addr, 0);
-
-        cpu->f &= ~FLAG_Z;
-        cpu->f &= ~FLAG_C;
-        cpu->f &= ~FLAG_N;
-        cpu->f &= ~FLAG_O;
+        if ((cpu->f & FLAG_Z) != 0) {
+          cpu->ip = addr;
+        }
       }
       break;
-    case SET:
+    case 1: // check Z flag clear
       {
-        uint8_t value = CPU_fetch(cpu);
-        cpu->registers[field] = value;
-        if (cpu->a == 0) {
-          cpu->f |= FLAG_Z;
-        } else {
-          cpu->f &= ~FLAG_Z;
+        if ((cpu->f & FLAG_Z) == 0) {
+          cpu->ip = addr;
         }
       }
       break;
-    case DEC:
+    case 2: // check N flag
       {
-        uint8_t result = cpu->registers[field] -= 1;
-        if (cpu->a == 0) {
-          cpu->f |= FLAG_Z;
-        } else {
-          cpu->f &= ~FLAG_Z;
-        }
-
-        if (isBitSet(result, 7)) {
-          cpu->f |= FLAG_N;
-        } else {
-          cpu->f &= ~FLAG_N;
+        if ((cpu->f & FLAG_N) != 0) {
+          cpu->ip = addr;
         }
       }
       break;
-    case INC:
+    case 3: // check N flag
       {
-        uint8_t result = cpu->registers[field] += 1;
-        if (cpu->a == 0) {
-          cpu->f |= FLAG_Z;
-        } else {
-          cpu->f &= ~FLAG_Z;
-        }
-
-        if (isBitSet(result, 7)) {
-          cpu->f |= FLAG_N;
-        } else {
-          cpu->f &= ~FLAG_N;
+        if ((cpu->f & FLAG_N) == 0) {
+          cpu->ip = addr;
         }
       }
       break;
-    case ADD:
+    case 4: // check C flag
       {
-        uint8_t a = cpu->a;
-        uint8_t b = cpu->registers[field];
-        uint8_t carry = ((cpu->f & FLAG_C) != 0);
-        uint16_t result = a + b + carry;
-        cpu->a = result;
-        if (cpu->a == 0) {
-          cpu->f |= FLAG_Z;
-        } else {
-          cpu->f &= ~FLAG_Z;
-        }
-
-        if (isBitSet((~(a ^ b) & (a ^ result) & 0x80), 7)) {
-          cpu->f |= FLAG_O;
-        } else {
-          cpu->f &= ~FLAG_O;
-        }
-
-        if (isBitSet(result, 8)) {
-          cpu->f |= FLAG_C;
-        } else {
-          cpu->f &= ~FLAG_C;
-        }
-
-        if (isBitSet(result, 7)) {
-          cpu->f |= FLAG_N;
-        } else {
-          cpu->f &= ~FLAG_N;
+        if ((cpu->f & FLAG_C) != 0) {
+          cpu->ip = addr;
         }
       }
       break;
-    case SUB:
+    case 5: // check C flag
       {
-        uint8_t a = cpu->a;
-        uint8_t b = cpu->registers[field];
-        uint16_t carry = ((cpu->f & FLAG_C) != 0);
-        int16_t result = a - (b+carry);
-        cpu->a = result;
-        if (cpu->a == 0) {
-          cpu->f |= FLAG_Z;
-        } else {
-          cpu->f &= ~FLAG_Z;
-        }
-
-        if (isBitSet(((a ^ b) & (a ^ result) & 0x80), 7)) {
-          cpu->f |= FLAG_O;
-        } else {
-          cpu->f &= ~FLAG_O;
-        }
-
-        if (result < 0) {
-          cpu->f |= FLAG_C;
-        } else {
-          cpu->f &= ~FLAG_C;
-        }
-
-        if (isBitSet(result, 7)) {
-          cpu->f |= FLAG_N;
-        } else {
-          cpu->f &= ~FLAG_N;
+        if ((cpu->f & FLAG_C) == 0) {
+          cpu->ip = addr;
         }
       }
       break;
-    case MUL:
+    case 6: // check O flag
       {
-        uint8_t a = cpu->a;
-        uint8_t b = cpu->registers[field];
-        uint16_t result = a * b;
-
-        cpu->a = result & 0xFF;
-        cpu->b = (result & 0xFF00) >> 8;
-
-        if (isBitSet((~(a ^ b) & (a ^ result) & 0x80), 7)) {
-          cpu->f |= FLAG_O;
-        } else {
-          cpu->f &= ~FLAG_O;
-        }
-        if (result == 0) {
-          cpu->f |= FLAG_Z;
-        } else {
-          cpu->f &= ~FLAG_Z;
+        if ((cpu->f & FLAG_O) != 0) {
+          cpu->ip = addr;
         }
       }
       break;
-    case AND:
-      cpu->a &= cpu->registers[field];
-      if (cpu->a == 0) {
-        cpu->f |= FLAG_Z;
-      } else {
-        cpu->f &= ~FLAG_Z;
-      }
-      break;
-    case OR:
-      cpu->a |= cpu->registers[field];
-      if (cpu->a == 0) {
-        cpu->f |= FLAG_Z;
-      } else {
-        cpu->f &= ~FLAG_Z;
-      }
-      break;
-    case XOR:
-      cpu->a ^= cpu->registers[field];
-      if (cpu->a == 0) {
-        cpu->f |= FLAG_Z;
-      } else {
-        cpu->f &= ~FLAG_Z;
-      }
-      break;
-    case NOT:
-      cpu->a = ~(cpu->registers[field]);
-      if (cpu->a == 0) {
-        cpu->f |= FLAG_Z;
-      } else {
-        cpu->f &= ~FLAG_Z;
-      }
-      break;
-    case SYS:
+    case 7: // check O flag
       {
-        switch (field) {
-          case HALT:
-            cpu->running = false;
-            break;
-          case DATA_IN:
-            CPU_readData(cpu);
-            break;
-          case DATA_OUT:
-            CPU_writeData(cpu);
-            break;
-          case CLEAR_INT:
-            cpu->i = 0;
-            break;
-          case RET:
-            {
-              uint8_t lo, hi;
-              POP_STACK(lo);
-              POP_STACK(hi);
-              cpu->ip = (hi << 8) | lo;
-            }
-            break;
-          case RETI:
-            {
-              POP_STACK(cpu->f);
-              uint8_t lo, hi;
-              POP_STACK(lo);
-              POP_STACK(hi);
-              cpu->ip = (hi << 8) | lo;
-            }
-            break;
-          case SWAP:
-            {
-              uint8_t operand = CPU_fetch(cpu);
-              uint8_t src = operand & 0xF;
-              uint8_t dest = (operand & 0xF0) >> 4;
-              uint8_t swap = cpu->registers[dest];
-              cpu->registers[dest] = cpu->registers[src];
-              cpu->registers[src] = swap;
-
-              cpu->f &= ~FLAG_Z;
-              cpu->f &= ~FLAG_C;
-              cpu->f &= ~FLAG_N;
-              cpu->f &= ~FLAG_O;
-            }
-            break;
-          case NOOP: break;
+        if ((cpu->f & FLAG_O) == 0) {
+          cpu->ip = addr;
         }
       }
       break;
-    default: cpu->running = false;
   }
+  */
 }
 
-uint8_t CPU_defaultMemAccess(enum DIRECTION dir, uint16_t addr, uint8_t value) {
-  return 0;
+static inline void CPU_opCMP(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t a = cpu->a;
+  uint8_t b = cpu->registers[field];
+  uint16_t carry = CPU_carry(cpu);
+  int16_t result = a - (b+carry);
+  cpu->lazy.zero = result != 0;
+  cpu->lazy.sign = result;
+  CPU_setLazy(cpu, LAZY_SUB, a, b, result);
 }
 
-void CPU_init(CPU* cpu) {
-  cpu->running = true;
-  cpu->a = 0;
-  cpu->b = 0;
-  cpu->c = 0;
-  cpu->d = 0;
-  cpu->g = 0;
-  cpu->h = 0;
-
-  cpu->e = 0;
-  cpu->f = 0x00;
+// Pairs are read and written as one 16-bit access where the host's byte
+// order allows, so a pair written by one instruction and read by the next
+// forwards from the store instead of stalling on two byte stores.
+static inline uint16_t CPU_pair(CPU* cpu, uint8_t pair) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint16_t value;
+  memcpy(&value, &cpu->registers[pair * 2], 2);
+  return value;
+#else
+  return (cpu->registers[pair * 2 + 1] << 8) | cpu->registers[pair * 2];
+#endif
+}
 
-  cpu->ip = 0;
-  cpu->sp = 0;
-  cpu->memory = CPU_defaultMemAccess;
+static inline void CPU_setPair(CPU* cpu, uint8_t pair, uint16_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&cpu->registers[pair * 2], &value, 2);
+#else
+  cpu->registers[pair * 2] = value;
+  cpu->registers[pair * 2 + 1] = value >> 8;
+#endif
 }
 
-void CPU_prime(CPU* cpu) {
-  uint8_t lo = cpu->memory(READ, 0x00, 0);
-  uint8_t hi = cpu->memory(READ, 0x01, 0);
-  cpu->ip = (hi << 8) | lo;
+static inline void CPU_opSTORE_I(CPU* cpu, uint8_t field, uint16_t operand) {
+  // register to memory - operand
+  uint16_t addr = operand;
+  CPU_write(cpu, addr, cpu->registers[field]);
+  CPU_clearAluFlags(cpu);
 }
 
-bool CPU_step(CPU* cpu) {
-  if (!cpu->running) {
-    return false;
+static inline void CPU_opSTORE_R(CPU* cpu, uint8_t field, uint16_t operand) {
+  // Pick memory address from register pair
+  // store register value to memory at address
+  uint16_t addr = CPU_pair(cpu, operand & 3);
+  CPU_write(cpu, addr, cpu->registers[field]);
+  if (operand & POST_INC) {
+    CPU_setPair(cpu, operand & 3, addr + 1);
   }
 
-  if ((cpu->f & FLAG_I) != 0 && (cpu->i != 0)) {
-    // service interupt
-    PUSH_STACK((cpu->ip >> 8));
-    PUSH_STACK((uint8_t)(cpu->ip & 0x00FF));
-    PUSH_STACK(cpu->f);
-    uint8_t lo = cpu->memory(READ, 0x02, 0);
-    uint8_t hi = cpu->memory(READ, 0x03, 0);
-    cpu->ip = (hi << 8) | lo;
-  }
+  CPU_clearAluFlags(cpu);
+}
 
-  uint8_t instruction = CPU_fetch(cpu);
+static inline void CPU_opLOAD_I(CPU* cpu, uint8_t field, uint16_t operand) {
+  // memory (operand) to register
+  // addressing
+  uint16_t addr = operand;
+  cpu->registers[field] = CPU_read(cpu, addr);
+  CPU_clearAluFlags(cpu);
+}
 
-  // decode
-  uint8_t opcode = instruction & 0x8F;
-  uint8_t field = (instruction & 0x70) >> 4;
+static inline void CPU_opLOAD_R(CPU* cpu, uint8_t field, uint16_t operand) {
+  // Pick memory address from register pair
+  // read the contents of address to register
+  uint16_t addr = CPU_pair(cpu, operand & 3);
 
-  CPU_execute(cpu, opcode, field);
-  return cpu->running;
-}
+  uint8_t value = CPU_read(cpu, addr);
+  if (operand & POST_INC) {
+    CPU_setPair(cpu, operand & 3, addr + 1);
+  }
+  // A register of the pair itself ends up holding what was loaded.
+  cpu->registers[field] = value;
 
-void CPU_registerMemCallback(CPU* cpu, MEM_callback callback) {
-  cpu->memory = callback;
+  CPU_clearAluFlags(cpu);
 }
 
-void CPU_registerBusCallback(CPU* cpu, uint8_t addr, BUS_callback callback) {
-  cpu->bus.callback[addr] = callback;
-}
+/*
+   Block transfers
+
+   MOVE, FILL and COMPARE take the source from AB, the destination from
+   CD and the length from GH (low register first, like LOAD_R). Where
+   every page involved is plain memory they run as memmove/memset/memcmp
+   a page at a time. Anything else (MMIO, ROM, a range wrapping past
+   0xFFFF, or a profiled or traced cpu) goes a byte at a time through
+   CPU_read/CPU_write, and sees exactly what the equivalent loop would.
+   */
 
-void CPU_raiseInterrupt(CPU* cpu, uint8_t addr) {
-  if (cpu->i < 255) {
-    cpu->i++;
+// Whether [addr, addr + length) can be accessed through host pointers.
+static bool CPU_directRange(CPU* cpu, uint16_t addr, uint16_t length, bool write) {
+  if ((CPU_PROFILING && cpu->profile != NULL) || (CPU_TRACING && cpu->tracer != NULL)
+      || addr + length > 0x10000) {
+    return false;
+  }
+  for (uint32_t page = addr >> 8; page <= (uint32_t)(addr + length - 1) >> 8; page++) {
+    bool direct = write
+      ? cpu->pages[page].write != NULL || (cpu->frameModes[page] & PAGE_WRITE)
+      : cpu->pages[page].read != NULL;
+    if (!direct) {
+      return false;
+    }
   }
+  return true;
+}
+
+// Host pointer for writing to `addr`; the range was checked by
+// CPU_directRange. Drops cached code, like CPU_write.
+static inline uint8_t* CPU_writePointer(CPU* cpu, uint16_t addr) {
+  uint8_t page = addr >> 8;
+  if (cpu->codePages[page] != 0) {
+    CPU_invalidatePage(cpu, page);
+  }
+  uint8_t* base = cpu->pages[page].write;
+  return (base != NULL ? base : CPU_pageForWrite(cpu, page)) + (addr & 0xFF);
+}
+
+// Bytes from `a` and `b` up to the end of either's page, at most `length`.
+static inline uint16_t CPU_pageRun(uint16_t a, uint16_t b, uint32_t length) {
+  uint32_t run = PAGE_SIZE - (a & 0xFF);
+  if (PAGE_SIZE - (b & 0xFF) < run) {
+    run = PAGE_SIZE - (b & 0xFF);
+  }
+  return length < run ? length : run;
+}
+
+// Copies GH bytes from [AB] to [CD]. Like memmove, the copy runs from the
+// last byte down when the destination starts inside the source.
+static inline void CPU_opMOVE(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint16_t src = CPU_pair(cpu, 0);
+  uint16_t dest = CPU_pair(cpu, 1);
+  uint16_t length = CPU_pair(cpu, 2);
+  bool backwards = dest != src && (uint16_t)(dest - src) < length;
+  if (length > 0 && CPU_directRange(cpu, src, length, false)
+      && CPU_directRange(cpu, dest, length, true)) {
+    uint32_t left = length;
+    while (left > 0) {
+      uint16_t run;
+      if (backwards) {
+        uint16_t lastSrc = src + left - 1;
+        uint16_t lastDest = dest + left - 1;
+        run = left < (uint32_t)(lastSrc & 0xFF) + 1 ? left : (lastSrc & 0xFF) + 1;
+        run = run < (lastDest & 0xFF) + 1 ? run : (lastDest & 0xFF) + 1;
+        left -= run;
+        // The write pointer first: it may copy the frame the source is in.
+        uint8_t* to = CPU_writePointer(cpu, dest + left);
+        memmove(to, cpu->pages[(uint16_t)(src + left) >> 8].read + ((src + left) & 0xFF), run);
+      } else {
+        run = CPU_pageRun(src, dest, left);
+        uint8_t* to = CPU_writePointer(cpu, dest);
+        memmove(to, cpu->pages[src >> 8].read + (src & 0xFF), run);
+        src += run;
+        dest += run;
+        left -= run;
+      }
+    }
+  } else if (backwards) {
+    for (uint16_t n = length; n > 0; n--) {
+      CPU_write(cpu, dest + n - 1, CPU_read(cpu, src + n - 1));
+    }
+  } else {
+    for (uint16_t n = 0; n < length; n++) {
+      CPU_write(cpu, dest + n, CPU_read(cpu, src + n));
+    }
+  }
+  CPU_clearAluFlags(cpu);
+}
+
+// Stores A into GH bytes from [CD].
+static inline void CPU_opFILL(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint16_t dest = CPU_pair(cpu, 1);
+  uint16_t length = CPU_pair(cpu, 2);
+  if (length > 0 && CPU_directRange(cpu, dest, length, true)) {
+    uint32_t left = length;
+    while (left > 0) {
+      uint16_t run = CPU_pageRun(dest, dest, left);
+      memset(CPU_writePointer(cpu, dest), cpu->a, run);
+      dest += run;
+      left -= run;
+    }
+  } else {
+    for (uint16_t n = 0; n < length; n++) {
+      CPU_write(cpu, dest + n, cpu->a);
+    }
+  }
+  CPU_clearAluFlags(cpu);
+}
+
+// Compares GH bytes at [AB] and [CD]. GH becomes the offset of the first
+// difference, or stays the length, and the flags are those of a CMP of
+// the two bytes that differ (without carry), so Z means equal.
+static inline void CPU_opCOMPARE(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint16_t first = CPU_pair(cpu, 0);
+  uint16_t second = CPU_pair(cpu, 1);
+  uint16_t length = CPU_pair(cpu, 2);
+  uint16_t offset = 0;
+  uint8_t a = 0, b = 0;
+  if (length > 0 && CPU_directRange(cpu, first, length, false)
+      && CPU_directRange(cpu, second, length, false)) {
+    while (offset < length) {
+      uint16_t x = first + offset, y = second + offset;
+      uint16_t run = CPU_pageRun(x, y, length - offset);
+      const uint8_t* p = cpu->pages[x >> 8].read + (x & 0xFF);
+      const uint8_t* q = cpu->pages[y >> 8].read + (y & 0xFF);
+      if (memcmp(p, q, run) != 0) {
+        while (*p == *q) {
+          p++;
+          q++;
+          offset++;
+        }
+        a = *p;
+        b = *q;
+        break;
+      }
+      offset += run;
+    }
+  } else {
+    for (; offset < length; offset++) {
+      a = CPU_read(cpu, first + offset);
+      b = CPU_read(cpu, second + offset);
+      if (a != b) {
+        break;
+      }
+    }
+    if (offset == length) {
+      a = b = 0;
+    }
+  }
+  cpu->g = offset & 0xFF;
+  cpu->h = offset >> 8;
+  int16_t result = a - b;
+  cpu->lazy.zero = result != 0;
+  cpu->lazy.sign = result;
+  CPU_setLazy(cpu, LAZY_SUB, a, b, result);
+}
+
+/*
+   Register pairs
+
+   INC16, DEC16, ADD16 and CMP16 work on AB, CD, GH and E/SP as 16-bit
+   values, low register first, so pointers and counters step without a
+   carry chain. The operand byte names the pair in its low two bits, or
+   two pairs as (x << 4) | y. Z and N come from the 16-bit result. ADD16
+   and CMP16 take no carry in and set C and O from bit 15 directly, which
+   the lazy flags, being 8-bit, cannot record; INC16 and DEC16 leave C
+   and O alone, like INC and DEC.
+   */
+
+static inline void CPU_setPairFlags(CPU* cpu, uint16_t result) {
+  cpu->lazy.zero = result != 0;
+  cpu->lazy.sign = result >> 8;
+}
+
+// C and O, replacing anything pending for them.
+static inline void CPU_setCarryOverflow(CPU* cpu, bool carry, bool overflow) {
+  cpu->lazy.op = LAZY_NONE;
+  cpu->f = (cpu->f & ~(FLAG_C | FLAG_O)) | (carry ? FLAG_C : 0) | (overflow ? FLAG_O : 0);
+}
+
+static inline void CPU_opINC16(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint16_t result = CPU_pair(cpu, operand & 3) + 1;
+  CPU_setPair(cpu, operand & 3, result);
+  CPU_setPairFlags(cpu, result);
+}
+
+static inline void CPU_opDEC16(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint16_t result = CPU_pair(cpu, operand & 3) - 1;
+  CPU_setPair(cpu, operand & 3, result);
+  CPU_setPairFlags(cpu, result);
+}
+
+// x += y
+static inline void CPU_opADD16(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint16_t x = CPU_pair(cpu, (operand >> 4) & 3);
+  uint16_t y = CPU_pair(cpu, operand & 3);
+  uint16_t result = x + y;
+  CPU_setPair(cpu, (operand >> 4) & 3, result);
+  CPU_setPairFlags(cpu, result);
+  CPU_setCarryOverflow(cpu, result < x, ~(x ^ y) & (x ^ result) & 0x8000);
+}
+
+// Flags of x - y: Z when equal, C when x is lower.
+static inline void CPU_opCMP16(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint16_t x = CPU_pair(cpu, (operand >> 4) & 3);
+  uint16_t y = CPU_pair(cpu, operand & 3);
+  uint16_t result = x - y;
+  CPU_setPairFlags(cpu, result);
+  CPU_setCarryOverflow(cpu, x < y, (x ^ y) & (x ^ result) & 0x8000);
+}
+
+static inline void CPU_opSET(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t value = operand;
+  cpu->registers[field] = value;
+  cpu->lazy.zero = cpu->a;
+}
+
+static inline void CPU_opDEC(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t result = cpu->registers[field] -= 1;
+  cpu->lazy.zero = cpu->a;
+  cpu->lazy.sign = result;
+}
+
+static inline void CPU_opINC(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t result = cpu->registers[field] += 1;
+  cpu->lazy.zero = cpu->a;
+  cpu->lazy.sign = result;
+}
+
+static inline void CPU_opADD(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t a = cpu->a;
+  uint8_t b = cpu->registers[field];
+  uint8_t carry = CPU_carry(cpu);
+  uint16_t result = a + b + carry;
+  cpu->a = result;
+  cpu->lazy.zero = result & 0xFF;
+  cpu->lazy.sign = result;
+  CPU_setLazy(cpu, LAZY_ADD, a, b, result);
+}
+
+static inline void CPU_opSUB(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t a = cpu->a;
+  uint8_t b = cpu->registers[field];
+  uint16_t carry = CPU_carry(cpu);
+  int16_t result = a - (b+carry);
+  cpu->a = result;
+  cpu->lazy.zero = result & 0xFF;
+  cpu->lazy.sign = result;
+  CPU_setLazy(cpu, LAZY_SUB, a, b, result);
+}
+
+static inline void CPU_opMUL(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t a = cpu->a;
+  uint8_t b = cpu->registers[field];
+  uint16_t result = a * b;
+
+  cpu->a = result & 0xFF;
+  cpu->b = (result & 0xFF00) >> 8;
+  cpu->lazy.zero = result != 0;
+  CPU_setLazy(cpu, LAZY_MUL, a, b, result);
+}
+
+static inline void CPU_opAND(CPU* cpu, uint8_t field, uint16_t operand) {
+  cpu->a &= cpu->registers[field];
+  cpu->lazy.zero = cpu->a;
+}
+
+static inline void CPU_opOR(CPU* cpu, uint8_t field, uint16_t operand) {
+  cpu->a |= cpu->registers[field];
+  cpu->lazy.zero = cpu->a;
+}
+
+static inline void CPU_opXOR(CPU* cpu, uint8_t field, uint16_t operand) {
+  cpu->a ^= cpu->registers[field];
+  cpu->lazy.zero = cpu->a;
+}
+
+static inline void CPU_opNOT(CPU* cpu, uint8_t field, uint16_t operand) {
+  cpu->a = ~(cpu->registers[field]);
+  cpu->lazy.zero = cpu->a;
+}
+
+static inline void CPU_opNOOP(CPU* cpu, uint8_t field, uint16_t operand) {
+}
+
+static inline void CPU_opHALT(CPU* cpu, uint8_t field, uint16_t operand) {
+  cpu->running = false;
+  cpu->exit = EXIT_HALT;
+}
+
+static inline void CPU_opDATA_IN(CPU* cpu, uint8_t field, uint16_t operand) {
+  CPU_readData(cpu);
+}
+
+static inline void CPU_opDATA_OUT(CPU* cpu, uint8_t field, uint16_t operand) {
+  CPU_writeData(cpu);
+}
+
+static inline void CPU_opCLEAR_INT(CPU* cpu, uint8_t field, uint16_t operand) {
+  atomic_store_explicit(&cpu->i, 0, memory_order_relaxed);
+  atomic_store_explicit(&cpu->held, 0, memory_order_relaxed);
+}
+
+static inline void CPU_opRET(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t lo, hi;
+  POP_STACK(lo);
+  POP_STACK(hi);
+  cpu->ip = (hi << 8) | lo;
+}
+
+static inline void CPU_opRETI(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t f;
+  POP_STACK(f);
+  CPU_setFlags(cpu, f);
+  uint8_t lo, hi;
+  POP_STACK(lo);
+  POP_STACK(hi);
+  cpu->ip = (hi << 8) | lo;
+}
+
+// Registers in bits 0-2 and 4-6 of the operand; bits 3 and 7 are
+// ignored, so a guest can't reach past the register file.
+static inline void CPU_opSWAP(CPU* cpu, uint8_t field, uint16_t operand) {
+  uint8_t src = operand & 0x7;
+  uint8_t dest = (operand & 0x70) >> 4;
+  uint8_t swap = cpu->registers[dest];
+  cpu->registers[dest] = cpu->registers[src];
+  cpu->registers[src] = swap;
+
+  CPU_clearAluFlags(cpu);
+}
+
+static inline void CPU_opWAIT(CPU* cpu, uint8_t field, uint16_t operand) {
+  if (atomic_load(&cpu->i) == 0) {
+    cpu->waiting = true;
+    cpu->yield = true;
+  }
+}
+
+static inline void CPU_opINVALID(CPU* cpu, uint8_t field, uint16_t operand) {
+  cpu->running = false;
+  cpu->exit = EXIT_INVALID;
+}
+
+void CPU_execute(CPU* cpu, uint8_t opcode, uint8_t field) {
+  switch (opcode) {
+    case COPY_IN: CPU_opCOPY_IN(cpu, field, 0); break;
+    case COPY_OUT: CPU_opCOPY_OUT(cpu, field, 0); break;
+
+    case SHL: CPU_opSHL(cpu, field, 0); break;
+    case SHR: CPU_opSHR(cpu, field, 0); break;
+    case RTL: CPU_opRTL(cpu, field, 0); break;
+    case RTR: CPU_opRTR(cpu, field, 0); break;
+    case CLF: CPU_opCLF(cpu, field, 0); break;
+    case SEF: CPU_opSEF(cpu, field, 0); break;
+    case JMP:
+      {
+        // The target first, so a call returns past it.
+        uint16_t addr = 0;
+        if ((field & 0x3) == 0x3) {
+          addr = CPU_fetch16(cpu);
+        }
+        CPU_opJMP(cpu, field, addr);
+      }
+      break;
+    case PUSH: CPU_opPUSH(cpu, field, 0); break;
+    case POP: CPU_opPOP(cpu, field, 0); break;
+    case BRCH: CPU_opBRCH(cpu, field, CPU_fetch16(cpu)); break;
+    case CMP: CPU_opCMP(cpu, field, 0); break;
+    case STORE_I: CPU_opSTORE_I(cpu, field, CPU_fetch16(cpu)); break;
+    case STORE_R: CPU_opSTORE_R(cpu, field, CPU_fetch(cpu)); break;
+    case LOAD_I: CPU_opLOAD_I(cpu, field, CPU_fetch16(cpu)); break;
+    case LOAD_R: CPU_opLOAD_R(cpu, field, CPU_fetch(cpu)); break;
+    case SET: CPU_opSET(cpu, field, CPU_fetch(cpu)); break;
+    case MOVE:
+    case FILL:
+    case COMPARE:
+      if (field != 0) {
+        CPU_opINVALID(cpu, field, 0);
+      } else if (opcode == MOVE) {
+        CPU_opMOVE(cpu, field, 0);
+      } else if (opcode == FILL) {
+        CPU_opFILL(cpu, field, 0);
+      } else {
+        CPU_opCOMPARE(cpu, field, 0);
+      }
+      break;
+    case DEC: CPU_opDEC(cpu, field, 0); break;
+    case INC: CPU_opINC(cpu, field, 0); break;
+    case ADD: CPU_opADD(cpu, field, 0); break;
+    case SUB: CPU_opSUB(cpu, field, 0); break;
+    case MUL: CPU_opMUL(cpu, field, 0); break;
+    case AND: CPU_opAND(cpu, field, 0); break;
+    case OR: CPU_opOR(cpu, field, 0); break;
+    case XOR: CPU_opXOR(cpu, field, 0); break;
+    case NOT: CPU_opNOT(cpu, field, 0); break;
+    case SYS:
+      {
+        switch (field) {
+          case HALT: CPU_opHALT(cpu, field, 0); break;
+          case DATA_IN: CPU_opDATA_IN(cpu, field, 0); break;
+          case DATA_OUT: CPU_opDATA_OUT(cpu, field, 0); break;
+          case CLEAR_INT: CPU_opCLEAR_INT(cpu, field, 0); break;
+          case RET: CPU_opRET(cpu, field, 0); break;
+          case RETI: CPU_opRETI(cpu, field, 0); break;
+          case SWAP: CPU_opSWAP(cpu, field, CPU_fetch(cpu)); break;
+          case NOOP: break;
+        }
+      }
+      break;
+    case EXT:
+      {
+        switch (field) {
+          case WAIT: CPU_opWAIT(cpu, field, 0); break;
+          case INC16: CPU_opINC16(cpu, field, CPU_fetch(cpu)); break;
+          case DEC16: CPU_opDEC16(cpu, field, CPU_fetch(cpu)); break;
+          case ADD16: CPU_opADD16(cpu, field, CPU_fetch(cpu)); break;
+          case CMP16: CPU_opCMP16(cpu, field, CPU_fetch(cpu)); break;
+          default: CPU_opINVALID(cpu, field, 0); break;
+        }
+      }
+      break;
+    default: CPU_opINVALID(cpu, field, 0);
+  }
+}
+
+/*
+   Handler table
+
+   X(name, operand bytes) for every distinct handler. SYS is split per
+   field and JMP into register-pair and immediate forms, so that one
+   instruction byte always maps to one handler with a fixed operand size.
+   */
+
+#define CPU_HANDLERS(X) \
+  X(INVALID, 0) \
+  X(NOOP, 0) X(HALT, 0) X(DATA_IN, 0) X(DATA_OUT, 0) \
+  X(CLEAR_INT, 0) X(RET, 0) X(RETI, 0) X(SWAP, 1) \
+  X(WAIT, 0) X(INC16, 1) X(DEC16, 1) X(ADD16, 1) X(CMP16, 1) \
+  X(JMP, 0) X(JMP_I, 2) \
+  X(CLF, 0) X(SEF, 0) X(PUSH, 0) X(POP, 0) \
+  X(COPY_IN, 0) X(COPY_OUT, 0) X(INC, 0) X(DEC, 0) \
+  X(RTL, 0) X(RTR, 0) X(SHL, 0) X(SHR, 0) \
+  X(LOAD_I, 2) X(LOAD_R, 1) X(STORE_I, 2) X(STORE_R, 1) \
+  X(BRCH, 2) X(SET, 1) X(NOT, 0) X(XOR, 0) \
+  X(AND, 0) X(OR, 0) X(ADD, 0) X(MUL, 0) \
+  X(SUB, 0) X(CMP, 0) \
+  X(MOVE, 0) X(FILL, 0) X(COMPARE, 0)
+
+#define CPU_opJMP_I CPU_opJMP
+
+#define X_ENUM(name, operands) H_##name,
+typedef enum { CPU_HANDLERS(X_ENUM) H_COUNT } HANDLER;
+#undef X_ENUM
+
+typedef void (*CPU_opFn)(CPU* cpu, uint8_t field, uint16_t operand);
+
+#define X_FUNCTION(name, operands) [H_##name] = CPU_op##name,
+const CPU_opFn CPU_handlerFunctions[H_COUNT] = { CPU_HANDLERS(X_FUNCTION) };
+#undef X_FUNCTION
+
+#define X_OPERANDS(name, operands) [H_##name] = operands,
+const uint8_t CPU_handlerOperands[H_COUNT] = { CPU_HANDLERS(X_OPERANDS) };
+#undef X_OPERANDS
+
+#define X_NAME(name, operands) [H_##name] = #name,
+const char* const CPU_handlerNames[H_COUNT] = { CPU_HANDLERS(X_NAME) };
+#undef X_NAME
+
+// Handler runs matched by each superinstruction, padded with H_COUNT.
+#define X_FUSED_PATTERN2(a, b) [F_##a##_##b] = { H_##a, H_##b, H_COUNT },
+#define X_FUSED_PATTERN3(a, b, c) [F_##a##_##b##_##c] = { H_##a, H_##b, H_##c },
+const uint8_t CPU_fusedPatterns[F_COUNT][3] = {
+  CPU_FUSIONS3(X_FUSED_PATTERN3) CPU_FUSIONS2(X_FUSED_PATTERN2)
+};
+#undef X_FUSED_PATTERN2
+#undef X_FUSED_PATTERN3
+
+#define X_FUSED_NAME2(a, b) [F_##a##_##b] = #a "+" #b,
+#define X_FUSED_NAME3(a, b, c) [F_##a##_##b##_##c] = #a "+" #b "+" #c,
+const char* const CPU_fusedNames[F_COUNT] = {
+  CPU_FUSIONS3(X_FUSED_NAME3) CPU_FUSIONS2(X_FUSED_NAME2)
+};
+#undef X_FUSED_NAME2
+#undef X_FUSED_NAME3
+
+// Handlers after which a superinstruction has to check like a single
+// instruction would; see CPU_FUSIONS2.
+static inline bool CPU_fusedMayTrap(uint8_t kind) {
+  return kind == H_PUSH || kind == H_POP;
+}
+
+// Instruction byte -> handler.
+uint8_t CPU_decodeTable[256];
+// 0 unbuilt, 1 being built, 2 ready. Machines may be initialised from
+// several threads at once; the first one builds the table.
+static _Atomic int CPU_decodeState;
+
+void CPU_buildDecodeTable(void) {
+  int state = 0;
+  if (!atomic_compare_exchange_strong(&CPU_decodeState, &state, 1)) {
+    while (atomic_load_explicit(&CPU_decodeState, memory_order_acquire) != 2) {
+      sched_yield();
+    }
+    return;
+  }
+  static const uint8_t opcodes[][2] = {
+    { JMP, H_JMP }, { CLF, H_CLF }, { SEF, H_SEF },
+    { PUSH, H_PUSH }, { POP, H_POP },
+    { COPY_IN, H_COPY_IN }, { COPY_OUT, H_COPY_OUT },
+    { INC, H_INC }, { DEC, H_DEC }, { RTL, H_RTL }, { RTR, H_RTR },
+    { SHL, H_SHL }, { SHR, H_SHR },
+    { LOAD_I, H_LOAD_I }, { LOAD_R, H_LOAD_R },
+    { STORE_I, H_STORE_I }, { STORE_R, H_STORE_R },
+    { BRCH, H_BRCH }, { SET, H_SET }, { NOT, H_NOT }, { XOR, H_XOR },
+    { AND, H_AND }, { OR, H_OR }, { ADD, H_ADD }, { MUL, H_MUL },
+    { SUB, H_SUB }, { CMP, H_CMP },
+  };
+  static const uint8_t sys[8] = {
+    H_NOOP, H_HALT, H_DATA_IN, H_DATA_OUT,
+    H_CLEAR_INT, H_RET, H_RETI, H_SWAP
+  };
+
+  memset(CPU_decodeTable, H_INVALID, sizeof(CPU_decodeTable));
+  for (size_t n = 0; n < sizeof(opcodes) / sizeof(opcodes[0]); n++) {
+    for (uint8_t field = 0; field < 8; field++) {
+      CPU_decodeTable[OP(opcodes[n][0], field)] = opcodes[n][1];
+    }
+  }
+  for (uint8_t field = 0; field < 8; field++) {
+    CPU_decodeTable[OP(SYS, field)] = sys[field];
+  }
+  CPU_decodeTable[OP(EXT, WAIT)] = H_WAIT;
+  CPU_decodeTable[OP(EXT, INC16)] = H_INC16;
+  CPU_decodeTable[OP(EXT, DEC16)] = H_DEC16;
+  CPU_decodeTable[OP(EXT, ADD16)] = H_ADD16;
+  CPU_decodeTable[OP(EXT, CMP16)] = H_CMP16;
+  CPU_decodeTable[OP(MOVE, 0)] = H_MOVE;
+  CPU_decodeTable[OP(FILL, 0)] = H_FILL;
+  CPU_decodeTable[OP(COMPARE, 0)] = H_COMPARE;
+  CPU_decodeTable[OP(JMP, 3)] = H_JMP_I;
+  CPU_decodeTable[OP(JMP, 7)] = H_JMP_I;
+  atomic_store_explicit(&CPU_decodeState, 2, memory_order_release);
+}
+
+void CPU_registerMemCallback(CPU* cpu, MEM_callback callback, void* ctx);
+
+uint8_t CPU_defaultMemAccess(void* ctx, enum DIRECTION dir, uint16_t addr, uint8_t value) {
+  return 0;
+}
+
+void CPU_init(CPU* cpu) {
+  cpu->running = true;
+  cpu->a = 0;
+  cpu->b = 0;
+  cpu->c = 0;
+  cpu->d = 0;
+  cpu->g = 0;
+  cpu->h = 0;
+
+  cpu->e = 0;
+  CPU_setFlags(cpu, 0x00);
+
+  cpu->ip = 0;
+  cpu->sp = 0;
+  cpu->retired = 0;
+  cpu->budgetEnd = 0;
+  cpu->core = CORE_SWITCH;
+  cpu->exit = EXIT_HALT;
+  cpu->ioTrap = false;
+  cpu->waiting = false;
+  cpu->idleLoop = false;
+  cpu->idleDetect = true;
+  cpu->idleSkipped = 0;
+  cpu->idleRate = CPU_IDLE_RATE;
+  cpu->idleSince = 0;
+  cpu->idleLength = 0;
+  atomic_init(&cpu->wakeups, 0);
+  atomic_init(&cpu->sleeping, false);
+  cpu->wakeHook = NULL;
+  cpu->wakeCtx = NULL;
+  atomic_init(&cpu->serviceRequests, 0);
+  cpu->serviceCount = 0;
+  atomic_init(&cpu->i, 0);
+  atomic_init(&cpu->held, 0);
+  atomic_init(&cpu->interruptMask, 0);
+  cpu->vectors = 0;
+  for (int n = 0; n < CPU_LINES; n++) {
+    cpu->priorities[n] = 0;
+    cpu->lineOrder[n] = n;
+  }
+  memset(&cpu->bus, 0, sizeof(cpu->bus));
+  memset(cpu->frames, 0, sizeof(cpu->frames));
+  memset(cpu->frameModes, 0, sizeof(cpu->frameModes));
+  CPU_registerMemCallback(cpu, CPU_defaultMemAccess, NULL);
+
+  cpu->blocks = NULL;
+  memset(cpu->codePages, 0, sizeof(cpu->codePages));
+  cpu->yield = false;
+  cpu->jit = NULL;
+  cpu->fuse = true;
+  memset(cpu->fusedRuns, 0, sizeof(cpu->fusedRuns));
+  cpu->profile = NULL;
+  cpu->tracer = NULL;
+  CPU_buildDecodeTable();
+}
+
+void CPU_prime(CPU* cpu) {
+  uint8_t lo = CPU_read(cpu, 0x00);
+  uint8_t hi = CPU_read(cpu, 0x01);
+  cpu->ip = (hi << 8) | lo;
+}
+
+static inline bool CPU_interruptPending(CPU* cpu) {
+  return (cpu->f & FLAG_I) != 0
+    && atomic_load_explicit(&cpu->i, memory_order_acquire) != 0;
+}
+
+// The pending line of highest priority in `lines`.
+static inline uint8_t CPU_nextLine(CPU* cpu, uint8_t lines) {
+  for (int n = 0; n < CPU_LINES - 1; n++) {
+    if (lines & (1 << cpu->lineOrder[n])) {
+      return cpu->lineOrder[n];
+    }
+  }
+  return cpu->lineOrder[CPU_LINES - 1];
+}
+
+// Enters the handler for the pending interrupt, if there still is one.
+static inline bool CPU_serviceInterrupt(CPU* cpu) {
+  uint8_t lines = atomic_load_explicit(&cpu->i, memory_order_acquire);
+  uint8_t mask = atomic_load_explicit(&cpu->interruptMask, memory_order_relaxed);
+  if (lines & mask) {
+    // Raised just as its line was masked: hold it back after all.
+    lines = atomic_fetch_and(&cpu->i, ~mask);
+    atomic_fetch_or(&cpu->held, lines & mask);
+    lines &= ~mask;
+    if (lines == 0) {
+      return false;
+    }
+  }
+  PUSH_STACK((cpu->ip >> 8));
+  PUSH_STACK((uint8_t)(cpu->ip & 0x00FF));
+  PUSH_STACK(CPU_flags(cpu));
+  uint16_t vector = 0x02;
+  if (cpu->vectors != 0) {
+    uint8_t line = CPU_nextLine(cpu, lines);
+    atomic_fetch_and_explicit(&cpu->i, ~(1 << line), memory_order_relaxed);
+    cpu->f &= ~FLAG_I;
+    vector = cpu->vectors + 2 * line;
+  }
+  uint8_t lo = CPU_read(cpu, vector);
+  uint8_t hi = CPU_read(cpu, vector + 1);
+  cpu->ip = (hi << 8) | lo;
+  return true;
+}
+
+void CPU_idle(CPU* cpu);
+static void CPU_endIdleLoop(CPU* cpu);
+void CPU_wake(CPU* cpu);
+void CPU_runServices(CPU* cpu);
+
+static void CPU_profileInstruction(CPU* cpu, uint16_t ip, uint8_t instruction) {
+  PROFILE* profile = cpu->profile;
+  profile->opcodes[instruction]++;
+  profile->ips[ip]++;
+  profile->instructions[ip] = instruction;
+  if (CPU_decodeTable[instruction] == H_BRCH
+      && CPU_branchTaken(cpu, (instruction & 0x70) >> 4)) {
+    profile->taken[ip]++;
+  }
+}
+
+// Operands are read back from memory, unless that would poke MMIO.
+static uint8_t CPU_traceByte(CPU* cpu, uint16_t addr) {
+  const PAGE* page = &cpu->pages[addr >> 8];
+  return page->read != NULL ? page->read[addr & 0xFF] : 0;
+}
+
+static void CPU_traceInstruction(CPU* cpu, uint16_t ip, uint8_t instruction) {
+  TRACER* tracer = cpu->tracer;
+  TRACE_RECORD record = {
+    .ip = ip,
+    .instruction = instruction,
+    .f = CPU_flags(cpu),
+    .address = tracer->address,
+    .access = tracer->access,
+  };
+  uint8_t operands = CPU_handlerOperands[CPU_decodeTable[instruction]];
+  if (operands > 0) {
+    record.operand = CPU_traceByte(cpu, ip + 1);
+  }
+  if (operands == 2) {
+    record.operand |= CPU_traceByte(cpu, ip + 2) << 8;
+  }
+  int count = 0;
+  for (int n = 0; n < 8; n++) {
+    if (cpu->registers[n] != tracer->registers[n]) {
+      record.changed |= 1 << n;
+      if (count < 6) {
+        record.values[count++] = cpu->registers[n];
+      }
+    }
+  }
+  tracer->emit(tracer->ctx, &record);
+}
+
+// `instrumented` is a constant in every caller, so CPU_step carries no
+// trace of the profiler or the tracer.
+static inline bool CPU_stepWith(CPU* cpu, const bool instrumented) {
+  if (!cpu->running) {
+    return false;
+  }
+
+  if (cpu->waiting) {
+    CPU_idle(cpu);
+    if (cpu->idleLoop) {
+      CPU_endIdleLoop(cpu);
+    }
+    cpu->waiting = false;
+  }
+
+  bool tracing = CPU_TRACING && instrumented && cpu->tracer != NULL;
+  if (tracing) {
+    memcpy(cpu->tracer->registers, cpu->registers, sizeof(cpu->registers));
+    cpu->tracer->access = 0;
+  }
+
+  if (CPU_interruptPending(cpu)) {
+    // service interupt
+    if (CPU_serviceInterrupt(cpu) && tracing) {
+      cpu->tracer->access |= TRACE_INTERRUPT;
+    }
+  }
+
+  uint16_t ip = cpu->ip;
+  uint8_t instruction = CPU_fetch(cpu);
+
+  // decode
+  uint8_t opcode = instruction & 0x8F;
+  uint8_t field = (instruction & 0x70) >> 4;
+
+  if (CPU_PROFILING && instrumented && cpu->profile != NULL) {
+    // Before executing, while the flags still decide the branch.
+    CPU_profileInstruction(cpu, ip, instruction);
+  }
+  CPU_execute(cpu, opcode, field);
+  cpu->retired++;
+  if (tracing) {
+    CPU_traceInstruction(cpu, ip, instruction);
+  }
+  return cpu->running;
+}
+
+bool CPU_step(CPU* cpu) {
+  return CPU_stepWith(cpu, false);
+}
+
+/*
+   Block cache
+
+   Straight-line runs of guest code are decoded once into BLOCKs keyed by
+   their start address. Each page remembers how many cached blocks touch
+   it; a write to such a page drops every block overlapping it, which keeps
+   self-modifying code correct.
+   */
+
+// Handlers which transfer control (or stop the cpu) end a block.
+static inline bool CPU_endsBlock(uint8_t kind) {
+  switch (kind) {
+    case H_JMP: case H_JMP_I: case H_BRCH:
+    case H_RET: case H_RETI: case H_HALT: case H_INVALID: case H_WAIT:
+      return true;
+  }
+  return false;
+}
+
+static inline uint16_t CPU_blockSlot(uint16_t ip) {
+  return (ip ^ (ip >> 8)) & (BLOCK_CACHE_SIZE - 1);
+}
+
+static void CPU_markBlockPages(CPU* cpu, BLOCK* block, int delta) {
+  uint8_t first = block->start >> 8;
+  uint8_t last = (uint16_t)(block->start + block->size - 1) >> 8;
+  cpu->codePages[first] += delta;
+  if (last != first) {
+    cpu->codePages[last] += delta;
+  }
+}
+
+static void CPU_dropBlock(CPU* cpu, BLOCK* block) {
+  if (block->valid) {
+    block->valid = false;
+    block->native = NULL;
+    CPU_markBlockPages(cpu, block, -1);
+  }
+}
+
+void CPU_invalidatePage(CPU* cpu, uint8_t page) {
+  for (int n = 0; n < BLOCK_CACHE_SIZE && cpu->codePages[page] != 0; n++) {
+    BLOCK* block = &cpu->blocks[n];
+    if (!block->valid) {
+      continue;
+    }
+    uint8_t first = block->start >> 8;
+    uint8_t last = (uint16_t)(block->start + block->size - 1) >> 8;
+    if (first == page || last == page) {
+      CPU_dropBlock(cpu, block);
+    }
+  }
+  cpu->yield = true;
+}
+
+// Drop every cached block, e.g. after the host rewrote guest memory.
+void CPU_invalidate(CPU* cpu) {
+  if (cpu->blocks == NULL) {
+    return;
+  }
+  for (int n = 0; n < BLOCK_CACHE_SIZE; n++) {
+    CPU_dropBlock(cpu, &cpu->blocks[n]);
+  }
+  cpu->yield = true;
+}
+
+// Points the first op of every superinstruction in `block` at it.
+static void CPU_fuseBlock(BLOCK* block) {
+  for (int n = 0; n < block->length; n++) {
+    DECODED* ops = &block->ops[n];
+    for (int f = 0; f < F_COUNT; f++) {
+      const uint8_t* pattern = CPU_fusedPatterns[f];
+      int length = pattern[2] == H_COUNT ? 2 : 3;
+      if (n + length <= block->length && ops[0].kind == pattern[0] && ops[1].kind == pattern[1]
+          && (length == 2 || ops[2].kind == pattern[2])) {
+        ops[0].entry = H_COUNT + 1 + f;
+        n += length - 1;
+        break;
+      }
+    }
+  }
+}
+
+// `labels` maps handler kinds, then H_COUNT + 1 + superinstructions, to
+// threaded-core labels (NULL when the threaded core dispatches through a
+// switch).
+static void CPU_decodeBlock(CPU* cpu, BLOCK* block, uint16_t ip, const void* const* labels) {
+  uint16_t pc = ip;
+  uint8_t length = 0;
+  while (length < BLOCK_MAX) {
+    DECODED* op = &block->ops[length++];
+    uint8_t instruction = CPU_load(cpu, pc++);
+    op->kind = CPU_decodeTable[instruction];
+    op->field = (instruction & 0x70) >> 4;
+    op->operand = 0;
+    if (CPU_handlerOperands[op->kind] == 1) {
+      op->operand = CPU_load(cpu, pc++);
+    } else if (CPU_handlerOperands[op->kind] == 2) {
+      uint8_t lo = CPU_load(cpu, pc++);
+      uint8_t hi = CPU_load(cpu, pc++);
+      op->operand = (hi << 8) | lo;
+    }
+    op->next = pc;
+    op->entry = op->kind;
+    if (CPU_endsBlock(op->kind)) {
+      break;
+    }
+  }
+
+  DECODED* sentinel = &block->ops[length];
+  sentinel->kind = H_COUNT;
+  sentinel->entry = H_COUNT;
+  block->length = length;
+  if (cpu->fuse) {
+    CPU_fuseBlock(block);
+  }
+  for (int n = 0; n <= length; n++) {
+    block->ops[n].handler = labels != NULL ? labels[block->ops[n].entry] : NULL;
+  }
+
+  block->start = ip;
+  block->size = (uint16_t)(pc - ip);
+  block->hits = 0;
+  block->native = NULL;
+  block->valid = true;
+  CPU_markBlockPages(cpu, block, 1);
+}
+
+static inline BLOCK* CPU_lookupBlock(CPU* cpu, uint16_t ip, const void* const* labels) {
+  BLOCK* block = &cpu->blocks[CPU_blockSlot(ip)];
+  if (block->valid && block->start == ip) {
+    return block;
+  }
+  CPU_dropBlock(cpu, block);
+  CPU_decodeBlock(cpu, block, ip, labels);
+  return block;
+}
+
+#if CPU_JIT
+#include "jit.c"
+#endif
+
+void CPU_unmapFrame(CPU* cpu, uint8_t page);
+
+void CPU_free(CPU* cpu) {
+#if CPU_JIT
+  JIT_free(cpu);
+#endif
+  for (int n = 0; n < PAGE_COUNT; n++) {
+    CPU_unmapFrame(cpu, n);
+  }
+  free(cpu->blocks);
+  cpu->blocks = NULL;
+  memset(cpu->codePages, 0, sizeof(cpu->codePages));
+  free(cpu->profile);
+  cpu->profile = NULL;
+}
+
+/*
+   Threaded core
+
+   Runs predecoded blocks. Each op carries the address of its handler
+   label, and each handler ends by jumping straight to the next op's
+   handler, so there is no central switch for the branch predictor to
+   choke on. Leaving a block (control transfer, interrupt, or a write to
+   cached code) goes back through the block lookup.
+   */
+
+#define X_LABEL(name, operands) [H_##name] = &&op_##name,
+#define X_CASE(name, operands) case H_##name: goto op_##name;
+#define X_FUSED_LABEL2(a, b) [H_COUNT + 1 + F_##a##_##b] = &&fused_##a##_##b,
+#define X_FUSED_LABEL3(a, b, c) [H_COUNT + 1 + F_##a##_##b##_##c] = &&fused_##a##_##b##_##c,
+#define X_FUSED_CASE2(a, b) case H_COUNT + 1 + F_##a##_##b: goto fused_##a##_##b;
+#define X_FUSED_CASE3(a, b, c) case H_COUNT + 1 + F_##a##_##b##_##c: goto fused_##a##_##b##_##c;
+
+#define X_HANDLER(name, operands) \
+  op_##name: \
+    cpu->ip = op->next; \
+    CPU_op##name(cpu, op->field, op->operand); \
+    cpu->retired++; \
+    op++; \
+    if (cpu->retired >= end || cpu->yield || CPU_interruptPending(cpu)) { \
+      goto lookup; \
+    } \
+    DISPATCH();
+
+// One instruction of a superinstruction, `n` into it.
+#define X_FUSED_STEP(name, n) \
+    cpu->ip = op[n].next; \
+    CPU_op##name(cpu, op[n].field, op[n].operand);
+
+// Leaves after the nth instruction if it could have been observed.
+#define X_FUSED_CHECK(name, n) \
+    if (CPU_fusedMayTrap(H_##name) && (cpu->yield || CPU_interruptPending(cpu))) { \
+      cpu->retired += n + 1; \
+      goto lookup; \
+    }
+
+// A superinstruction runs its first instruction alone when the budget
+// ends inside it.
+#define X_FUSED_END(fused, length) \
+    cpu->fusedRuns[fused]++; \
+    cpu->retired += length; \
+    op += length; \
+    if (cpu->retired >= end || cpu->yield || CPU_interruptPending(cpu)) { \
+      goto lookup; \
+    } \
+    DISPATCH();
+
+#define X_FUSED2(a, b) \
+  fused_##a##_##b: \
+    if (cpu->retired + 2 > end) { \
+      DISPATCH_KIND(); \
+    } \
+    X_FUSED_STEP(a, 0) \
+    X_FUSED_CHECK(a, 0) \
+    X_FUSED_STEP(b, 1) \
+    X_FUSED_END(F_##a##_##b, 2)
+
+#define X_FUSED3(a, b, c) \
+  fused_##a##_##b##_##c: \
+    if (cpu->retired + 3 > end) { \
+      DISPATCH_KIND(); \
+    } \
+    X_FUSED_STEP(a, 0) \
+    X_FUSED_CHECK(a, 0) \
+    X_FUSED_STEP(b, 1) \
+    X_FUSED_CHECK(b, 1) \
+    X_FUSED_STEP(c, 2) \
+    X_FUSED_END(F_##a##_##b##_##c, 3)
+
+// Runs until cpu->retired reaches `end`, the cpu stops, an I/O trap, or
+// an interrupt becoming pending. An interrupt already pending on entry is
+// serviced.
+EXIT CPU_runThreaded(CPU* cpu, uint64_t end) {
+  BLOCK* block;
+  const DECODED* op;
+  uint64_t start = cpu->retired;
+
+  if (cpu->blocks == NULL) {
+    cpu->blocks = calloc(BLOCK_CACHE_SIZE, sizeof(BLOCK));
+    memset(cpu->codePages, 0, sizeof(cpu->codePages));
+  }
+
+#if CPU_COMPUTED_GOTO
+  static const void* const labels[H_COUNT + 1 + F_COUNT] = {
+    CPU_HANDLERS(X_LABEL)
+    [H_COUNT] = &&block_end,
+    CPU_FUSIONS2(X_FUSED_LABEL2)
+    CPU_FUSIONS3(X_FUSED_LABEL3)
+  };
+#define DISPATCH() goto *op->handler
+#define DISPATCH_KIND() goto *labels[op->kind]
+#else
+  static const void* const* labels = NULL;
+  // Handlers can't expand CPU_HANDLERS again, so they jump to one switch.
+#define DISPATCH() goto dispatch
+#define DISPATCH_KIND() goto dispatchKind
+#endif
+
+lookup:
+  cpu->yield = false;
+  if (!cpu->running) {
+    return cpu->exit;
+  }
+  if (cpu->ioTrap) {
+    cpu->ioTrap = false;
+    return EXIT_IO;
+  }
+  if (cpu->waiting) {
+    return EXIT_WAIT;
+  }
+  if (cpu->retired >= end) {
+    return EXIT_BUDGET;
+  }
+  if (CPU_interruptPending(cpu)) {
+    if (cpu->retired != start) {
+      return EXIT_INTERRUPT;
+    }
+    CPU_serviceInterrupt(cpu);
+    cpu->yield = false;
+  }
+  block = CPU_lookupBlock(cpu, cpu->ip, labels);
+#if CPU_JIT
+  if (cpu->core == CORE_JIT && !CPU_interruptPending(cpu)) {
+    if (block->native != NULL && cpu->retired + block->nativeLength <= end) {
+      JIT_run(cpu, block);
+      goto lookup;
+    }
+    if (block->hits < JIT_THRESHOLD && ++block->hits == JIT_THRESHOLD) {
+      JIT_compile(cpu, block);
+    }
+  }
+#endif
+  op = block->ops;
+  DISPATCH();
+
+#if !CPU_COMPUTED_GOTO
+dispatch:
+  switch (op->entry) {
+    CPU_HANDLERS(X_CASE)
+    CPU_FUSIONS2(X_FUSED_CASE2)
+    CPU_FUSIONS3(X_FUSED_CASE3)
+    default: goto block_end;
+  }
+dispatchKind:
+  switch (op->kind) {
+    CPU_HANDLERS(X_CASE)
+    default: goto block_end;
+  }
+#endif
+
+  CPU_HANDLERS(X_HANDLER)
+  CPU_FUSIONS2(X_FUSED2)
+  CPU_FUSIONS3(X_FUSED3)
+
+block_end:
+  goto lookup;
+
+#undef DISPATCH
+#undef DISPATCH_KIND
+}
+
+#undef X_LABEL
+#undef X_CASE
+#undef X_HANDLER
+#undef X_FUSED_LABEL2
+#undef X_FUSED_LABEL3
+#undef X_FUSED_CASE2
+#undef X_FUSED_CASE3
+#undef X_FUSED_STEP
+#undef X_FUSED_CHECK
+#undef X_FUSED_END
+#undef X_FUSED2
+#undef X_FUSED3
+
+void CPU_setCore(CPU* cpu, CORE core) {
+  cpu->core = core;
+}
+
+// Turns superinstructions in the threaded and JIT cores on (the default)
+// or off, e.g. to measure what they buy.
+void CPU_setFusion(CPU* cpu, bool fuse) {
+  cpu->fuse = fuse;
+  CPU_invalidate(cpu);
+}
+
+/*
+   Idle loops
+
+   Guests that wait for an interrupt without WAIT spin, in a JMP to
+   itself or a short loop polling memory. With interrupts enabled,
+   CPU_runFor runs a slice CPU_IDLE_CHECK instructions at a time, and
+   before each steps through up to CPU_IDLE_SPAN which change nothing
+   but registers, flags and ip, and read only plain memory. Coming back
+   to a state it was already in, with interrupts enabled, the cpu would
+   go round the same loop until an interrupt, so it parks as on WAIT. A
+   service run wakes it as well, as it may have changed what the loop
+   reads.
+
+   Nothing is accounted up front. When the park ends, the time it lasted
+   is accounted at idleRate, in whole trips round the loop so that the
+   state is still the one the loop keeps coming back to; see
+   CPU_endIdleLoop.
+   */
+
+#define CPU_IDLE_SPAN 16
+// Instructions run between looks for an idle loop. It is also what an
+// interrupt costs a guest that idles in a loop: its handler runs in a
+// chunk like any other code, and the loop it returns to is only found
+// again at the start of the next, so up to CPU_IDLE_CHECK instructions
+// (some 50 us on the threaded core) are spun for real before the cpu
+// parks again.
+#define CPU_IDLE_CHECK (1 << 14)
+
+static uint64_t CPU_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+typedef struct {
+  uint8_t registers[8];
+  uint16_t ip;
+  uint8_t f;
+} IDLE_STATE;
+
+// Whether the instruction at ip leaves memory, the bus and the stack
+// alone, and reads nothing that traps.
+static bool CPU_sideEffectFree(CPU* cpu) {
+  const PAGE* page = &cpu->pages[cpu->ip >> 8];
+  if (page->read == NULL) {
+    return false;
+  }
+  uint8_t instruction = page->read[cpu->ip & 0xFF];
+  uint8_t kind = CPU_decodeTable[instruction];
+  uint8_t field = (instruction & 0x70) >> 4;
+  uint16_t operand = 0;
+  for (int n = 1; n <= CPU_handlerOperands[kind]; n++) {
+    uint16_t addr = cpu->ip + n;
+    if (cpu->pages[addr >> 8].read == NULL) {
+      return false;
+    }
+    operand |= cpu->pages[addr >> 8].read[addr & 0xFF] << (8 * (n - 1));
+  }
+  switch (kind) {
+    case H_NOOP: case H_SWAP: case H_CLF: case H_SEF:
+    case H_COPY_IN: case H_COPY_OUT: case H_INC: case H_DEC:
+    case H_RTL: case H_RTR: case H_SHL: case H_SHR:
+    case H_BRCH: case H_SET: case H_NOT: case H_XOR:
+    case H_AND: case H_OR: case H_ADD: case H_MUL:
+    case H_SUB: case H_CMP: case H_INC16: case H_DEC16:
+    case H_ADD16: case H_CMP16:
+      return true;
+    case H_JMP:
+    case H_JMP_I:
+      return (field & 0x4) == 0;
+    case H_LOAD_I:
+      return cpu->pages[operand >> 8].read != NULL;
+    case H_LOAD_R:
+      return cpu->pages[cpu->registers[(operand & 3) * 2 + 1]].read != NULL;
+    default:
+      return false;
+  }
+}
+
+// Runs the cpu into an idle loop, if it is in one, stepping no further
+// than `end`, and parks it there; see above.
+static bool CPU_idleLoop(CPU* cpu, uint64_t end) {
+  IDLE_STATE seen[CPU_IDLE_SPAN + 1];
+  for (int count = 0; ; count++) {
+    IDLE_STATE* state = &seen[count];
+    memcpy(state->registers, cpu->registers, sizeof(state->registers));
+    state->ip = cpu->ip;
+    state->f = CPU_flags(cpu);
+    for (int n = 0; n < count; n++) {
+      if (seen[n].ip == state->ip && seen[n].f == state->f
+          && memcmp(seen[n].registers, state->registers, sizeof(state->registers)) == 0) {
+        if ((state->f & FLAG_I) == 0) {
+          // Nothing can end it; leave that to the host.
+          return false;
+        }
+        cpu->idleLength = count - n;
+        cpu->idleSince = CPU_now();
+        cpu->waiting = true;
+        cpu->idleLoop = true;
+        return true;
+      }
+    }
+    if (count == CPU_IDLE_SPAN || cpu->retired >= end
+        || CPU_interruptPending(cpu) || !CPU_sideEffectFree(cpu)) {
+      return false;
+    }
+    CPU_stepWith(cpu, false);
+  }
+}
+
+// Unparks a cpu parked in an idle loop, accounting the trips round it
+// it would have made meanwhile.
+static void CPU_endIdleLoop(CPU* cpu) {
+  uint64_t parked = CPU_now() - cpu->idleSince;
+  // Whole seconds apart, so that a long park can't overflow.
+  uint64_t spun = parked / 1000000000ull * cpu->idleRate
+    + parked % 1000000000ull * cpu->idleRate / 1000000000ull;
+  uint64_t skipped = spun / cpu->idleLength * cpu->idleLength;
+  cpu->retired += skipped;
+  cpu->idleSkipped += skipped;
+  cpu->waiting = false;
+  cpu->idleLoop = false;
+}
+
+// Turns idle loop detection on (the default) or off.
+void CPU_setIdleDetection(CPU* cpu, bool detect) {
+  cpu->idleDetect = detect;
+}
+
+// Sets how many instructions a second a parked idle loop is accounted
+// at, CPU_IDLE_RATE by default; 0 accounts only what actually ran.
+void CPU_setIdleRate(CPU* cpu, uint64_t rate) {
+  cpu->idleRate = rate;
+}
+
+static inline EXIT CPU_runSwitchWith(CPU* cpu, uint64_t end, const bool instrumented) {
+  uint64_t start = cpu->retired;
+  while (cpu->running) {
+    if (cpu->retired >= end) {
+      return EXIT_BUDGET;
+    }
+    if (cpu->retired != start && CPU_interruptPending(cpu)) {
+      return EXIT_INTERRUPT;
+    }
+    CPU_stepWith(cpu, instrumented);
+    if (cpu->ioTrap) {
+      cpu->ioTrap = false;
+      return EXIT_IO;
+    }
+    if (cpu->waiting) {
+      return EXIT_WAIT;
+    }
+  }
+  return cpu->exit;
+}
+
+static EXIT CPU_runSwitch(CPU* cpu, uint64_t end) {
+  return CPU_runSwitchWith(cpu, end, false);
+}
+
+// A profiled or traced cpu always runs here, whatever its core.
+static EXIT CPU_runInstrumented(CPU* cpu, uint64_t end) {
+  return CPU_runSwitchWith(cpu, end, true);
+}
+
+/*
+   Runs at most `budget` instructions and says why it stopped. The number
+   of instructions retired is stored in `retired` if it isn't NULL. Hosts
+   can poll devices or switch between cpus between calls.
+   */
+static EXIT CPU_runCore(CPU* cpu, uint64_t end) {
+  switch (cpu->core) {
+    case CORE_THREADED:
+    case CORE_JIT:
+      return CPU_runThreaded(cpu, end);
+    case CORE_SWITCH:
+    default:
+      return CPU_runSwitch(cpu, end);
+  }
+}
+
+// Runs to `end`, looking for idle loops while interrupts are enabled.
+static EXIT CPU_runDetecting(CPU* cpu, uint64_t end) {
+  while (cpu->running && cpu->retired < end) {
+    if ((cpu->f & FLAG_I) && CPU_idleLoop(cpu, end)) {
+      return EXIT_WAIT;
+    }
+    // The JIT checks budgetEnd itself.
+    cpu->budgetEnd = end - cpu->retired > CPU_IDLE_CHECK ? cpu->retired + CPU_IDLE_CHECK : end;
+    EXIT exit = CPU_runCore(cpu, cpu->budgetEnd);
+    cpu->budgetEnd = end;
+    if (exit != EXIT_BUDGET) {
+      return exit;
+    }
+  }
+  return cpu->running ? EXIT_BUDGET : cpu->exit;
+}
+
+EXIT CPU_runFor(CPU* cpu, uint64_t budget, uint64_t* retired) {
+  EXIT exit;
+  cpu->ioTrap = false;
+  bool serviced = false;
+  if (atomic_load_explicit(&cpu->serviceRequests, memory_order_relaxed) != 0) {
+    CPU_runServices(cpu);
+    serviced = true;
+  }
+  if (cpu->waiting) {
+    if (atomic_load(&cpu->i) == 0 && cpu->running && !(serviced && cpu->idleLoop)) {
+      if (retired != NULL) {
+        *retired = 0;
+      }
+      return EXIT_WAIT;
+    }
+    if (cpu->idleLoop) {
+      // The park is accounted ahead of the slice, not in it.
+      CPU_endIdleLoop(cpu);
+    }
+    cpu->waiting = false;
+  }
+  uint64_t start = cpu->retired;
+  cpu->budgetEnd = budget > UINT64_MAX - start ? UINT64_MAX : start + budget;
+  if ((CPU_PROFILING && cpu->profile != NULL) || (CPU_TRACING && cpu->tracer != NULL)) {
+    exit = CPU_runInstrumented(cpu, cpu->budgetEnd);
+  } else if (cpu->idleDetect) {
+    exit = CPU_runDetecting(cpu, cpu->budgetEnd);
+  } else {
+    exit = CPU_runCore(cpu, cpu->budgetEnd);
+  }
+  if (retired != NULL) {
+    *retired = cpu->retired - start;
+  }
+  return exit;
+}
+
+#define CPU_RUN_SLICE (1 << 20)
+
+void CPU_run(CPU* cpu) {
+  while (cpu->running) {
+    if (CPU_runFor(cpu, CPU_RUN_SLICE, NULL) == EXIT_WAIT) {
+      CPU_idle(cpu);
+    }
+  }
+}
+
+// Makes every page trap to `callback`.
+void CPU_registerMemCallback(CPU* cpu, MEM_callback callback, void* ctx) {
+  cpu->memory = callback;
+  cpu->memoryCtx = ctx;
+  for (int n = 0; n < PAGE_COUNT; n++) {
+    CPU_unmapFrame(cpu, n);
+    cpu->pages[n].read = NULL;
+    cpu->pages[n].write = NULL;
+    cpu->pages[n].mmio = callback;
+    cpu->pages[n].ctx = ctx;
+  }
+}
+
+// Maps `length` bytes of host memory at guest address `addr`. Both must be
+// page aligned. Accesses the mode leaves out trap to the mem callback.
+void CPU_mapMemory(CPU* cpu, uint16_t addr, size_t length, uint8_t* host, PAGE_MODE mode) {
+  for (size_t offset = 0; offset < length; offset += PAGE_SIZE) {
+    PAGE* page = &cpu->pages[(addr + offset) >> 8];
+    CPU_unmapFrame(cpu, (addr + offset) >> 8);
+    page->read = (mode & PAGE_READ) ? host + offset : NULL;
+    page->write = (mode & PAGE_WRITE) ? host + offset : NULL;
+    page->mmio = cpu->memory;
+    page->ctx = cpu->memoryCtx;
+    if (cpu->codePages[(addr + offset) >> 8] != 0) {
+      CPU_invalidatePage(cpu, (addr + offset) >> 8);
+    }
+  }
+}
+
+// Maps `length` bytes of host memory at `addr` for reading, like
+// CPU_mapMemory, with writes trapping to `callback` instead.
+void CPU_mapReadOnly(CPU* cpu, uint16_t addr, size_t length, uint8_t* host,
+    MEM_callback callback, void* ctx) {
+  CPU_mapMemory(cpu, addr, length, host, PAGE_READ);
+  for (size_t offset = 0; offset < length; offset += PAGE_SIZE) {
+    cpu->pages[(addr + offset) >> 8].mmio = callback;
+    cpu->pages[(addr + offset) >> 8].ctx = ctx;
+  }
+}
+
+// Makes `length` bytes at guest address `addr` trap to `callback`.
+void CPU_mapMMIO(CPU* cpu, uint16_t addr, size_t length, MEM_callback callback, void* ctx) {
+  for (size_t offset = 0; offset < length; offset += PAGE_SIZE) {
+    PAGE* page = &cpu->pages[(addr + offset) >> 8];
+    CPU_unmapFrame(cpu, (addr + offset) >> 8);
+    page->read = NULL;
+    page->write = NULL;
+    page->mmio = callback;
+    page->ctx = ctx;
+    if (cpu->codePages[(addr + offset) >> 8] != 0) {
+      CPU_invalidatePage(cpu, (addr + offset) >> 8);
+    }
+  }
+}
+
+void CPU_registerBusCallback(CPU* cpu, uint8_t addr, BUS_callback callback, void* ctx) {
+  cpu->bus.callback[addr] = callback;
+  cpu->bus.ctx[addr] = ctx;
+}
+
+// I/O on a trapping port ends CPU_runFor with EXIT_IO once it completes.
+void CPU_trapBus(CPU* cpu, uint8_t addr, bool trap) {
+  cpu->bus.trap[addr] = trap;
+}
+
+// Host pointer to the `length` bytes at `addr`, which must not cross a
+// page, for a device moving a block on the cpu's thread. NULL when the
+// page traps, or the cpu is profiled or traced, and the device has to go
+// through CPU_read/CPU_write instead. Asking to write drops cached code on
+// the page and copies a shared frame.
+uint8_t* CPU_hostPointer(CPU* cpu, uint16_t addr, uint16_t length, bool write) {
+  if (!CPU_directRange(cpu, addr, length, write)) {
+    return NULL;
+  }
+  return write ? CPU_writePointer(cpu, addr) : cpu->pages[addr >> 8].read + (addr & 0xFF);
+}
+
+// Registers `callback` as a service and returns its id for
+// CPU_requestService, or -1 when all CPU_SERVICES are taken.
+int CPU_addService(CPU* cpu, SERVICE_callback callback, void* ctx) {
+  if (cpu->serviceCount == CPU_SERVICES) {
+    return -1;
+  }
+  cpu->services[cpu->serviceCount] = callback;
+  cpu->serviceCtx[cpu->serviceCount] = ctx;
+  return cpu->serviceCount++;
+}
+
+// Safe to call from any thread.
+void CPU_requestService(CPU* cpu, int id) {
+  atomic_fetch_or_explicit(&cpu->serviceRequests, 1 << id, memory_order_release);
+  CPU_wake(cpu);
+}
+
+// Runs every requested service. Only on the cpu's thread.
+void CPU_runServices(CPU* cpu) {
+  uint8_t requests = atomic_exchange_explicit(&cpu->serviceRequests, 0, memory_order_acquire);
+  for (int n = 0; requests != 0; n++, requests >>= 1) {
+    if (requests & 1) {
+      cpu->services[n](cpu->serviceCtx[n]);
+    }
+  }
+}
+
+/*
+   Frames and snapshots
+
+   A snapshot holds the registers, pending interrupts, bus bindings and
+   page table of a cpu, plus a reference on every frame it maps, so taking
+   one costs the same whatever the cpu has in memory. Restoring swaps the
+   frames back in and so only has to copy pages that get written again.
+   Pages mapped to host memory or MMIO are recorded as mappings only:
+   their contents, like device state, belong to the host.
+   */
+
+typedef struct SNAPSHOT_t {
+  uint8_t registers[8];
+  uint16_t ip;
+  uint8_t f;
+  uint8_t i;
+  uint8_t held;
+  uint8_t interruptMask;
+  uint8_t vectors;
+  uint8_t priorities[CPU_LINES];
+  uint8_t lineOrder[CPU_LINES];
+  bool running;
+  bool waiting;
+  EXIT exit;
+  uint64_t retired;
+  BUS bus;
+  MEM_callback memory;
+  void* memoryCtx;
+  PAGE pages[PAGE_COUNT];
+  FRAME* frames[PAGE_COUNT];
+  uint8_t frameModes[PAGE_COUNT];
+} SNAPSHOT;
+
+static FRAME CPU_zeroFrame; // never written, never freed
+
+/*
+   Frame pool
+
+   Frames come from CPU_SLAB_SIZE slabs mapped from the OS rather than a
+   malloc each, and a slab's frames are only touched once handed out. A
+   thread keeps up to CPU_FRAME_CACHE free frames of its own and trades
+   them with the shared pool CPU_FRAME_BATCH at a time, under
+   CPU_poolLock. A slab whose frames have all come back is unmapped,
+   unless no other slab has room, so memory goes back to the OS as
+   machines are freed. Frames in use are counted per thread too, and
+   added up whenever the thread takes the lock anyway.
+   */
+
+#define CPU_SLAB_SIZE (64 * 1024)
+#define CPU_FRAME_CACHE 64
+#define CPU_FRAME_BATCH 32
+
+typedef struct SLAB_t {
+  struct SLAB_t* prev; // in CPU_partialSlabs
+  struct SLAB_t* next;
+  FRAME* free; // frames given back
+  uint32_t carved; // frames ever handed out; the rest were never touched
+  uint32_t used; // frames handed out and not given back
+} SLAB;
+
+#define CPU_SLAB_FRAMES ((CPU_SLAB_SIZE - sizeof(SLAB)) / sizeof(FRAME))
+
+static pthread_mutex_t CPU_poolLock = PTHREAD_MUTEX_INITIALIZER;
+static SLAB* CPU_partialSlabs; // slabs with frames to hand out
+static size_t CPU_slabCount;
+static size_t CPU_frameCount; // in use, but for the threads' CPU_framesTaken
+static _Thread_local FRAME* CPU_frameCache[CPU_FRAME_CACHE];
+static _Thread_local int CPU_framesCached;
+static _Thread_local long CPU_framesTaken; // allocated less freed since the lock
+static _Thread_local bool CPU_cacheRegistered;
+static pthread_key_t CPU_cacheKey;
+static pthread_once_t CPU_cacheOnce = PTHREAD_ONCE_INIT;
+
+static inline SLAB* CPU_slabOf(FRAME* frame) {
+  return (SLAB*)((uintptr_t)frame & ~(uintptr_t)(CPU_SLAB_SIZE - 1));
+}
+
+static void CPU_linkSlab(SLAB* slab) {
+  slab->prev = NULL;
+  slab->next = CPU_partialSlabs;
+  if (slab->next != NULL) {
+    slab->next->prev = slab;
+  }
+  CPU_partialSlabs = slab;
+}
+
+static void CPU_unlinkSlab(SLAB* slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    CPU_partialSlabs = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+// A slab aligned to its size, so frames find it from their address.
+static SLAB* CPU_mapSlab(void) {
+  uint8_t* map = mmap(NULL, 2 * CPU_SLAB_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  uint8_t* slab = (uint8_t*)(((uintptr_t)map + CPU_SLAB_SIZE - 1) & ~(uintptr_t)(CPU_SLAB_SIZE - 1));
+  if (slab > map) {
+    munmap(map, slab - map);
+  }
+  if (slab + CPU_SLAB_SIZE < map + 2 * CPU_SLAB_SIZE) {
+    munmap(slab + CPU_SLAB_SIZE, map + 2 * CPU_SLAB_SIZE - (slab + CPU_SLAB_SIZE));
+  }
+  CPU_slabCount++;
+  return (SLAB*)slab; // zeroed by the OS
+}
+
+// Gives the calling thread's cached frames back down to `keep`.
+static void CPU_drainFrames(int keep) {
+  pthread_mutex_lock(&CPU_poolLock);
+  CPU_frameCount += CPU_framesTaken;
+  CPU_framesTaken = 0;
+  while (CPU_framesCached > keep) {
+    FRAME* frame = CPU_frameCache[--CPU_framesCached];
+    SLAB* slab = CPU_slabOf(frame);
+    if (slab->free == NULL && slab->carved == CPU_SLAB_FRAMES) {
+      CPU_linkSlab(slab);
+    }
+    frame->next = slab->free;
+    slab->free = frame;
+    slab->used--;
+    if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+      CPU_unlinkSlab(slab);
+      munmap(slab, CPU_SLAB_SIZE);
+      CPU_slabCount--;
+    }
+  }
+  pthread_mutex_unlock(&CPU_poolLock);
+}
+
+static void CPU_cacheExit(void* unused) {
+  CPU_drainFrames(0);
+}
+
+static void CPU_cacheKeyCreate(void) {
+  pthread_key_create(&CPU_cacheKey, CPU_cacheExit);
+}
+
+// Hands the cache back when the thread exits.
+static void CPU_registerCache(void) {
+  pthread_once(&CPU_cacheOnce, CPU_cacheKeyCreate);
+  pthread_setspecific(CPU_cacheKey, &CPU_cacheRegistered);
+  CPU_cacheRegistered = true;
+}
+
+static void CPU_fillFrames(void) {
+  if (!CPU_cacheRegistered) {
+    CPU_registerCache();
+  }
+  pthread_mutex_lock(&CPU_poolLock);
+  CPU_frameCount += CPU_framesTaken;
+  CPU_framesTaken = 0;
+  while (CPU_framesCached < CPU_FRAME_BATCH) {
+    SLAB* slab = CPU_partialSlabs;
+    if (slab == NULL) {
+      slab = CPU_mapSlab();
+      if (slab == NULL) {
+        break;
+      }
+      CPU_linkSlab(slab);
+    }
+    FRAME* frame = slab->free;
+    if (frame != NULL) {
+      slab->free = frame->next;
+    } else {
+      frame = (FRAME*)(slab + 1) + slab->carved++;
+    }
+    slab->used++;
+    if (slab->free == NULL && slab->carved == CPU_SLAB_FRAMES) {
+      CPU_unlinkSlab(slab);
+    }
+    CPU_frameCache[CPU_framesCached++] = frame;
+  }
+  pthread_mutex_unlock(&CPU_poolLock);
+}
+
+// An uninitialised frame.
+static FRAME* CPU_allocFrame(void) {
+  if (CPU_framesCached == 0) {
+    CPU_fillFrames();
+    if (CPU_framesCached == 0) {
+      perror("irx: frame");
+      abort();
+    }
+  }
+  CPU_framesTaken++;
+  return CPU_frameCache[--CPU_framesCached];
+}
+
+static void CPU_freeFrame(FRAME* frame) {
+  if (!CPU_cacheRegistered) {
+    CPU_registerCache();
+  }
+  CPU_framesTaken--;
+  if (CPU_framesCached == CPU_FRAME_CACHE) {
+    CPU_drainFrames(CPU_FRAME_CACHE - CPU_FRAME_BATCH);
+  }
+  CPU_frameCache[CPU_framesCached++] = frame;
+}
+
+// Slabs mapped for frames, CPU_SLAB_SIZE bytes each.
+size_t CPU_slabsInUse(void) {
+  pthread_mutex_lock(&CPU_poolLock);
+  size_t count = CPU_slabCount;
+  pthread_mutex_unlock(&CPU_poolLock);
+  return count;
+}
+
+/*
+   Shared frames
+
+   CPU_shareFrame maps a page to the one frame holding its contents,
+   found in a hash table of every shared frame in the process, so
+   machines loading the same program share its pages until they write to
+   them. A shared frame leaves the table when its last reference goes;
+   that and finding it both happen under CPU_sharedLock, so a frame on
+   its way out is never handed out again.
+   */
+
+#define CPU_SHARED_BUCKETS 4096
+
+static FRAME* CPU_sharedFrames[CPU_SHARED_BUCKETS];
+static pthread_mutex_t CPU_sharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline FRAME* CPU_retainFrame(FRAME* frame) {
+  if (frame != &CPU_zeroFrame) {
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+  }
+  return frame;
+}
+
+static void CPU_releaseShared(FRAME* frame) {
+  uint32_t refs = atomic_load(&frame->refs);
+  while (refs > 1) {
+    if (atomic_compare_exchange_weak(&frame->refs, &refs, refs - 1)) {
+      return;
+    }
+  }
+  pthread_mutex_lock(&CPU_sharedLock);
+  if (atomic_fetch_sub(&frame->refs, 1) == 1) {
+    FRAME** link = &CPU_sharedFrames[frame->hash % CPU_SHARED_BUCKETS];
+    while (*link != frame) {
+      link = &(*link)->next;
+    }
+    *link = frame->next;
+    CPU_freeFrame(frame);
+  }
+  pthread_mutex_unlock(&CPU_sharedLock);
+}
+
+static inline void CPU_releaseFrame(FRAME* frame) {
+  if (frame == &CPU_zeroFrame) {
+    return;
+  }
+  if (frame->shared) {
+    CPU_releaseShared(frame);
+  } else if (atomic_fetch_sub(&frame->refs, 1) == 1) {
+    CPU_freeFrame(frame);
+  }
+}
+
+// Frames allocated by all cpus in the process and still referenced, as
+// far as other running threads have told the pool.
+size_t CPU_framesInUse(void) {
+  pthread_mutex_lock(&CPU_poolLock);
+  CPU_frameCount += CPU_framesTaken;
+  CPU_framesTaken = 0;
+  size_t count = CPU_frameCount;
+  pthread_mutex_unlock(&CPU_poolLock);
+  return count;
+}
+
+void CPU_unmapFrame(CPU* cpu, uint8_t page) {
+  if (cpu->frames[page] != NULL) {
+    CPU_releaseFrame(cpu->frames[page]);
+    cpu->frames[page] = NULL;
+    cpu->frameModes[page] = 0;
+  }
+}
+
+// Points `page` at `frame`. The write pointer is only set while the cpu
+// holds the sole reference.
+static void CPU_setFrame(CPU* cpu, uint8_t page, FRAME* frame, uint8_t mode) {
+  cpu->frames[page] = frame;
+  cpu->frameModes[page] = mode;
+  cpu->pages[page].read = (mode & PAGE_READ) ? frame->data : NULL;
+  cpu->pages[page].write = (mode & PAGE_WRITE) && frame != &CPU_zeroFrame
+    && !frame->shared && atomic_load(&frame->refs) == 1 ? frame->data : NULL;
+  cpu->pages[page].mmio = cpu->memory;
+  cpu->pages[page].ctx = cpu->memoryCtx;
+}
+
+// Maps `length` bytes of zeroed, cpu-owned memory at guest address
+// `addr`, which must be page aligned. Accesses the mode leaves out trap
+// to the mem callback.
+void CPU_mapFrames(CPU* cpu, uint16_t addr, size_t length, PAGE_MODE mode) {
+  for (size_t offset = 0; offset < length; offset += PAGE_SIZE) {
+    uint8_t page = (addr + offset) >> 8;
+    CPU_unmapFrame(cpu, page);
+    CPU_setFrame(cpu, page, &CPU_zeroFrame, mode);
+    if (cpu->codePages[page] != 0) {
+      CPU_invalidatePage(cpu, page);
+    }
+  }
+}
+
+// Maps `page`, which must already hold a frame, to the shared frame with
+// the PAGE_SIZE bytes at `data`, keeping its mode. Writes to it copy the
+// frame first, like writes to any shared frame.
+void CPU_shareFrame(CPU* cpu, uint8_t page, const uint8_t* data) {
+  uint8_t mode = cpu->frameModes[page];
+  FRAME* frame = &CPU_zeroFrame;
+  uint32_t hash = 2166136261u; // FNV-1a
+  bool zero = true;
+  for (int n = 0; n < PAGE_SIZE; n++) {
+    hash = (hash ^ data[n]) * 16777619u;
+    zero = zero && data[n] == 0;
+  }
+  if (!zero) {
+    pthread_mutex_lock(&CPU_sharedLock);
+    FRAME** bucket = &CPU_sharedFrames[hash % CPU_SHARED_BUCKETS];
+    for (frame = *bucket; frame != NULL; frame = frame->next) {
+      if (frame->hash == hash && memcmp(frame->data, data, PAGE_SIZE) == 0) {
+        break;
+      }
+    }
+    if (frame != NULL) {
+      CPU_retainFrame(frame);
+    } else {
+      frame = CPU_allocFrame();
+      atomic_init(&frame->refs, 1);
+      frame->hash = hash;
+      frame->shared = true;
+      memcpy(frame->data, data, PAGE_SIZE);
+      frame->next = *bucket;
+      *bucket = frame;
+    }
+    pthread_mutex_unlock(&CPU_sharedLock);
+  }
+  CPU_unmapFrame(cpu, page);
+  CPU_setFrame(cpu, page, frame, mode);
+  if (cpu->codePages[page] != 0) {
+    CPU_invalidatePage(cpu, page);
+  }
+}
+
+// The host-writable data of `page`, copying its frame first if it is
+// shared. Writing through it bypasses the block cache, so call
+// CPU_invalidatePage for pages that may hold code. NULL for a page
+// with neither a frame nor a write pointer.
+uint8_t* CPU_pageForWrite(CPU* cpu, uint8_t page) {
+  FRAME* frame = cpu->frames[page];
+  if (frame == NULL) {
+    return cpu->pages[page].write;
+  }
+  if (frame == &CPU_zeroFrame || frame->shared || atomic_load(&frame->refs) != 1) {
+    FRAME* copy = CPU_allocFrame();
+    atomic_init(&copy->refs, 1);
+    copy->shared = false;
+    memcpy(copy->data, frame->data, PAGE_SIZE);
+    CPU_releaseFrame(frame);
+    frame = copy;
+  }
+  CPU_setFrame(cpu, page, frame, cpu->frameModes[page]);
+  return frame->data;
+}
+
+// Captures `cpu` into `snapshot`; release it with CPU_freeSnapshot. The
+// cpu must not be running on another thread.
+void CPU_snapshot(CPU* cpu, SNAPSHOT* snapshot) {
+  memcpy(snapshot->registers, cpu->registers, sizeof(snapshot->registers));
+  snapshot->ip = cpu->ip;
+  snapshot->f = CPU_flags(cpu);
+  snapshot->i = atomic_load(&cpu->i);
+  snapshot->held = atomic_load(&cpu->held);
+  snapshot->interruptMask = atomic_load(&cpu->interruptMask);
+  snapshot->vectors = cpu->vectors;
+  memcpy(snapshot->priorities, cpu->priorities, sizeof(snapshot->priorities));
+  memcpy(snapshot->lineOrder, cpu->lineOrder, sizeof(snapshot->lineOrder));
+  snapshot->running = cpu->running;
+  snapshot->waiting = cpu->waiting;
+  snapshot->exit = cpu->exit;
+  snapshot->retired = cpu->retired;
+  snapshot->bus = cpu->bus;
+  snapshot->memory = cpu->memory;
+  snapshot->memoryCtx = cpu->memoryCtx;
+  memcpy(snapshot->pages, cpu->pages, sizeof(snapshot->pages));
+  memcpy(snapshot->frameModes, cpu->frameModes, sizeof(snapshot->frameModes));
+  for (int n = 0; n < PAGE_COUNT; n++) {
+    snapshot->frames[n] = NULL;
+    if (cpu->frames[n] != NULL) {
+      // Shared from now on, so the cpu's next write to it copies.
+      snapshot->frames[n] = CPU_retainFrame(cpu->frames[n]);
+      cpu->pages[n].write = NULL;
+    }
+  }
+}
+
+// Puts `cpu` back in the state `snapshot` captured. The cpu may be another
+// one than the snapshot was taken from, to fork it; pages that trapped to
+// the snapshot's mem callback then trap to this cpu's. The cpu must not
+// be running on another thread.
+void CPU_restore(CPU* cpu, const SNAPSHOT* snapshot) {
+  memcpy(cpu->registers, snapshot->registers, sizeof(cpu->registers));
+  cpu->ip = snapshot->ip;
+  CPU_setFlags(cpu, snapshot->f);
+  atomic_store(&cpu->i, snapshot->i);
+  atomic_store(&cpu->held, snapshot->held);
+  atomic_store(&cpu->interruptMask, snapshot->interruptMask);
+  cpu->vectors = snapshot->vectors;
+  memcpy(cpu->priorities, snapshot->priorities, sizeof(cpu->priorities));
+  memcpy(cpu->lineOrder, snapshot->lineOrder, sizeof(cpu->lineOrder));
+  cpu->running = snapshot->running;
+  cpu->waiting = snapshot->waiting;
+  cpu->exit = snapshot->exit;
+  cpu->retired = snapshot->retired;
+  cpu->ioTrap = false;
+  cpu->bus = snapshot->bus;
+  for (int n = 0; n < PAGE_COUNT; n++) {
+    FRAME* frame = snapshot->frames[n];
+    if (frame != NULL && frame == cpu->frames[n]
+        && snapshot->frameModes[n] == cpu->frameModes[n]) {
+      // Not written since: still shared with the snapshot.
+      continue;
+    }
+    CPU_unmapFrame(cpu, n);
+    if (frame != NULL) {
+      CPU_setFrame(cpu, n, CPU_retainFrame(frame), snapshot->frameModes[n]);
+    } else {
+      cpu->pages[n] = snapshot->pages[n];
+    }
+    if (cpu->pages[n].mmio == snapshot->memory && cpu->pages[n].ctx == snapshot->memoryCtx) {
+      cpu->pages[n].mmio = cpu->memory;
+      cpu->pages[n].ctx = cpu->memoryCtx;
+    }
+  }
+  CPU_invalidate(cpu);
+}
+
+void CPU_freeSnapshot(SNAPSHOT* snapshot) {
+  for (int n = 0; n < PAGE_COUNT; n++) {
+    if (snapshot->frames[n] != NULL) {
+      CPU_releaseFrame(snapshot->frames[n]);
+      snapshot->frames[n] = NULL;
+    }
+  }
+}
+
+/*
+   Idling
+
+   A thread parked in CPU_idle sleeps on the `wakeups` futex word. Wakers
+   bump it and only make the wake syscall when someone is sleeping.
+   */
+
+void CPU_wake(CPU* cpu) {
+  atomic_fetch_add(&cpu->wakeups, 1);
+  if (atomic_load(&cpu->sleeping)) {
+#ifdef __linux__
+    syscall(SYS_futex, &cpu->wakeups, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#endif
+  }
+  if (cpu->wakeHook != NULL) {
+    cpu->wakeHook(cpu->wakeCtx);
+  }
+}
+
+// Lets a host that does not block in CPU_idle, like a scheduler that
+// parks cpus on EXIT_WAIT, learn about interrupts and stops. The hook
+// runs on the raising thread, after everything else CPU_wake does.
+void CPU_setWakeHook(CPU* cpu, void (*hook)(void* ctx), void* ctx) {
+  cpu->wakeHook = hook;
+  cpu->wakeCtx = ctx;
+}
+
+// Blocks the calling thread until an interrupt is raised or the cpu stops.
+// Services requested meanwhile run here, on the cpu's thread; they end
+// the wait of a cpu parked in an idle loop.
+void CPU_idle(CPU* cpu) {
+  atomic_store(&cpu->sleeping, true);
+  while (cpu->running && atomic_load(&cpu->i) == 0) {
+    uint32_t seen = atomic_load(&cpu->wakeups);
+    if (atomic_load_explicit(&cpu->serviceRequests, memory_order_relaxed) != 0) {
+      CPU_runServices(cpu);
+      if (cpu->idleLoop) {
+        // The loop may see what the service did.
+        CPU_endIdleLoop(cpu);
+        break;
+      }
+      continue;
+    }
+    if (!cpu->running || atomic_load(&cpu->i) != 0) {
+      break;
+    }
+#ifdef __linux__
+    syscall(SYS_futex, &cpu->wakeups, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+    (void)seen;
+    sched_yield();
+#endif
+  }
+  atomic_store(&cpu->sleeping, false);
+}
+
+// Stops the cpu from any thread, waking it if it is idle.
+void CPU_stop(CPU* cpu) {
+  cpu->running = false;
+  CPU_wake(cpu);
+}
+
+// Moves the held `lines` back to pending, returning whether there were any.
+static bool CPU_releaseLines(CPU* cpu, uint8_t lines) {
+  uint8_t released = atomic_fetch_and(&cpu->held, ~lines) & lines;
+  if (released == 0) {
+    return false;
+  }
+  atomic_fetch_or_explicit(&cpu->i, released, memory_order_release);
+  return true;
+}
+
+// Raises interrupt `line`, 0 to CPU_LINES - 1. Safe to call from any
+// thread, and lock-free. Data a device publishes before raising the
+// interrupt is visible to the handler.
+void CPU_raiseInterrupt(CPU* cpu, uint8_t line) {
+  uint8_t bit = 1 << (line % CPU_LINES);
+  if (atomic_load(&cpu->interruptMask) & bit) {
+    atomic_fetch_or(&cpu->held, bit);
+    // Unmasked meanwhile, maybe before the cpu could see it held.
+    if ((atomic_load(&cpu->interruptMask) & bit) || !CPU_releaseLines(cpu, bit)) {
+      return;
+    }
+  } else {
+    atomic_fetch_or_explicit(&cpu->i, bit, memory_order_release);
+  }
+  CPU_wake(cpu);
+}
+
+// Lines raised and not yet serviced or acknowledged, masked ones too.
+uint8_t CPU_pendingInterrupts(CPU* cpu) {
+  return atomic_load(&cpu->i) | atomic_load(&cpu->held);
+}
+
+// The interrupt controller's settings, only changed on the cpu's thread.
+
+// Drops `lines` without servicing them.
+void CPU_acknowledgeInterrupts(CPU* cpu, uint8_t lines) {
+  atomic_fetch_and(&cpu->i, ~lines);
+  atomic_fetch_and(&cpu->held, ~lines);
+}
+
+// Holds back the lines whose bits are set in `mask`.
+void CPU_setInterruptMask(CPU* cpu, uint8_t mask) {
+  atomic_store(&cpu->interruptMask, mask);
+  uint8_t masked = atomic_fetch_and(&cpu->i, ~mask) & mask;
+  if (masked != 0) {
+    atomic_fetch_or(&cpu->held, masked);
+  }
+  CPU_releaseLines(cpu, ~mask);
+}
+
+// Services pending lines with the higher `priority` first.
+void CPU_setInterruptPriority(CPU* cpu, uint8_t line, uint8_t priority) {
+  cpu->priorities[line % CPU_LINES] = priority;
+  for (int n = 0; n < CPU_LINES; n++) {
+    // Insertion sort, stable so ties go to the lower line.
+    int at = n;
+    while (at > 0 && cpu->priorities[cpu->lineOrder[at - 1]] < cpu->priorities[n]) {
+      cpu->lineOrder[at] = cpu->lineOrder[at - 1];
+      at--;
+    }
+    cpu->lineOrder[at] = n;
+  }
+}
+
+// Vectors each line through the table at `table` in page 0, or all of
+// them through 0x02 when it is 0.
+void CPU_setInterruptVectors(CPU* cpu, uint8_t table) {
+  cpu->vectors = table;
 }
 
 void CPU_dump(CPU* cpu) {
@@ -703,6 +2932,7 @@ void CPU_dump(CPU* cpu) {
   printf("Running: %s\n", cpu->running ? "true" : "false");
   printf("IP: 0x%04X\n", cpu->ip);
   printf("SP: 0x%04X\n", cpu->sp);
+  CPU_flags(cpu);
   printf("E: 0x%02X\t F: 0x%02X\n", cpu->e, cpu->f);
 
   printf("C:%i  Z:%i  I:%i  U2: %i\n", (cpu->f & FLAG_C) != 0, (cpu->f & FLAG_Z) != 0, (cpu->f & FLAG_I) != 0, (cpu->f & FLAG_U2) != 0);
@@ -717,5 +2947,137 @@ void CPU_dump(CPU* cpu) {
   printf("G: 0x%02X\n", cpu->g);
   printf("H: 0x%02X\n", cpu->h);
   printf("\n");
+  printf("Retired: %llu\n", (unsigned long long)cpu->retired);
+  printf("Idle skipped: %llu\n", (unsigned long long)cpu->idleSkipped);
   printf("--------------------------\n");
 }
+
+/*
+   Starts counting into a fresh profile, or restarts the current one.
+   Returns false in builds without CPU_PROFILE, or if out of memory.
+   While profiling the cpu runs on the switch core, whichever core is set.
+   */
+bool CPU_enableProfile(CPU* cpu) {
+  if (!CPU_PROFILING) {
+    return false;
+  }
+  if (cpu->profile == NULL) {
+    cpu->profile = calloc(1, sizeof(PROFILE));
+    return cpu->profile != NULL;
+  }
+  memset(cpu->profile, 0, sizeof(PROFILE));
+  return true;
+}
+
+static void CPU_dumpProfileCSV(const PROFILE* profile, FILE* out) {
+  fprintf(out, "counter,key,handler,field,count,taken\n");
+  for (int n = 0; n < 256; n++) {
+    if (profile->opcodes[n] != 0) {
+      fprintf(out, "opcode,0x%02X,%s,%i,%llu,\n", n, CPU_handlerNames[CPU_decodeTable[n]],
+          (n & 0x70) >> 4, (unsigned long long)profile->opcodes[n]);
+    }
+  }
+  for (int n = 0; n < 0x10000; n++) {
+    if (profile->ips[n] == 0) {
+      continue;
+    }
+    uint8_t instruction = profile->instructions[n];
+    fprintf(out, "ip,0x%04X,%s,%i,%llu,", n, CPU_handlerNames[CPU_decodeTable[instruction]],
+        (instruction & 0x70) >> 4, (unsigned long long)profile->ips[n]);
+    if (CPU_decodeTable[instruction] == H_BRCH) {
+      fprintf(out, "%llu", (unsigned long long)profile->taken[n]);
+    }
+    fprintf(out, "\n");
+  }
+  const char* names[] = { "read", "write", "in", "out" };
+  const uint64_t* counters[] = { profile->reads, profile->writes, profile->dataIn, profile->dataOut };
+  for (int c = 0; c < 4; c++) {
+    for (int n = 0; n < 256; n++) {
+      if (counters[c][n] != 0) {
+        fprintf(out, "%s,0x%02X,,,%llu,\n", names[c], n, (unsigned long long)counters[c][n]);
+      }
+    }
+  }
+}
+
+static void CPU_dumpProfileJSON(const PROFILE* profile, FILE* out) {
+  uint64_t retired = 0;
+  for (int n = 0; n < 256; n++) {
+    retired += profile->opcodes[n];
+  }
+  fprintf(out, "{\n  \"retired\": %llu,\n  \"opcodes\": [", (unsigned long long)retired);
+  const char* separator = "\n";
+  for (int n = 0; n < 256; n++) {
+    if (profile->opcodes[n] != 0) {
+      fprintf(out, "%s    {\"byte\": %i, \"handler\": \"%s\", \"field\": %i, \"count\": %llu}",
+          separator, n, CPU_handlerNames[CPU_decodeTable[n]], (n & 0x70) >> 4,
+          (unsigned long long)profile->opcodes[n]);
+      separator = ",\n";
+    }
+  }
+  fprintf(out, "\n  ],\n  \"ips\": [");
+  separator = "\n";
+  for (int n = 0; n < 0x10000; n++) {
+    if (profile->ips[n] != 0) {
+      fprintf(out, "%s    {\"ip\": %i, \"handler\": \"%s\", \"count\": %llu}", separator, n,
+          CPU_handlerNames[CPU_decodeTable[profile->instructions[n]]],
+          (unsigned long long)profile->ips[n]);
+      separator = ",\n";
+    }
+  }
+  fprintf(out, "\n  ],\n  \"branches\": [");
+  separator = "\n";
+  for (int n = 0; n < 0x10000; n++) {
+    if (profile->ips[n] != 0 && CPU_decodeTable[profile->instructions[n]] == H_BRCH) {
+      fprintf(out, "%s    {\"ip\": %i, \"field\": %i, \"taken\": %llu, \"notTaken\": %llu}",
+          separator, n, (profile->instructions[n] & 0x70) >> 4,
+          (unsigned long long)profile->taken[n],
+          (unsigned long long)(profile->ips[n] - profile->taken[n]));
+      separator = ",\n";
+    }
+  }
+  fprintf(out, "\n  ],\n  \"pages\": [");
+  separator = "\n";
+  for (int n = 0; n < PAGE_COUNT; n++) {
+    if (profile->reads[n] != 0 || profile->writes[n] != 0) {
+      fprintf(out, "%s    {\"page\": %i, \"reads\": %llu, \"writes\": %llu}", separator, n,
+          (unsigned long long)profile->reads[n], (unsigned long long)profile->writes[n]);
+      separator = ",\n";
+    }
+  }
+  fprintf(out, "\n  ],\n  \"ports\": [");
+  separator = "\n";
+  for (int n = 0; n < 256; n++) {
+    if (profile->dataIn[n] != 0 || profile->dataOut[n] != 0) {
+      fprintf(out, "%s    {\"port\": %i, \"in\": %llu, \"out\": %llu}", separator, n,
+          (unsigned long long)profile->dataIn[n], (unsigned long long)profile->dataOut[n]);
+      separator = ",\n";
+    }
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+// Writes the counters gathered since CPU_enableProfile. Only addresses,
+// pages and ports which were used are listed.
+bool CPU_dumpProfile(CPU* cpu, FILE* out, PROFILE_FORMAT format) {
+  if (cpu->profile == NULL) {
+    return false;
+  }
+  if (format == PROFILE_JSON) {
+    CPU_dumpProfileJSON(cpu->profile, out);
+  } else {
+    CPU_dumpProfileCSV(cpu->profile, out);
+  }
+  return true;
+}
+
+// Starts handing a TRACE_RECORD per instruction to `tracer`, or stops
+// with NULL. Returns false in builds without CPU_TRACE. Like profiling,
+// tracing runs the cpu on the switch core.
+bool CPU_setTracer(CPU* cpu, TRACER* tracer) {
+  if (!CPU_TRACING) {
+    return false;
+  }
+  cpu->tracer = tracer;
+  return true;
+}
@@ -0,0 +1,201 @@
+#include <stdatomic.h>
+
+/*
+   irx DMA channel
+   Lets a device move whole blocks between itself and guest memory, where
+   DATA_IN/DATA_OUT move one byte per instruction. A channel takes
+   DMA_PORTS consecutive bus ports from `port`:
+
+     port + 0  address, low byte
+     port + 1  address, high byte
+     port + 2  length, low byte
+     port + 3  length, high byte
+     port + 4  DATA_OUT issues a command, DATA_IN reads the status
+
+   DMA_IN fills `length` bytes from `address` with input from the device,
+   DMA_OUT hands them to the device, and DMA_STOP abandons the transfer.
+   Address and length count along as bytes move and read back through
+   their ports, so a stopped transfer shows how far it got. The status is
+   DMA_BUSY until the last byte has moved, then DMA_DONE, and finishing
+   raises interrupt `line`. A DMA_IN also finishes, as DMA_END, when the
+   device's input ends first; the address then says how much came in.
+
+   Guest memory is only touched on the cpu's thread: a transfer moves as
+   much as the device can take or give when it is issued, and the rest
+   from a cpu service each time the device calls DMA_ready.
+   */
+
+#define DMA_PORTS 5
+
+typedef enum {
+  DMA_STOP = 0,
+  DMA_IN = 1,
+  DMA_OUT = 2,
+} DMA_COMMAND;
+
+typedef enum {
+  DMA_IDLE = 0,
+  DMA_BUSY = 1,
+  DMA_DONE = 2,
+  DMA_END = 3, // input ended before the length was reached
+} DMA_STATUS;
+
+// Moves up to `length` bytes between the device and `data` and returns
+// how many moved. READ fills `data`, WRITE consumes it.
+typedef size_t (*DMA_callback)(void* ctx, enum DIRECTION dir, uint8_t* data, size_t length);
+
+struct DMA_t;
+
+typedef struct DMA_PORT_t {
+  struct DMA_t* dma;
+  uint8_t index; // port - dma->port
+} DMA_PORT;
+
+typedef struct DMA_t {
+  CPU* cpu;
+  DMA_callback callback;
+  void* ctx;
+  uint8_t port;
+  uint8_t line; // interrupt raised when a transfer finishes, 0 by default
+  int service; // CPU_addService id
+  DMA_PORT ports[DMA_PORTS];
+  uint16_t address; // next byte to move
+  uint16_t length; // bytes left to move
+  _Atomic uint8_t command; // in flight, DMA_STOP once done or stopped
+  DMA_STATUS status;
+  _Atomic bool ended; // the device has no more input, see DMA_end
+  uint64_t transfers; // DMA_DONE reached
+  uint64_t bytes; // moved in either direction
+} DMA;
+
+static void DMA_finish(DMA* dma, DMA_STATUS status) {
+  atomic_store(&dma->command, DMA_STOP);
+  dma->status = status;
+  dma->transfers++;
+  CPU_raiseInterrupt(dma->cpu, dma->line);
+}
+
+// Moves as far as the device lets it. On the cpu's thread.
+static void DMA_move(DMA* dma) {
+  CPU* cpu = dma->cpu;
+  bool in = atomic_load(&dma->command) == DMA_IN;
+  while (dma->length > 0) {
+    uint16_t run = PAGE_SIZE - (dma->address & 0xFF);
+    if (run > dma->length) {
+      run = dma->length;
+    }
+    uint8_t* data = CPU_hostPointer(cpu, dma->address, run, in);
+    uint8_t byte;
+    if (data == NULL) {
+      // MMIO, ROM or an instrumented cpu: a byte at a time, like the guest.
+      run = 1;
+      data = &byte;
+      if (!in) {
+        byte = CPU_read(cpu, dma->address);
+      }
+    }
+    size_t moved = dma->callback(dma->ctx, in ? READ : WRITE, data, run);
+    if (moved > 0 && data == &byte && in) {
+      CPU_write(cpu, dma->address, byte);
+    }
+    dma->address += moved;
+    dma->length -= moved;
+    dma->bytes += moved;
+    if (moved < run && (!in || !atomic_load(&dma->ended))) {
+      // The device has no more for now; DMA_ready brings us back.
+      return;
+    }
+    if (moved == 0) {
+      // Ended, and everything it had before that has come in.
+      DMA_finish(dma, DMA_END);
+      return;
+    }
+  }
+  DMA_finish(dma, DMA_DONE);
+}
+
+static void DMA_service(void* ctx) {
+  DMA* dma = ctx;
+  if (atomic_load(&dma->command) != DMA_STOP) {
+    DMA_move(dma);
+  }
+}
+
+uint8_t DMA_io(void* ctx, enum DIRECTION dir, uint8_t value) {
+  DMA_PORT* port = ctx;
+  DMA* dma = port->dma;
+  if (dir == READ) {
+    switch (port->index) {
+      case 0: return dma->address & 0xFF;
+      case 1: return dma->address >> 8;
+      case 2: return dma->length & 0xFF;
+      case 3: return dma->length >> 8;
+      default: return dma->status;
+    }
+  }
+  switch (port->index) {
+    case 0: dma->address = (dma->address & 0xFF00) | value; break;
+    case 1: dma->address = (dma->address & 0x00FF) | (value << 8); break;
+    case 2: dma->length = (dma->length & 0xFF00) | value; break;
+    case 3: dma->length = (dma->length & 0x00FF) | (value << 8); break;
+    default:
+      if (value == DMA_IN || value == DMA_OUT) {
+        atomic_store(&dma->command, value);
+        dma->status = DMA_BUSY;
+        DMA_move(dma);
+      } else {
+        atomic_store(&dma->command, DMA_STOP);
+        dma->status = DMA_IDLE;
+      }
+      break;
+  }
+  return 0;
+}
+
+// Attaches a channel for the device behind `callback` on bus ports
+// `port` to `port + DMA_PORTS - 1`.
+bool DMA_init(DMA* dma, CPU* cpu, uint8_t port, DMA_callback callback, void* ctx) {
+  if (port > 256 - DMA_PORTS) {
+    return false;
+  }
+  dma->cpu = cpu;
+  dma->callback = callback;
+  dma->ctx = ctx;
+  dma->port = port;
+  dma->line = 0;
+  dma->address = 0;
+  dma->length = 0;
+  atomic_init(&dma->command, DMA_STOP);
+  dma->status = DMA_IDLE;
+  atomic_init(&dma->ended, false);
+  dma->transfers = 0;
+  dma->bytes = 0;
+  dma->service = CPU_addService(cpu, DMA_service, dma);
+  if (dma->service == -1) {
+    return false;
+  }
+  for (int n = 0; n < DMA_PORTS; n++) {
+    dma->ports[n].dma = dma;
+    dma->ports[n].index = n;
+    CPU_registerBusCallback(cpu, port + n, DMA_io, &dma->ports[n]);
+  }
+  return true;
+}
+
+// Whether a `command` transfer is in flight. Any thread.
+bool DMA_busy(DMA* dma, DMA_COMMAND command) {
+  return atomic_load(&dma->command) == command;
+}
+
+// Tells the channel the device can move more. Any thread.
+void DMA_ready(DMA* dma) {
+  CPU_requestService(dma->cpu, dma->service);
+}
+
+// Tells the channel the device's input has ended: once everything the
+// device already had is in, DMA_IN transfers finish as DMA_END. Any
+// thread, after the last input is ready to be read.
+void DMA_end(DMA* dma) {
+  atomic_store(&dma->ended, true);
+  CPU_requestService(dma->cpu, dma->service);
+}
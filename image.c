@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+   irx image format
+   A program on disk, loaded by mapping the file instead of copying it.
+
+   All fields are little-endian.
+
+     header, IMAGE_HEADER_SIZE bytes
+       0  "IRXI"
+       4  u16 version, IMAGE_VERSION
+       6  u16 segment count
+       8  u16 entry vector
+      10  u16 interrupt vector
+      12  u32 checksum: FNV-1a over the segment table, then every
+              segment's data in table order
+     segment table, IMAGE_SEGMENT_SIZE bytes per segment
+       0  u16 guest address
+       2  u16 flags, IMAGE_WRITABLE
+       4  u32 file offset of the data
+       8  u32 size in bytes
+     segment data
+
+   Read-only segments start on a guest page and cover whole pages, so
+   their pages point straight into the mapping: they are never copied, and
+   every machine and process using the image shares the same physical
+   pages. Writable segments are copied into the machine's own frames. The
+   vectors are written to 0x0000 unless a read-only segment holds them.
+
+   The IMAGE must stay open while any machine it was loaded into is in
+   use.
+   */
+
+#define IMAGE_MAGIC "IRXI"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 16
+#define IMAGE_SEGMENT_SIZE 12
+#define IMAGE_MAX_SEGMENTS 256
+
+typedef enum {
+  IMAGE_WRITABLE = 1, // copied into the machine; otherwise mapped read-only
+} IMAGE_FLAGS;
+
+typedef struct IMAGE_SEGMENT_t {
+  uint16_t address;
+  uint16_t flags;
+  uint32_t offset;
+  uint32_t size;
+  const uint8_t* data; // into the mapping once opened; the source when writing
+} IMAGE_SEGMENT;
+
+typedef struct IMAGE_t {
+  uint16_t entry;
+  uint16_t interrupt;
+  uint16_t segmentCount;
+  IMAGE_SEGMENT* segments;
+  const uint8_t* file; // the whole file, mapped read-only
+  size_t size;
+} IMAGE;
+
+static uint16_t IMAGE_get16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t IMAGE_get32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void IMAGE_put16(uint8_t* p, uint16_t value) {
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+}
+
+static void IMAGE_put32(uint8_t* p, uint32_t value) {
+  IMAGE_put16(p, value & 0xFFFF);
+  IMAGE_put16(p + 2, value >> 16);
+}
+
+#define IMAGE_FNV_BASIS 2166136261u
+
+static uint32_t IMAGE_hash(uint32_t hash, const uint8_t* data, size_t size) {
+  for (size_t n = 0; n < size; n++) {
+    hash = (hash ^ data[n]) * 16777619u;
+  }
+  return hash;
+}
+
+static bool IMAGE_fail(const char* path, const char* reason) {
+  fprintf(stderr, "%s: %s\n", path, reason);
+  return false;
+}
+
+// Checks everything IMAGE_load relies on.
+static bool IMAGE_validate(IMAGE* image, const char* path) {
+  uint8_t pages[PAGE_COUNT] = { 0 }; // segment flags + 1 of the owning segment
+  uint32_t checksum = IMAGE_hash(IMAGE_FNV_BASIS, image->file + IMAGE_HEADER_SIZE,
+      image->segmentCount * IMAGE_SEGMENT_SIZE);
+  for (int n = 0; n < image->segmentCount; n++) {
+    IMAGE_SEGMENT* segment = &image->segments[n];
+    bool writable = segment->flags & IMAGE_WRITABLE;
+    if (segment->flags & ~IMAGE_WRITABLE) {
+      return IMAGE_fail(path, "unknown segment flags");
+    }
+    if ((uint64_t)segment->offset + segment->size > image->size) {
+      return IMAGE_fail(path, "segment past the end of the file");
+    }
+    if (segment->address + segment->size > 0x10000) {
+      return IMAGE_fail(path, "segment past the end of the address space");
+    }
+    if (!writable && (segment->address % PAGE_SIZE != 0 || segment->size % PAGE_SIZE != 0)) {
+      return IMAGE_fail(path, "read-only segment not made of whole pages");
+    }
+    for (uint32_t page = segment->address >> 8;
+        segment->size > 0 && page <= (segment->address + segment->size - 1) >> 8; page++) {
+      if (pages[page] != 0 && (!writable || pages[page] != 1 + IMAGE_WRITABLE)) {
+        return IMAGE_fail(path, "segments overlap on a read-only page");
+      }
+      pages[page] = 1 + segment->flags;
+    }
+    segment->data = image->file + segment->offset;
+    checksum = IMAGE_hash(checksum, segment->data, segment->size);
+  }
+  if (checksum != IMAGE_get32(image->file + 12)) {
+    return IMAGE_fail(path, "bad checksum");
+  }
+  if (pages[0] == 1) {
+    const uint8_t* vectors = NULL;
+    for (int n = 0; n < image->segmentCount; n++) {
+      if (image->segments[n].address == 0 && image->segments[n].size > 0) {
+        vectors = image->segments[n].data;
+      }
+    }
+    if (IMAGE_get16(vectors) != image->entry || IMAGE_get16(vectors + 2) != image->interrupt) {
+      return IMAGE_fail(path, "vectors disagree with the read-only segment at 0x0000");
+    }
+  }
+  return true;
+}
+
+void IMAGE_close(IMAGE* image) {
+  if (image->file != NULL) {
+    munmap((void*)image->file, image->size);
+  }
+  free(image->segments);
+  image->file = NULL;
+  image->segments = NULL;
+}
+
+// Maps and checks the image at `path`. Problems are reported on stderr.
+bool IMAGE_open(IMAGE* image, const char* path) {
+  image->file = NULL;
+  image->segments = NULL;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    perror(path);
+    close(fd);
+    return false;
+  }
+  if (info.st_size < IMAGE_HEADER_SIZE) {
+    close(fd);
+    return IMAGE_fail(path, "not an irx image");
+  }
+  void* file = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  image->file = file;
+  image->size = info.st_size;
+
+  const uint8_t* header = image->file;
+  if (memcmp(header, IMAGE_MAGIC, 4) != 0) {
+    IMAGE_close(image);
+    return IMAGE_fail(path, "not an irx image");
+  }
+  if (IMAGE_get16(header + 4) != IMAGE_VERSION) {
+    IMAGE_close(image);
+    return IMAGE_fail(path, "unsupported image version");
+  }
+  image->segmentCount = IMAGE_get16(header + 6);
+  image->entry = IMAGE_get16(header + 8);
+  image->interrupt = IMAGE_get16(header + 10);
+  if (image->segmentCount > IMAGE_MAX_SEGMENTS
+      || IMAGE_HEADER_SIZE + image->segmentCount * IMAGE_SEGMENT_SIZE > image->size) {
+    IMAGE_close(image);
+    return IMAGE_fail(path, "truncated segment table");
+  }
+  image->segments = calloc(image->segmentCount + 1, sizeof(IMAGE_SEGMENT));
+  for (int n = 0; n < image->segmentCount; n++) {
+    const uint8_t* entry = header + IMAGE_HEADER_SIZE + n * IMAGE_SEGMENT_SIZE;
+    image->segments[n].address = IMAGE_get16(entry);
+    image->segments[n].flags = IMAGE_get16(entry + 2);
+    image->segments[n].offset = IMAGE_get32(entry + 4);
+    image->segments[n].size = IMAGE_get32(entry + 8);
+  }
+  if (!IMAGE_validate(image, path)) {
+    IMAGE_close(image);
+    return false;
+  }
+  return true;
+}
+
+// Maps the read-only segments into `machine`, copies the writable ones,
+// and points ip at the entry vector.
+void IMAGE_load(const IMAGE* image, MACHINE* machine) {
+  CPU* cpu = &machine->cpu;
+  for (int n = 0; n < image->segmentCount; n++) {
+    const IMAGE_SEGMENT* segment = &image->segments[n];
+    if (segment->flags & IMAGE_WRITABLE) {
+      MACHINE_share(machine, segment->address, segment->data, segment->size);
+    } else {
+      CPU_mapMemory(cpu, segment->address, segment->size, (uint8_t*)segment->data, PAGE_READ);
+    }
+  }
+  if (cpu->frames[0] != NULL) {
+    uint8_t vectors[4];
+    IMAGE_put16(vectors, image->entry);
+    IMAGE_put16(vectors + 2, image->interrupt);
+    MACHINE_share(machine, 0x0000, vectors, sizeof(vectors));
+  }
+  CPU_invalidate(cpu);
+  CPU_prime(cpu);
+}
+
+// Writes an image of `count` segments taken from their `data` pointers.
+// Read-only segments are padded to whole pages.
+bool IMAGE_write(const char* path, uint16_t entry, uint16_t interrupt,
+    const IMAGE_SEGMENT* segments, uint16_t count) {
+  size_t tableSize = count * IMAGE_SEGMENT_SIZE;
+  size_t size = IMAGE_HEADER_SIZE + tableSize;
+  for (int n = 0; n < count; n++) {
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    size += (segments[n].size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+  }
+  uint8_t* file = calloc(1, size);
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  memcpy(file, IMAGE_MAGIC, 4);
+  IMAGE_put16(file + 4, IMAGE_VERSION);
+  IMAGE_put16(file + 6, count);
+  IMAGE_put16(file + 8, entry);
+  IMAGE_put16(file + 10, interrupt);
+
+  // Segment data starts on a page boundary so that the mapped pages line
+  // up with host pages as far as possible.
+  size_t offset = IMAGE_HEADER_SIZE + tableSize;
+  for (int n = 0; n < count; n++) {
+    const IMAGE_SEGMENT* segment = &segments[n];
+    uint32_t stored = segment->size;
+    if (!(segment->flags & IMAGE_WRITABLE)) {
+      stored = (stored + PAGE_SIZE - 1) & ~(uint32_t)(PAGE_SIZE - 1);
+    }
+    offset = (offset + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    uint8_t* entry = file + IMAGE_HEADER_SIZE + n * IMAGE_SEGMENT_SIZE;
+    IMAGE_put16(entry, segment->address);
+    IMAGE_put16(entry + 2, segment->flags);
+    IMAGE_put32(entry + 4, offset);
+    IMAGE_put32(entry + 8, stored);
+    memcpy(file + offset, segment->data, segment->size);
+    offset += stored;
+  }
+  size = offset;
+
+  uint32_t checksum = IMAGE_hash(IMAGE_FNV_BASIS, file + IMAGE_HEADER_SIZE, tableSize);
+  for (int n = 0; n < count; n++) {
+    const uint8_t* entry = file + IMAGE_HEADER_SIZE + n * IMAGE_SEGMENT_SIZE;
+    checksum = IMAGE_hash(checksum, file + IMAGE_get32(entry + 4), IMAGE_get32(entry + 8));
+  }
+  IMAGE_put32(file + 12, checksum);
+
+  FILE* out = fopen(path, "wb");
+  bool written = out != NULL && fwrite(file, 1, size, out) == size;
+  if (out != NULL && fclose(out) != 0) {
+    written = false;
+  }
+  if (!written) {
+    perror(path);
+  }
+  free(file);
+  return written;
+}
@@ -0,0 +1,72 @@
+#include <stdatomic.h>
+
+/*
+   irx interrupt controller
+   The guest's side of the cpu's eight interrupt lines, see CPU_LINES. It
+   takes INTC_PORTS consecutive bus ports from `port`:
+
+     port + 0  mask: bit n set holds line n back
+     port + 1  DATA_IN reads the pending lines, masked ones too; DATA_OUT
+               acknowledges the lines whose bits are set
+     port + 2  vector table address in page 0, 0 for the single vector
+     port + 3  priority: DATA_OUT (line << 4) | level, higher levels are
+               serviced first; DATA_IN reads the unmasked pending line
+               that would be serviced next, 0xFF when there is none
+
+   Mask and vector table read back what was written. Which device raises
+   which line is up to the host.
+   */
+
+#define INTC_PORTS 4
+
+struct INTC_t;
+
+typedef struct INTC_PORT_t {
+  struct INTC_t* intc;
+  uint8_t index; // port - intc->port
+} INTC_PORT;
+
+typedef struct INTC_t {
+  CPU* cpu;
+  uint8_t port;
+  INTC_PORT ports[INTC_PORTS];
+} INTC;
+
+uint8_t INTC_io(void* ctx, enum DIRECTION dir, uint8_t value) {
+  INTC_PORT* port = ctx;
+  INTC* intc = port->intc;
+  CPU* cpu = intc->cpu;
+  if (dir == READ) {
+    switch (port->index) {
+      case 0: return atomic_load(&cpu->interruptMask);
+      case 1: return CPU_pendingInterrupts(cpu);
+      case 2: return cpu->vectors;
+      default: {
+        uint8_t lines = atomic_load(&cpu->i) & ~atomic_load(&cpu->interruptMask);
+        return lines != 0 ? CPU_nextLine(cpu, lines) : 0xFF;
+      }
+    }
+  }
+  switch (port->index) {
+    case 0: CPU_setInterruptMask(cpu, value); break;
+    case 1: CPU_acknowledgeInterrupts(cpu, value); break;
+    case 2: CPU_setInterruptVectors(cpu, value); break;
+    default: CPU_setInterruptPriority(cpu, value >> 4, value & 0x0F); break;
+  }
+  return 0;
+}
+
+// Attaches the controller on bus ports `port` to `port + INTC_PORTS - 1`.
+bool INTC_init(INTC* intc, CPU* cpu, uint8_t port) {
+  if (port > 256 - INTC_PORTS) {
+    return false;
+  }
+  intc->cpu = cpu;
+  intc->port = port;
+  for (int n = 0; n < INTC_PORTS; n++) {
+    intc->ports[n].intc = intc;
+    intc->ports[n].index = n;
+    CPU_registerBusCallback(cpu, port + n, INTC_io, &intc->ports[n]);
+  }
+  return true;
+}
@@ -0,0 +1,762 @@
+#include <sys/mman.h>
+#include <stddef.h>
+#include <unistd.h>
+
+/*
+   irx x86-64 JIT
+
+   Blocks which the threaded core has run JIT_THRESHOLD times are
+   translated into native code in an mmap'd arena. Only register-only
+   instructions are translated, so native code never touches guest memory
+   or the bus; the translation stops at the first instruction it cannot
+   handle (memory, stack, SYS DATA_IN/DATA_OUT, interrupt-flag changes...)
+   and the interpreter carries on from there. Entering and leaving native
+   code costs about what the interpreter takes for a few instructions, so
+   a block that doesn't loop on itself is left to the interpreter unless
+   JIT_MIN_LENGTH of its instructions translate.
+
+   The guest state lives in host registers for the whole block: A to SP in
+   r8 to r15, f in ebp and the Z and N sources of the lazy flags in esi
+   and edi, with the CPU pointer in rbx and rax, rcx and rdx for scratch.
+   ip is a constant everywhere inside a block. Every instruction is
+   emitted inline, so nothing calls out: the state is loaded on the way in
+   and spilled on the way out, once a run however often the block loops.
+
+   Pending C and O are folded into f before entry and native code keeps
+   them there, capturing them from the host flags after ADD, SUB, CMP and
+   the pair ops. A backwards pass over the block finds the flag results
+   that are overwritten before anything reads them, and those are never
+   computed. A block that branches back to itself loops natively until an
+   interrupt is to be serviced, the cpu stops or the CPU_runFor budget
+   runs out.
+
+   The arena is never writable and executable at once: the pages a block
+   goes into are made writable while it is emitted, and executable after.
+
+   In lockstep mode every native run is replayed on a copy of the cpu
+   through CPU_step and the results compared.
+   */
+
+#define JIT_THRESHOLD 64
+#define JIT_ARENA_SIZE (1024 * 1024)
+#define JIT_BLOCK_MAX_CODE 4096
+#define JIT_MIN_LENGTH 5 // instructions, for a block that doesn't loop on itself
+
+typedef struct JIT_t {
+  uint8_t* arena;
+  size_t used;
+  size_t pageSize;
+  bool lockstep;
+} JIT;
+
+typedef struct {
+  uint8_t* code;
+  size_t length;
+} JIT_buffer;
+
+// Host registers, numbered as in ModRM.
+enum {
+  JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI,
+};
+
+#define JIT_CPU JIT_RBX
+#define JIT_F JIT_RBP
+#define JIT_ZERO JIT_RSI // lazy.zero
+#define JIT_SIGN JIT_RDI // lazy.sign
+#define JIT_REG(n) (8 + (n)) // guest register n, in r8 to r15
+#define JIT_W 0x08 // REX.W: 64-bit operand
+
+static void JIT_emit(JIT_buffer* buf, const void* bytes, size_t length) {
+  memcpy(buf->code + buf->length, bytes, length);
+  buf->length += length;
+}
+
+static void JIT_emit8(JIT_buffer* buf, uint8_t value) {
+  buf->code[buf->length++] = value;
+}
+
+static void JIT_emit16(JIT_buffer* buf, uint16_t value) {
+  JIT_emit(buf, &value, 2);
+}
+
+static void JIT_emit32(JIT_buffer* buf, uint32_t value) {
+  JIT_emit(buf, &value, 4);
+}
+
+// Patch a rel32 emitted at `at` to land on the current position.
+static void JIT_patch(JIT_buffer* buf, size_t at) {
+  int32_t rel = (int32_t)(buf->length - (at + 4));
+  memcpy(buf->code + at, &rel, 4);
+}
+
+// REX, a one or two byte (0x0F first) opcode and a register-direct ModRM.
+// The REX is always there, so byte operands 4 to 7 are spl, bpl, sil and
+// dil rather than ah, ch, dh and bh.
+static void JIT_rr(JIT_buffer* buf, uint8_t w, uint16_t opcode, uint8_t reg, uint8_t rm) {
+  JIT_emit8(buf, 0x40 | w | ((reg >> 3) << 2) | (rm >> 3));
+  if (opcode > 0xFF) {
+    JIT_emit8(buf, opcode >> 8);
+  }
+  JIT_emit8(buf, opcode);
+  JIT_emit8(buf, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// As JIT_rr, with a [rbx + disp32] memory operand.
+static void JIT_rm(JIT_buffer* buf, uint8_t w, uint16_t opcode, uint8_t reg, size_t offset) {
+  JIT_emit8(buf, 0x40 | w | ((reg >> 3) << 2));
+  if (opcode > 0xFF) {
+    JIT_emit8(buf, opcode >> 8);
+  }
+  JIT_emit8(buf, opcode);
+  JIT_emit8(buf, 0x83 | ((reg & 7) << 3));
+  JIT_emit32(buf, (uint32_t)offset);
+}
+
+// mov dst8, src8
+static void JIT_movByte(JIT_buffer* buf, uint8_t dst, uint8_t src) {
+  JIT_rr(buf, 0, 0x88, src, dst);
+}
+
+// Byte ALU op in its `op r/m8, r8` form: add 0x00, or 0x08, adc 0x10,
+// sbb 0x18, and 0x20, sub 0x28, xor 0x30.
+static void JIT_alu(JIT_buffer* buf, uint8_t opcode, uint8_t dst, uint8_t src) {
+  JIT_rr(buf, 0, opcode, src, dst);
+}
+
+// Group 1 op on a byte with an immediate: or 1, and 4.
+static void JIT_aluImm(JIT_buffer* buf, uint8_t ext, uint8_t rm, uint8_t imm) {
+  JIT_rr(buf, 0, 0x80, ext, rm);
+  JIT_emit8(buf, imm);
+}
+
+// Shift or rotate a byte by one: rol 0, ror 1, shl 4, shr 5.
+static void JIT_shift1(JIT_buffer* buf, uint8_t ext, uint8_t rm) {
+  JIT_rr(buf, 0, 0xD0, ext, rm);
+}
+
+// Shift a dword by `count`: shl 4, shr 5.
+static void JIT_shift32(JIT_buffer* buf, uint8_t ext, uint8_t rm, uint8_t count) {
+  JIT_rr(buf, 0, 0xC1, ext, rm);
+  JIT_emit8(buf, count);
+}
+
+// setcc r8: seto 0x90, setc 0x92, setnz 0x95.
+static void JIT_set(JIT_buffer* buf, uint8_t cc, uint8_t rm) {
+  JIT_rr(buf, 0, 0x0F00 | cc, 0, rm);
+}
+
+// movzx reg32, rm8
+static void JIT_movzx(JIT_buffer* buf, uint8_t reg, uint8_t rm) {
+  JIT_rr(buf, 0, 0x0FB6, reg, rm);
+}
+
+// mov reg8, imm8
+static void JIT_setByte(JIT_buffer* buf, uint8_t reg, uint8_t imm) {
+  JIT_emit8(buf, 0x40 | (reg >> 3));
+  JIT_emit8(buf, 0xB0 | (reg & 7));
+  JIT_emit8(buf, imm);
+}
+
+// bt ebp, 0: the guest carry into the host one, for ADC and SBB.
+static void JIT_carryIn(JIT_buffer* buf) {
+  JIT_rr(buf, 0, 0x0FBA, 4, JIT_F);
+  JIT_emit8(buf, 0);
+}
+
+// Pair `pair` into the dword `reg`.
+static void JIT_loadPair(JIT_buffer* buf, uint8_t reg, uint8_t pair) {
+  JIT_movzx(buf, reg, JIT_REG(pair * 2 + 1));
+  JIT_shift32(buf, 4, reg, 8);
+  JIT_movByte(buf, reg, JIT_REG(pair * 2));
+}
+
+// The low word of `reg` into pair `pair`, leaving the high byte in `reg`.
+static void JIT_storePair(JIT_buffer* buf, uint8_t reg, uint8_t pair) {
+  JIT_movByte(buf, JIT_REG(pair * 2), reg);
+  JIT_shift32(buf, 5, reg, 8);
+  JIT_movByte(buf, JIT_REG(pair * 2 + 1), reg);
+}
+
+// The host carry into al and overflow into cl, those of them in `live`.
+// Must directly follow the instruction setting them.
+static void JIT_setCarry(JIT_buffer* buf, uint8_t live) {
+  if (live & FLAG_C) {
+    JIT_set(buf, 0x92, JIT_RAX);
+  }
+  if (live & FLAG_O) {
+    JIT_set(buf, 0x90, JIT_RCX);
+  }
+}
+
+// And from there into f.
+static void JIT_mergeCarry(JIT_buffer* buf, uint8_t live) {
+  live &= FLAG_C | FLAG_O;
+  if (live == 0) {
+    return;
+  }
+  JIT_aluImm(buf, 4, JIT_F, (uint8_t)~live);
+  if (live & FLAG_C) {
+    JIT_alu(buf, 0x08, JIT_F, JIT_RAX);
+  }
+  if (live & FLAG_O) {
+    JIT_shift32(buf, 4, JIT_RCX, 3);
+    JIT_alu(buf, 0x08, JIT_F, JIT_RCX);
+  }
+}
+
+// Guest registers `op` reads or writes, as bit masks.
+static void JIT_registers(const DECODED* op, uint8_t* read, uint8_t* written) {
+  uint8_t field = 1 << op->field;
+  uint8_t x = 3 << (((op->operand >> 4) & 3) * 2);
+  uint8_t y = 3 << ((op->operand & 3) * 2);
+  *read = 0;
+  *written = 0;
+  switch (op->kind) {
+    case H_COPY_IN: *read = field; *written = 1; break;
+    case H_COPY_OUT: *read = 1; *written = field; break;
+    case H_SET: *read = 1; *written = field; break;
+    case H_INC: case H_DEC:
+    case H_RTL: case H_RTR: case H_SHL: case H_SHR:
+      *read = field | 1; *written = field; break;
+    case H_ADD: case H_SUB: case H_AND: case H_OR: case H_XOR: case H_NOT:
+      *read = field | 1; *written = 1; break;
+    case H_CMP: *read = field | 1; break;
+    case H_MUL: *read = field | 1; *written = 3; break;
+    case H_SWAP:
+      *read = *written = (1 << (op->operand & 7)) | (1 << ((op->operand >> 4) & 7));
+      break;
+    case H_INC16: case H_DEC16: *read = *written = y; break;
+    case H_ADD16: *read = x | y; *written = x; break;
+    case H_CMP16: *read = x | y; break;
+  }
+}
+
+// ALU flags `op` reads, and those it sets without reading.
+static void JIT_flagEffects(const DECODED* op, uint8_t* uses, uint8_t* defs) {
+  *uses = 0;
+  *defs = 0;
+  switch (op->kind) {
+    case H_ADD: case H_SUB: case H_CMP:
+      *uses = FLAG_C; *defs = FLAGS_ALU; break;
+    case H_ADD16: case H_CMP16: case H_SWAP:
+      *defs = FLAGS_ALU; break;
+    case H_MUL: *defs = FLAG_Z | FLAG_O; break;
+    case H_INC: case H_DEC: case H_INC16: case H_DEC16:
+      *defs = FLAG_Z | FLAG_N; break;
+    case H_SET: case H_AND: case H_OR: case H_XOR: case H_NOT:
+      *defs = FLAG_Z; break;
+    case H_SHR: *defs = FLAG_C; break;
+    case H_CLF: case H_SEF: *defs = (1 << op->field) & FLAGS_ALU; break;
+    case H_BRCH: *uses = (1 << (op->field / 2)) & FLAGS_ALU; break;
+  }
+}
+
+// Emits a test of guest flag `flag` and returns the jcc condition byte
+// (0x84 je, 0x85 jne) that holds when it is set.
+static uint8_t JIT_testFlag(JIT_buffer* buf, uint8_t flag) {
+  if (flag == FLAG_Z) {
+    // test sil, sil
+    JIT_rr(buf, 0, 0x84, JIT_ZERO, JIT_ZERO);
+    return 0x84;
+  }
+  // test dil, 0x80 or test bpl, flag
+  JIT_rr(buf, 0, 0xF6, 0, flag == FLAG_N ? JIT_SIGN : JIT_F);
+  JIT_emit8(buf, flag == FLAG_N ? 0x80 : flag);
+  return 0x85;
+}
+
+// Sets ip, accounts retired instructions and jumps to the way out, whose
+// rel32 goes in `exits`.
+static void JIT_exit(JIT_buffer* buf, uint16_t ip, uint8_t retired,
+    size_t* exits, int* exitCount) {
+  // mov word [rbx + ip], imm16
+  JIT_emit8(buf, 0x66);
+  JIT_rm(buf, 0, 0xC7, 0, offsetof(CPU, ip));
+  JIT_emit16(buf, ip);
+  if (retired > 0) {
+    // add qword [rbx + retired], imm32
+    JIT_rm(buf, JIT_W, 0x81, 0, offsetof(CPU, retired));
+    JIT_emit32(buf, retired);
+  }
+  JIT_emit8(buf, 0xE9);
+  exits[(*exitCount)++] = buf->length;
+  JIT_emit32(buf, 0);
+}
+
+// Branch back to the block head unless an interrupt is to be serviced,
+// the cpu stopped or another pass would overrun the CPU_runFor budget.
+// A line pending with I clear is left pending, as the interpreter leaves
+// it, so it doesn't end the loop.
+static void JIT_loop(JIT_buffer* buf, uint16_t start, uint8_t retired, size_t head,
+    size_t* exits, int* exitCount) {
+  size_t masked, pending, stopped, budget;
+  JIT_rm(buf, JIT_W, 0x81, 0, offsetof(CPU, retired));
+  JIT_emit32(buf, retired);
+  // test bpl, FLAG_I; jz masked; cmp byte [rbx + i], 0; jne exit
+  JIT_rr(buf, 0, 0xF6, 0, JIT_F);
+  JIT_emit8(buf, FLAG_I);
+  JIT_emit8(buf, 0x74);
+  masked = buf->length;
+  JIT_emit8(buf, 0);
+  JIT_rm(buf, 0, 0x80, 7, offsetof(CPU, i));
+  JIT_emit8(buf, 0);
+  JIT_emit(buf, "\x0F\x85", 2);
+  pending = buf->length;
+  JIT_emit32(buf, 0);
+  buf->code[masked] = (uint8_t)(buf->length - (masked + 1));
+  // cmp byte [rbx + running], 0; je exit
+  JIT_rm(buf, 0, 0x80, 7, offsetof(CPU, running));
+  JIT_emit8(buf, 0);
+  JIT_emit(buf, "\x0F\x84", 2);
+  stopped = buf->length;
+  JIT_emit32(buf, 0);
+  // mov rax, [rbx + retired]; add rax, imm32; cmp rax, [rbx + budgetEnd]; ja exit
+  JIT_rm(buf, JIT_W, 0x8B, JIT_RAX, offsetof(CPU, retired));
+  JIT_emit(buf, "\x48\x05", 2);
+  JIT_emit32(buf, retired);
+  JIT_rm(buf, JIT_W, 0x3B, JIT_RAX, offsetof(CPU, budgetEnd));
+  JIT_emit(buf, "\x0F\x87", 2);
+  budget = buf->length;
+  JIT_emit32(buf, 0);
+  // jmp head
+  JIT_emit8(buf, 0xE9);
+  JIT_emit32(buf, (uint32_t)(head - (buf->length + 4)));
+
+  JIT_patch(buf, pending);
+  JIT_patch(buf, stopped);
+  JIT_patch(buf, budget);
+  JIT_exit(buf, start, 0, exits, exitCount);
+}
+
+// Emits `op`, computing only the flags in `live`, those read after it.
+static void JIT_emitOp(JIT_buffer* buf, const DECODED* op, uint8_t live) {
+  uint8_t reg = JIT_REG(op->field);
+  uint8_t a = JIT_REG(0);
+  switch (op->kind) {
+    case H_NOOP:
+      break;
+    case H_COPY_IN:
+      JIT_movByte(buf, a, reg);
+      break;
+    case H_COPY_OUT:
+      JIT_movByte(buf, reg, a);
+      break;
+    case H_SET:
+      JIT_setByte(buf, reg, op->operand);
+      if (live & FLAG_Z) {
+        JIT_movByte(buf, JIT_ZERO, a);
+      }
+      break;
+    case H_INC:
+    case H_DEC:
+      // inc/dec r/m8. Z comes from A whichever register stepped.
+      JIT_rr(buf, 0, 0xFE, op->kind == H_INC ? 0 : 1, reg);
+      if (live & FLAG_Z) {
+        JIT_movByte(buf, JIT_ZERO, a);
+      }
+      if (live & FLAG_N) {
+        JIT_movByte(buf, JIT_SIGN, reg);
+      }
+      break;
+    case H_ADD:
+    case H_SUB:
+      JIT_carryIn(buf);
+      JIT_alu(buf, op->kind == H_ADD ? 0x10 : 0x18, a, reg);
+      JIT_setCarry(buf, live);
+      JIT_mergeCarry(buf, live);
+      if (live & FLAG_Z) {
+        JIT_movByte(buf, JIT_ZERO, a);
+      }
+      if (live & FLAG_N) {
+        JIT_movByte(buf, JIT_SIGN, a);
+      }
+      break;
+    case H_CMP:
+      if ((live & FLAGS_ALU) == 0) {
+        break;
+      }
+      {
+        // dl = A - (reg + C). Z is from the whole difference, so a borrow
+        // clears it even when the low byte is zero.
+        uint8_t carry = live | ((live & FLAG_Z) ? FLAG_C : 0);
+        JIT_movByte(buf, JIT_RDX, a);
+        JIT_carryIn(buf);
+        JIT_alu(buf, 0x18, JIT_RDX, reg);
+        JIT_setCarry(buf, carry);
+        if (live & FLAG_Z) {
+          JIT_movByte(buf, JIT_ZERO, JIT_RDX);
+          JIT_alu(buf, 0x08, JIT_ZERO, JIT_RAX);
+        }
+        JIT_mergeCarry(buf, carry);
+        if (live & FLAG_N) {
+          JIT_movByte(buf, JIT_SIGN, JIT_RDX);
+        }
+      }
+      break;
+    case H_MUL:
+      // ecx = A * reg. Z is from all 16 bits, O from the low byte as for ADD.
+      JIT_movzx(buf, JIT_RAX, a);
+      JIT_movzx(buf, JIT_RDX, reg);
+      JIT_rr(buf, 0, 0x89, JIT_RAX, JIT_RCX);
+      JIT_rr(buf, 0, 0x0FAF, JIT_RCX, JIT_RDX);
+      if (live & FLAG_O) {
+        // ~(a ^ b) & (a ^ result) & 0x80, down to FLAG_O
+        JIT_alu(buf, 0x30, JIT_RDX, JIT_RAX);
+        JIT_rr(buf, 0, 0xF6, 2, JIT_RDX);
+        JIT_alu(buf, 0x30, JIT_RAX, JIT_RCX);
+        JIT_alu(buf, 0x20, JIT_RAX, JIT_RDX);
+        JIT_aluImm(buf, 4, JIT_RAX, 0x80);
+        JIT_shift32(buf, 5, JIT_RAX, 4);
+        JIT_aluImm(buf, 4, JIT_F, (uint8_t)~FLAG_O);
+        JIT_alu(buf, 0x08, JIT_F, JIT_RAX);
+      }
+      if (live & FLAG_Z) {
+        // test ecx, ecx
+        JIT_rr(buf, 0, 0x85, JIT_RCX, JIT_RCX);
+        JIT_set(buf, 0x95, JIT_ZERO);
+      }
+      JIT_movByte(buf, a, JIT_RCX);
+      JIT_shift32(buf, 5, JIT_RCX, 8);
+      JIT_movByte(buf, JIT_REG(1), JIT_RCX);
+      break;
+    case H_AND:
+    case H_OR:
+    case H_XOR:
+      JIT_alu(buf, op->kind == H_AND ? 0x20 : op->kind == H_OR ? 0x08 : 0x30, a, reg);
+      if (live & FLAG_Z) {
+        JIT_movByte(buf, JIT_ZERO, a);
+      }
+      break;
+    case H_NOT:
+      JIT_movByte(buf, a, reg);
+      JIT_rr(buf, 0, 0xF6, 2, a);
+      if (live & FLAG_Z) {
+        JIT_movByte(buf, JIT_ZERO, a);
+      }
+      break;
+    case H_SHL:
+      // C would come from bit 8 of the register, which is never set.
+      JIT_shift1(buf, 4, reg);
+      break;
+    case H_SHR:
+      JIT_shift1(buf, 5, reg);
+      JIT_aluImm(buf, 4, JIT_F, (uint8_t)~FLAG_C);
+      break;
+    case H_RTL:
+      JIT_shift1(buf, 0, reg);
+      break;
+    case H_RTR:
+      // The bit rotated round sets C; a clear one leaves it.
+      JIT_shift1(buf, 1, reg);
+      JIT_set(buf, 0x92, JIT_RAX);
+      JIT_alu(buf, 0x08, JIT_F, JIT_RAX);
+      break;
+    case H_CLF:
+    case H_SEF:
+      {
+        uint8_t flag = 1 << op->field;
+        bool set = op->kind == H_SEF;
+        if (flag == FLAG_Z) {
+          JIT_setByte(buf, JIT_ZERO, set ? 0 : 1);
+        } else if (flag == FLAG_N) {
+          JIT_setByte(buf, JIT_SIGN, set ? 0x80 : 0);
+        } else if (set) {
+          JIT_aluImm(buf, 1, JIT_F, flag);
+        } else {
+          JIT_aluImm(buf, 4, JIT_F, (uint8_t)~flag);
+        }
+      }
+      break;
+    case H_SWAP:
+      {
+        uint8_t src = JIT_REG(op->operand & 7);
+        uint8_t dest = JIT_REG((op->operand >> 4) & 7);
+        if (src != dest) {
+          // xchg
+          JIT_rr(buf, 0, 0x86, src, dest);
+        }
+        JIT_setByte(buf, JIT_ZERO, 1);
+        JIT_setByte(buf, JIT_SIGN, 0);
+        JIT_aluImm(buf, 4, JIT_F, (uint8_t)~FLAGS_ALU);
+      }
+      break;
+    case H_INC16:
+    case H_DEC16:
+      JIT_loadPair(buf, JIT_RDX, op->operand & 3);
+      // inc/dec dx
+      JIT_emit8(buf, 0x66);
+      JIT_rr(buf, 0, 0xFF, op->kind == H_INC16 ? 0 : 1, JIT_RDX);
+      if (live & FLAG_Z) {
+        JIT_set(buf, 0x95, JIT_ZERO);
+      }
+      JIT_storePair(buf, JIT_RDX, op->operand & 3);
+      if (live & FLAG_N) {
+        JIT_movByte(buf, JIT_SIGN, JIT_RDX);
+      }
+      break;
+    case H_ADD16:
+    case H_CMP16:
+      if (op->kind == H_CMP16 && (live & FLAGS_ALU) == 0) {
+        break;
+      }
+      JIT_loadPair(buf, JIT_RDX, (op->operand >> 4) & 3);
+      JIT_loadPair(buf, JIT_RCX, op->operand & 3);
+      // add/sub dx, cx
+      JIT_emit8(buf, 0x66);
+      JIT_alu(buf, op->kind == H_ADD16 ? 0x01 : 0x29, JIT_RDX, JIT_RCX);
+      JIT_setCarry(buf, live);
+      if (live & FLAG_Z) {
+        JIT_set(buf, 0x95, JIT_ZERO);
+      }
+      JIT_mergeCarry(buf, live);
+      if (op->kind == H_ADD16) {
+        JIT_storePair(buf, JIT_RDX, (op->operand >> 4) & 3);
+      } else {
+        JIT_shift32(buf, 5, JIT_RDX, 8);
+      }
+      if (live & FLAG_N) {
+        JIT_movByte(buf, JIT_SIGN, JIT_RDX);
+      }
+      break;
+  }
+}
+
+// Whether `op` can be translated. Anything touching memory, the bus, the
+// stack or the interrupt state is left to the interpreter.
+static bool JIT_supports(const DECODED* op) {
+  switch (op->kind) {
+    case H_CLF: case H_SEF:
+      return (1 << op->field) != FLAG_I;
+    case H_JMP_I:
+      return (op->field & 0x4) == 0;
+    case H_NOOP: case H_SWAP: case H_BRCH:
+    case H_COPY_IN: case H_COPY_OUT: case H_INC: case H_DEC:
+    case H_RTL: case H_RTR: case H_SHL: case H_SHR:
+    case H_SET: case H_NOT: case H_XOR: case H_AND: case H_OR:
+    case H_ADD: case H_MUL: case H_SUB: case H_CMP:
+    case H_INC16: case H_DEC16: case H_ADD16: case H_CMP16:
+      return true;
+  }
+  return false;
+}
+
+static void JIT_reset(CPU* cpu) {
+  for (int n = 0; n < BLOCK_CACHE_SIZE; n++) {
+    cpu->blocks[n].native = NULL;
+  }
+  cpu->jit->used = 0;
+}
+
+bool JIT_init(CPU* cpu) {
+  if (cpu->jit != NULL) {
+    return true;
+  }
+  uint8_t* arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED) {
+    return false;
+  }
+  cpu->jit = calloc(1, sizeof(JIT));
+  cpu->jit->arena = arena;
+  cpu->jit->pageSize = sysconf(_SC_PAGESIZE);
+  return true;
+}
+
+void JIT_free(CPU* cpu) {
+  if (cpu->jit != NULL) {
+    munmap(cpu->jit->arena, JIT_ARENA_SIZE);
+    free(cpu->jit);
+    cpu->jit = NULL;
+  }
+}
+
+void JIT_setLockstep(CPU* cpu, bool lockstep) {
+  if (JIT_init(cpu)) {
+    cpu->jit->lockstep = lockstep;
+  }
+}
+
+// Sets the protection of the arena pages overlapping [at, at + length).
+static bool JIT_protect(JIT* jit, size_t at, size_t length, int prot) {
+  size_t first = at & ~(jit->pageSize - 1);
+  size_t last = (at + length + jit->pageSize - 1) & ~(jit->pageSize - 1);
+  return mprotect(jit->arena + first, last - first, prot) == 0;
+}
+
+void JIT_compile(CPU* cpu, BLOCK* block) {
+  if (!JIT_init(cpu)) {
+    return;
+  }
+  JIT* jit = cpu->jit;
+  if (jit->used + JIT_BLOCK_MAX_CODE > JIT_ARENA_SIZE) {
+    JIT_reset(cpu);
+  }
+
+  uint8_t count = 0;
+  uint8_t read = 0, written = 0;
+  while (count < block->length && JIT_supports(&block->ops[count])) {
+    uint8_t r, w;
+    JIT_registers(&block->ops[count], &r, &w);
+    read |= r;
+    written |= w;
+    count++;
+  }
+  if (count == 0) {
+    return;
+  }
+  const DECODED* tail = &block->ops[count - 1];
+  bool loops = (tail->kind == H_JMP_I || tail->kind == H_BRCH) && tail->operand == block->start;
+  if (!loops && count < JIT_MIN_LENGTH) {
+    return;
+  }
+
+  // Flags read after each op. Every way out hands the whole state back to
+  // the interpreter, so at the end of the block that is all of them.
+  uint8_t live[BLOCK_MAX];
+  uint8_t after = FLAGS_ALU;
+  for (int n = count - 1; n >= 0; n--) {
+    uint8_t uses, defs;
+    uint8_t kind = block->ops[n].kind;
+    live[n] = after;
+    JIT_flagEffects(&block->ops[n], &uses, &defs);
+    // A compare whose flags are all overwritten is skipped, carry-in and all.
+    if ((kind == H_CMP || kind == H_CMP16) && (after & defs) == 0) {
+      uses = 0;
+    }
+    after = (after & ~defs) | uses;
+  }
+
+  if (!JIT_protect(jit, jit->used, JIT_BLOCK_MAX_CODE, PROT_READ | PROT_WRITE)) {
+    return;
+  }
+  JIT_buffer buf = { jit->arena + jit->used, 0 };
+  uint8_t loaded = read | written;
+  // push rbx; push rbp; push r12-r15 where guest registers go in them
+  JIT_emit(&buf, "\x53\x55", 2);
+  for (int n = 4; n < 8; n++) {
+    if (loaded & (1 << n)) {
+      JIT_emit8(&buf, 0x41);
+      JIT_emit8(&buf, 0x50 | (JIT_REG(n) & 7));
+    }
+  }
+  // mov rbx, rdi, then movzx the guest state in
+  JIT_rr(&buf, JIT_W, 0x89, JIT_RDI, JIT_CPU);
+  for (int n = 0; n < 8; n++) {
+    if (loaded & (1 << n)) {
+      JIT_rm(&buf, 0, 0x0FB6, JIT_REG(n), offsetof(CPU, registers) + n);
+    }
+  }
+  JIT_rm(&buf, 0, 0x0FB6, JIT_F, offsetof(CPU, f));
+  JIT_rm(&buf, 0, 0x0FB6, JIT_ZERO, offsetof(CPU, lazy.zero));
+  JIT_rm(&buf, 0, 0x0FB6, JIT_SIGN, offsetof(CPU, lazy.sign));
+  size_t head = buf.length;
+
+  size_t exits[3];
+  int exitCount = 0;
+  for (uint8_t n = 0; n < count; n++) {
+    const DECODED* op = &block->ops[n];
+    switch (op->kind) {
+      case H_JMP_I:
+        if (op->operand == block->start) {
+          JIT_loop(&buf, block->start, count, head, exits, &exitCount);
+        } else {
+          JIT_exit(&buf, op->operand, count, exits, &exitCount);
+        }
+        break;
+      case H_BRCH:
+        {
+          uint8_t flag = op->field / 2;
+          uint8_t mode = op->field % 2;
+          uint8_t set = JIT_testFlag(&buf, 1 << flag);
+          // jcc not_taken: flag clear when branching on set, and vice versa
+          JIT_emit8(&buf, 0x0F);
+          JIT_emit8(&buf, mode ? set : set ^ 1);
+          size_t notTaken = buf.length;
+          JIT_emit32(&buf, 0);
+          if (op->operand == block->start) {
+            JIT_loop(&buf, block->start, count, head, exits, &exitCount);
+          } else {
+            JIT_exit(&buf, op->operand, count, exits, &exitCount);
+          }
+          JIT_patch(&buf, notTaken);
+          JIT_exit(&buf, op->next, count, exits, &exitCount);
+        }
+        break;
+      default:
+        JIT_emitOp(&buf, op, live[n]);
+        break;
+    }
+  }
+
+  uint8_t last = block->ops[count - 1].kind;
+  if (last != H_BRCH && last != H_JMP_I) {
+    JIT_exit(&buf, block->ops[count - 1].next, count, exits, &exitCount);
+  }
+
+  // The way out: spill what the block wrote and restore the host registers.
+  for (int n = 0; n < exitCount; n++) {
+    JIT_patch(&buf, exits[n]);
+  }
+  for (int n = 0; n < 8; n++) {
+    if (written & (1 << n)) {
+      JIT_rm(&buf, 0, 0x88, JIT_REG(n), offsetof(CPU, registers) + n);
+    }
+  }
+  JIT_rm(&buf, 0, 0x88, JIT_F, offsetof(CPU, f));
+  JIT_rm(&buf, 0, 0x88, JIT_ZERO, offsetof(CPU, lazy.zero));
+  JIT_rm(&buf, 0, 0x88, JIT_SIGN, offsetof(CPU, lazy.sign));
+  for (int n = 7; n >= 4; n--) {
+    if (loaded & (1 << n)) {
+      JIT_emit8(&buf, 0x41);
+      JIT_emit8(&buf, 0x58 | (JIT_REG(n) & 7));
+    }
+  }
+  // pop rbp; pop rbx; ret
+  JIT_emit(&buf, "\x5D\x5B\xC3", 3);
+
+  if (!JIT_protect(jit, jit->used, buf.length, PROT_READ | PROT_EXEC)) {
+    return;
+  }
+  block->native = (void (*)(CPU*))(jit->arena + jit->used);
+  block->nativeLength = count;
+  jit->used += (buf.length + 15) & ~(size_t)15;
+}
+
+static void JIT_check(CPU* cpu, CPU* shadow) {
+  uint64_t retired = cpu->retired - shadow->retired;
+  CPU_flags(cpu);
+  shadow->i = 0;
+  shadow->blocks = NULL;
+  memset(shadow->codePages, 0, sizeof(shadow->codePages));
+  while (retired-- > 0 && shadow->running) {
+    CPU_step(shadow);
+  }
+  CPU_flags(shadow);
+  if (memcmp(cpu->registers, shadow->registers, sizeof(cpu->registers)) != 0
+      || cpu->ip != shadow->ip || cpu->f != shadow->f
+      || cpu->retired != shadow->retired) {
+    fprintf(stderr, "irx jit: lockstep mismatch\n");
+    fprintf(stderr, "jit:   ip=%04X f=%02X retired=%llu\n", cpu->ip, cpu->f,
+        (unsigned long long)cpu->retired);
+    fprintf(stderr, "interp: ip=%04X f=%02X retired=%llu\n", shadow->ip, shadow->f,
+        (unsigned long long)shadow->retired);
+    for (int n = 0; n < 8; n++) {
+      fprintf(stderr, "r%i: %02X %02X\n", n, cpu->registers[n], shadow->registers[n]);
+    }
+    abort();
+  }
+}
+
+static inline void JIT_run(CPU* cpu, BLOCK* block) {
+  // Native code keeps C and O in f.
+  if (cpu->lazy.op != LAZY_NONE) {
+    CPU_foldFlags(cpu);
+  }
+  if (cpu->jit->lockstep) {
+    CPU shadow = *cpu;
+    block->native(cpu);
+    JIT_check(cpu, &shadow);
+  } else {
+    block->native(cpu);
+  }
+}
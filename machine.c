@@ -0,0 +1,101 @@
+/*
+   irx machine
+   A cpu together with the 64 KiB of memory it owns. Nothing here is
+   global, so a process can hold as many machines as it has memory for
+   and run them on different threads.
+
+   Memory is made of cpu-owned frames, so CPU_snapshot captures all of it
+   and CPU_restore can fork the snapshot into any machine with the same
+   romSize. Pages nobody has written yet take no memory, and pages loaded
+   with MACHINE_share are shared by every machine that loaded the same
+   bytes, until one of them writes to its copy.
+
+   The first `romSize` bytes are ROM: their pages are mapped read-only and
+   writes to them trap to MACHINE_access, which drops the ones below
+   `romSize`.
+   */
+
+#define MACHINE_MEMORY_SIZE (64 * 1024)
+
+typedef struct MACHINE_t {
+  CPU cpu;
+  uint16_t romSize;
+} MACHINE;
+
+uint8_t MACHINE_access(void* ctx, enum DIRECTION dir, uint16_t addr, uint8_t value) {
+  MACHINE* machine = ctx;
+  CPU* cpu = &machine->cpu;
+  FRAME* frame = cpu->frames[addr >> 8];
+  if (frame == NULL) {
+    // Mapped from an image, or not at all.
+    return 0;
+  }
+  if (dir == READ) {
+    return frame->data[addr & 0xFF];
+  }
+  if (addr >= machine->romSize) {
+    CPU_pageForWrite(cpu, addr >> 8)[addr & 0xFF] = value;
+  }
+  return 0;
+}
+
+void MACHINE_init(MACHINE* machine, uint16_t romSize) {
+  CPU* cpu = &machine->cpu;
+  CPU_init(cpu);
+  machine->romSize = romSize;
+  CPU_registerMemCallback(cpu, MACHINE_access, machine);
+  // Pages holding ROM, even partly, only read directly.
+  size_t rom = (romSize + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+  CPU_mapFrames(cpu, 0x0000, rom, PAGE_READ);
+  CPU_mapFrames(cpu, rom, MACHINE_MEMORY_SIZE - rom, PAGE_READ | PAGE_WRITE);
+}
+
+static void MACHINE_copy(MACHINE* machine, uint16_t addr, const uint8_t* data, size_t size,
+    bool share) {
+  CPU* cpu = &machine->cpu;
+  size_t done = 0;
+  while (done < size && addr + done < MACHINE_MEMORY_SIZE) {
+    uint16_t at = addr + done;
+    size_t length = PAGE_SIZE - (at & 0xFF);
+    if (length > size - done) {
+      length = size - done;
+    }
+    FRAME* frame = cpu->frames[at >> 8];
+    if (frame != NULL && share) {
+      uint8_t page[PAGE_SIZE];
+      memcpy(page, frame->data, PAGE_SIZE);
+      memcpy(page + (at & 0xFF), data + done, length);
+      CPU_shareFrame(cpu, at >> 8, page);
+    } else if (frame != NULL) {
+      memcpy(CPU_pageForWrite(cpu, at >> 8) + (at & 0xFF), data + done, length);
+      if (cpu->codePages[at >> 8] != 0) {
+        CPU_invalidatePage(cpu, at >> 8);
+      }
+    }
+    done += length;
+  }
+}
+
+// Copies `size` bytes from the host into guest memory at `addr`, ROM
+// included. Pages mapped from host memory, like read-only image
+// segments, are skipped.
+void MACHINE_write(MACHINE* machine, uint16_t addr, const uint8_t* data, size_t size) {
+  MACHINE_copy(machine, addr, data, size, false);
+}
+
+// MACHINE_write for bytes many machines load, like programs: the pages
+// written are shared with other machines holding the same contents.
+void MACHINE_share(MACHINE* machine, uint16_t addr, const uint8_t* data, size_t size) {
+  MACHINE_copy(machine, addr, data, size, true);
+}
+
+// Copies `size` bytes of program to address 0 and points ip at its entry.
+void MACHINE_load(MACHINE* machine, const uint8_t* program, size_t size) {
+  MACHINE_share(machine, 0x0000, program, size);
+  CPU_invalidate(&machine->cpu);
+  CPU_prime(&machine->cpu);
+}
+
+void MACHINE_free(MACHINE* machine) {
+  CPU_free(&machine->cpu);
+}
@@ -0,0 +1,115 @@
+#include "cpu.c"
+#include "machine.c"
+#include "image.c"
+
+/*
+   irx image writer
+   Packs raw binaries into an irx image, or lists an existing one.
+
+   usage: mkimage -o image [-e entry] [-i interrupt] {-r|-w} address file...
+          mkimage -l image
+
+   -r maps the next file read-only at `address`, -w copies it writable.
+   Without -e/-i the vectors are taken from the first four bytes of the
+   segment at 0x0000, the way programs have always started.
+   */
+
+static void usage(void) {
+  fprintf(stderr, "usage: mkimage -o image [-e entry] [-i interrupt] {-r|-w} address file...\n");
+  fprintf(stderr, "       mkimage -l image\n");
+  exit(1);
+}
+
+static uint8_t* readFile(const char* path, uint32_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return NULL;
+  }
+  uint8_t* data = malloc(MACHINE_MEMORY_SIZE + 1);
+  *size = fread(data, 1, MACHINE_MEMORY_SIZE + 1, file);
+  fclose(file);
+  if (*size > MACHINE_MEMORY_SIZE) {
+    fprintf(stderr, "%s: larger than the address space\n", path);
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+static int list(const char* path) {
+  IMAGE image;
+  if (!IMAGE_open(&image, path)) {
+    return 1;
+  }
+  printf("entry 0x%04X, interrupt 0x%04X, %i segments\n", image.entry, image.interrupt,
+      image.segmentCount);
+  for (int n = 0; n < image.segmentCount; n++) {
+    const IMAGE_SEGMENT* segment = &image.segments[n];
+    printf("  0x%04X-0x%04X %s at offset %u\n", segment->address,
+        segment->address + segment->size - (segment->size > 0),
+        (segment->flags & IMAGE_WRITABLE) ? "rw" : "ro", segment->offset);
+  }
+  IMAGE_close(&image);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char* output = NULL;
+  long entry = -1, interrupt = -1;
+  IMAGE_SEGMENT segments[IMAGE_MAX_SEGMENTS];
+  uint16_t count = 0;
+
+  if (argc == 3 && strcmp(argv[1], "-l") == 0) {
+    return list(argv[2]);
+  }
+  for (int n = 1; n < argc; n++) {
+    if (strcmp(argv[n], "-o") == 0 && n + 1 < argc) {
+      output = argv[++n];
+    } else if (strcmp(argv[n], "-e") == 0 && n + 1 < argc) {
+      entry = strtol(argv[++n], NULL, 0);
+    } else if (strcmp(argv[n], "-i") == 0 && n + 1 < argc) {
+      interrupt = strtol(argv[++n], NULL, 0);
+    } else if ((strcmp(argv[n], "-r") == 0 || strcmp(argv[n], "-w") == 0) && n + 2 < argc
+        && count < IMAGE_MAX_SEGMENTS) {
+      IMAGE_SEGMENT* segment = &segments[count++];
+      segment->flags = argv[n][1] == 'w' ? IMAGE_WRITABLE : 0;
+      segment->address = strtol(argv[n + 1], NULL, 0);
+      segment->data = readFile(argv[n + 2], &segment->size);
+      if (segment->data == NULL) {
+        return 1;
+      }
+      n += 2;
+    } else {
+      usage();
+    }
+  }
+  if (output == NULL || count == 0) {
+    usage();
+  }
+  for (int n = 0; n < count; n++) {
+    if (segments[n].address == 0 && segments[n].size >= 4) {
+      if (entry == -1) {
+        entry = segments[n].data[0] | (segments[n].data[1] << 8);
+      }
+      if (interrupt == -1) {
+        interrupt = segments[n].data[2] | (segments[n].data[3] << 8);
+      }
+    }
+  }
+  if (entry == -1 || interrupt == -1) {
+    fprintf(stderr, "mkimage: no vectors, give -e and -i\n");
+    return 1;
+  }
+  bool written = IMAGE_write(output, entry, interrupt, segments, count);
+  for (int n = 0; n < count; n++) {
+    free((void*)segments[n].data);
+  }
+  // Read it back, so a bad layout is caught here rather than at load time.
+  IMAGE image;
+  if (!written || !IMAGE_open(&image, output)) {
+    return 1;
+  }
+  IMAGE_close(&image);
+  return 0;
+}
@@ -0,0 +1,231 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+   irx MMU
+   Extended memory past the 64 KiB address space: a store of `banks`
+   banks, `bankSize` bytes each, any of which can show through a window,
+   a bankSize range of guest addresses. Switching banks points the
+   window's pages at another part of the store, so it costs the same
+   however big the store is, and nothing is copied. The store is
+   anonymous memory the OS hands out as it is touched, or a file mapped
+   shared, which then holds what the guest wrote once it is done.
+
+   The guest drives it through MMU_PORTS consecutive bus ports from
+   `port`:
+
+     port + 0  DATA_OUT selects the window ports 1 and 2 act on, DATA_IN
+               reads the number of windows
+     port + 1  bank, high byte, kept until the low byte is written
+     port + 2  bank, low byte: DATA_OUT maps bank (high << 8) | low into
+               the selected window
+
+   Both bank ports read back the selected window's bank. Switching to a
+   bank past the end of the store leaves the window as it was.
+
+   Cached code in a window is dropped when its bank changes, like code
+   that was written over. A bank showing through two windows at once is
+   mapped read-only in both, and writes go through MMU_access, which
+   drops cached code behind either address. Windows are not part of
+   snapshots: a restored cpu sees whatever banks its pages pointed at.
+   */
+
+#define MMU_PORTS 3
+#define MMU_WINDOWS 4
+
+struct MMU_t;
+
+typedef struct MMU_PORT_t {
+  struct MMU_t* mmu;
+  uint8_t index; // port - mmu->port
+} MMU_PORT;
+
+typedef struct {
+  uint16_t addr;
+  uint16_t bank;
+  bool aliased; // the bank shows through another window too
+} MMU_WINDOW;
+
+typedef struct MMU_t {
+  CPU* cpu;
+  uint8_t port;
+  MMU_PORT ports[MMU_PORTS];
+  uint8_t* store;
+  size_t size; // bytes mapped at `store`
+  size_t bankSize;
+  uint32_t banks;
+  MMU_WINDOW windows[MMU_WINDOWS];
+  uint8_t windowCount;
+  uint8_t selected;
+  uint8_t high; // latched bank high byte
+  uint64_t switches; // banks mapped by the guest
+} MMU;
+
+static bool MMU_fail(const char* path, const char* reason) {
+  fprintf(stderr, "%s: %s\n", path, reason);
+  return false;
+}
+
+// Writes to a bank showing through more than one window.
+uint8_t MMU_access(void* ctx, enum DIRECTION dir, uint16_t addr, uint8_t value) {
+  MMU* mmu = ctx;
+  for (int n = 0; n < mmu->windowCount; n++) {
+    MMU_WINDOW* window = &mmu->windows[n];
+    if (addr >= window->addr && addr - window->addr < mmu->bankSize) {
+      uint8_t* byte = mmu->store + window->bank * mmu->bankSize + (addr - window->addr);
+      if (dir == READ) {
+        return *byte;
+      }
+      *byte = value;
+      for (int k = 0; k < mmu->windowCount; k++) {
+        uint8_t page = (mmu->windows[k].addr + (addr - window->addr)) >> 8;
+        if (mmu->windows[k].bank == window->bank && mmu->cpu->codePages[page] != 0) {
+          CPU_invalidatePage(mmu->cpu, page);
+        }
+      }
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static void MMU_mapWindow(MMU* mmu, MMU_WINDOW* window) {
+  uint8_t* host = mmu->store + window->bank * mmu->bankSize;
+  if (window->aliased) {
+    CPU_mapReadOnly(mmu->cpu, window->addr, mmu->bankSize, host, MMU_access, mmu);
+  } else {
+    CPU_mapMemory(mmu->cpu, window->addr, mmu->bankSize, host, PAGE_READ | PAGE_WRITE);
+  }
+}
+
+// Shows `bank` through window `index`. Windows whose banks start or stop
+// being shared elsewhere are mapped again too.
+bool MMU_map(MMU* mmu, uint8_t index, uint32_t bank) {
+  if (index >= mmu->windowCount || bank >= mmu->banks) {
+    return false;
+  }
+  mmu->windows[index].bank = bank;
+  for (int n = 0; n < mmu->windowCount; n++) {
+    MMU_WINDOW* window = &mmu->windows[n];
+    bool aliased = false;
+    for (int k = 0; k < mmu->windowCount; k++) {
+      aliased |= k != n && mmu->windows[k].bank == window->bank;
+    }
+    if (n == index || aliased != window->aliased) {
+      window->aliased = aliased;
+      MMU_mapWindow(mmu, window);
+    }
+  }
+  return true;
+}
+
+uint8_t MMU_io(void* ctx, enum DIRECTION dir, uint8_t value) {
+  MMU_PORT* port = ctx;
+  MMU* mmu = port->mmu;
+  uint16_t bank = mmu->selected < mmu->windowCount ? mmu->windows[mmu->selected].bank : 0;
+  if (dir == READ) {
+    switch (port->index) {
+      case 0: return mmu->windowCount;
+      case 1: return bank >> 8;
+      default: return bank & 0xFF;
+    }
+  }
+  switch (port->index) {
+    case 0: mmu->selected = value; break;
+    case 1: mmu->high = value; break;
+    default:
+      mmu->switches += MMU_map(mmu, mmu->selected, (mmu->high << 8) | value);
+      break;
+  }
+  return 0;
+}
+
+// Attaches an MMU on bus ports `port` to `port + MMU_PORTS - 1`, with a
+// store of `size` bytes cut into banks of `bankSize`, a whole number of
+// pages up to 64 KiB. With a `path` the store is that file, grown to
+// `size` if it is shorter; a `size` of 0 then takes the file's. Windows
+// are added with MMU_addWindow.
+bool MMU_init(MMU* mmu, CPU* cpu, uint8_t port, size_t bankSize, size_t size, const char* path) {
+  if (port > 256 - MMU_PORTS || bankSize == 0 || bankSize % PAGE_SIZE != 0
+      || bankSize > 0x10000) {
+    return false;
+  }
+  int fd = -1;
+  if (path != NULL) {
+    struct stat st;
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      perror(path);
+      if (fd != -1) {
+        close(fd);
+      }
+      return false;
+    }
+    if (size == 0) {
+      size = st.st_size;
+    }
+    if ((size_t)st.st_size < size && ftruncate(fd, size) == -1) {
+      perror(path);
+      close(fd);
+      return false;
+    }
+  }
+  if (size / bankSize == 0 || size / bankSize > 0x10000) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return MMU_fail(path != NULL ? path : "mmu", "store must hold 1 to 65536 banks");
+  }
+  mmu->store = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      fd != -1 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, fd, 0);
+  if (fd != -1) {
+    close(fd);
+  }
+  if (mmu->store == MAP_FAILED) {
+    perror(path != NULL ? path : "mmu");
+    return false;
+  }
+  mmu->cpu = cpu;
+  mmu->port = port;
+  mmu->size = size;
+  mmu->bankSize = bankSize;
+  mmu->banks = size / bankSize;
+  mmu->windowCount = 0;
+  mmu->selected = 0;
+  mmu->high = 0;
+  mmu->switches = 0;
+  for (int n = 0; n < MMU_PORTS; n++) {
+    mmu->ports[n].mmu = mmu;
+    mmu->ports[n].index = n;
+    CPU_registerBusCallback(cpu, port + n, MMU_io, &mmu->ports[n]);
+  }
+  return true;
+}
+
+// Adds a window at page-aligned `addr`, showing the bank numbered like
+// the window. Whatever was mapped there is replaced.
+bool MMU_addWindow(MMU* mmu, uint16_t addr) {
+  if (mmu->windowCount == MMU_WINDOWS || addr % PAGE_SIZE != 0
+      || addr + mmu->bankSize > 0x10000) {
+    return false;
+  }
+  for (int n = 0; n < mmu->windowCount; n++) {
+    uint16_t other = mmu->windows[n].addr;
+    if (addr < other + mmu->bankSize && other < addr + mmu->bankSize) {
+      return false;
+    }
+  }
+  uint8_t index = mmu->windowCount++;
+  mmu->windows[index].addr = addr;
+  mmu->windows[index].aliased = false;
+  return MMU_map(mmu, index, index < mmu->banks ? index : 0);
+}
+
+// Unmaps the store, writing a file store back. The cpu must be done with
+// the windows.
+void MMU_free(MMU* mmu) {
+  munmap(mmu->store, mmu->size);
+  mmu->store = NULL;
+}
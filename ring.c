@@ -0,0 +1,129 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+   Lock-free single-producer/single-consumer byte ring
+
+   One thread writes and one thread reads. The producer publishes bytes by
+   storing `head` with release order after copying them in; the consumer
+   frees space by storing `tail` with release order after copying them out.
+   Each side keeps a cached copy of the other side's index so the shared
+   cache lines are only touched when the cached view runs out.
+
+   Writes never block: RING_write returns how many bytes fitted, and a
+   short count is the producer's backpressure signal.
+   */
+
+#define RING_CACHE_LINE 64
+
+typedef struct RING_t {
+  uint8_t* data;
+  size_t mask; // capacity - 1, capacity is a power of two
+
+  _Alignas(RING_CACHE_LINE) _Atomic size_t head; // next byte to write
+  size_t tailCache; // producer's view of tail
+
+  _Alignas(RING_CACHE_LINE) _Atomic size_t tail; // next byte to read
+  size_t headCache; // consumer's view of head
+} RING;
+
+// `capacity` is rounded up to a power of two.
+bool RING_init(RING* ring, size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  ring->data = malloc(size);
+  if (ring->data == NULL) {
+    return false;
+  }
+  ring->mask = size - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->tailCache = 0;
+  ring->headCache = 0;
+  return true;
+}
+
+void RING_free(RING* ring) {
+  free(ring->data);
+  ring->data = NULL;
+}
+
+size_t RING_capacity(RING* ring) {
+  return ring->mask + 1;
+}
+
+// Bytes waiting to be read. From the consumer a lower bound, since the
+// producer may have written more since head was loaded; from the
+// producer an upper bound, since the consumer may have read more, so it
+// never makes a write look like it has more room than it does.
+size_t RING_used(RING* ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return head - tail;
+}
+
+// Producer: room for at least this many bytes.
+size_t RING_space(RING* ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  ring->tailCache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return ring->mask + 1 - (head - ring->tailCache);
+}
+
+// Producer: copies in as many of `length` bytes as fit and returns that.
+size_t RING_write(RING* ring, const uint8_t* bytes, size_t length) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t capacity = ring->mask + 1;
+  if (capacity - (head - ring->tailCache) < length) {
+    ring->tailCache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  }
+  size_t space = capacity - (head - ring->tailCache);
+  if (length > space) {
+    length = space;
+  }
+
+  size_t offset = head & ring->mask;
+  size_t first = capacity - offset;
+  if (first > length) {
+    first = length;
+  }
+  memcpy(ring->data + offset, bytes, first);
+  memcpy(ring->data, bytes + first, length - first);
+
+  atomic_store_explicit(&ring->head, head + length, memory_order_release);
+  return length;
+}
+
+// Consumer: copies out up to `length` bytes and returns how many.
+size_t RING_read(RING* ring, uint8_t* bytes, size_t length) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (ring->headCache - tail < length) {
+    ring->headCache = atomic_load_explicit(&ring->head, memory_order_acquire);
+  }
+  size_t available = ring->headCache - tail;
+  if (length > available) {
+    length = available;
+  }
+
+  size_t capacity = ring->mask + 1;
+  size_t offset = tail & ring->mask;
+  size_t first = capacity - offset;
+  if (first > length) {
+    first = length;
+  }
+  memcpy(bytes, ring->data + offset, first);
+  memcpy(bytes + first, ring->data, length - first);
+
+  atomic_store_explicit(&ring->tail, tail + length, memory_order_release);
+  return length;
+}
+
+bool RING_push(RING* ring, uint8_t value) {
+  return RING_write(ring, &value, 1) == 1;
+}
+
+bool RING_pop(RING* ring, uint8_t* value) {
+  return RING_read(ring, value, 1) == 1;
+}
@@ -0,0 +1,334 @@
+#include <pthread.h>
+
+/*
+   irx scheduler
+   Time-slices many cpus across a pool of worker threads.
+
+   Each worker owns a bounded deque of runnable tasks. The owner pushes at
+   the bottom; the owner and thieves all take from the top, so a worker
+   round-robins through its own tasks while idle workers steal the oldest
+   ones. Tasks made runnable from outside the pool, and pushes that find a
+   deque full, go through a shared inject queue.
+
+   A task whose cpu returns EXIT_WAIT is parked: it sits on no queue and
+   takes up no worker until CPU_wake (an interrupt or CPU_stop) runs the
+   wake hook, which queues it again. Guests blocked on a device wait for
+   its interrupt, or for a service it requested, like a DMA transfer
+   moving on, so this covers I/O too.
+   */
+
+#define SCHED_DEQUE_SIZE 1024
+#define SCHED_SLICE 100000
+#define SCHED_CACHE_LINE 64
+
+typedef enum {
+  TASK_QUEUED,
+  TASK_RUNNING,
+  TASK_PARKED,
+  TASK_DONE,
+} TASK_STATE;
+
+struct SCHED_t;
+
+typedef struct TASK_t {
+  CPU* cpu;
+  void (*done)(struct TASK_t* task); // called on a worker once the cpu stops
+  void* ctx;
+
+  struct SCHED_t* sched;
+  _Atomic int state;
+  struct TASK_t* next; // inject queue link
+} TASK;
+
+typedef struct SCHED_deque_t {
+  _Alignas(SCHED_CACHE_LINE) _Atomic int64_t top; // next task to take
+  _Alignas(SCHED_CACHE_LINE) _Atomic int64_t bottom; // next free slot, owner only
+  _Atomic(TASK*) slots[SCHED_DEQUE_SIZE];
+} SCHED_deque;
+
+typedef struct SCHED_worker_t {
+  SCHED_deque deque;
+  struct SCHED_t* sched;
+  pthread_t thread;
+  unsigned seed; // victim selection
+  uint64_t retired;
+  uint64_t slices;
+  uint64_t steals;
+  uint64_t parks;
+} SCHED_worker;
+
+typedef struct SCHED_t {
+  SCHED_worker* workers;
+  int workerCount;
+  uint64_t slice; // CPU_runFor budget per turn
+
+  pthread_mutex_t lock;
+  pthread_cond_t work; // runnable tasks appeared, or shutdown
+  pthread_cond_t idle; // no live tasks left
+  TASK* injectHead; // under lock
+  TASK* injectTail;
+  _Atomic int64_t injected; // tasks on the inject queue
+
+  _Atomic int64_t runnable; // queued tasks, an upper bound while pushing
+  _Atomic int sleepers; // workers blocked on `work`
+  _Atomic int64_t live; // submitted and not done
+  _Atomic bool shutdown;
+} SCHED;
+
+static _Thread_local SCHED_worker* SCHED_self;
+
+// Owner only. Fails when the deque is full.
+static bool SCHED_push(SCHED_deque* deque, TASK* task) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  if (bottom - top >= SCHED_DEQUE_SIZE) {
+    return false;
+  }
+  atomic_store_explicit(&deque->slots[bottom & (SCHED_DEQUE_SIZE - 1)], task,
+      memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+  return true;
+}
+
+// Any thread, owner included. NULL when empty or lost to another taker.
+static TASK* SCHED_steal(SCHED_deque* deque) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom) {
+    return NULL;
+  }
+  TASK* task = atomic_load_explicit(&deque->slots[top & (SCHED_DEQUE_SIZE - 1)],
+      memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+        memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+  return task;
+}
+
+static void SCHED_notify(SCHED* sched) {
+  if (atomic_load(&sched->sleepers) > 0) {
+    pthread_mutex_lock(&sched->lock);
+    pthread_cond_signal(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+  }
+}
+
+// Makes a task runnable: on the calling worker's deque when there is one,
+// otherwise on the inject queue.
+static void SCHED_enqueue(SCHED* sched, TASK* task) {
+  atomic_fetch_add(&sched->runnable, 1);
+  SCHED_worker* self = SCHED_self;
+  if (self == NULL || self->sched != sched || !SCHED_push(&self->deque, task)) {
+    pthread_mutex_lock(&sched->lock);
+    task->next = NULL;
+    if (sched->injectTail != NULL) {
+      sched->injectTail->next = task;
+    } else {
+      sched->injectHead = task;
+    }
+    sched->injectTail = task;
+    atomic_fetch_add(&sched->injected, 1);
+    pthread_mutex_unlock(&sched->lock);
+  }
+  SCHED_notify(sched);
+}
+
+// CPU wake hook: requeues the task if it was parked.
+static void SCHED_wake(void* ctx) {
+  TASK* task = ctx;
+  int parked = TASK_PARKED;
+  // Orders the interrupt raised before this against reading the state;
+  // pairs with the park in SCHED_runTask.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_compare_exchange_strong(&task->state, &parked, TASK_QUEUED)) {
+    SCHED_enqueue(task->sched, task);
+  }
+}
+
+static TASK* SCHED_takeInjected(SCHED* sched) {
+  if (atomic_load_explicit(&sched->injected, memory_order_relaxed) == 0) {
+    return NULL;
+  }
+  pthread_mutex_lock(&sched->lock);
+  TASK* task = sched->injectHead;
+  if (task != NULL) {
+    atomic_fetch_sub(&sched->injected, 1);
+    sched->injectHead = task->next;
+    if (sched->injectHead == NULL) {
+      sched->injectTail = NULL;
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return task;
+}
+
+static TASK* SCHED_find(SCHED_worker* worker) {
+  SCHED* sched = worker->sched;
+  TASK* task = SCHED_steal(&worker->deque);
+  if (task != NULL) {
+    return task;
+  }
+  task = SCHED_takeInjected(sched);
+  if (task != NULL) {
+    return task;
+  }
+  // Visit every other worker, starting at a random one.
+  int start = rand_r(&worker->seed) % sched->workerCount;
+  for (int n = 0; n < sched->workerCount; n++) {
+    SCHED_worker* victim = &sched->workers[(start + n) % sched->workerCount];
+    if (victim == worker) {
+      continue;
+    }
+    task = SCHED_steal(&victim->deque);
+    if (task != NULL) {
+      worker->steals++;
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static void SCHED_sleep(SCHED* sched) {
+  pthread_mutex_lock(&sched->lock);
+  atomic_fetch_add(&sched->sleepers, 1);
+  while (atomic_load(&sched->runnable) <= 0 && !atomic_load(&sched->shutdown)) {
+    pthread_cond_wait(&sched->work, &sched->lock);
+  }
+  atomic_fetch_sub(&sched->sleepers, 1);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+static void SCHED_runTask(SCHED_worker* worker, TASK* task) {
+  SCHED* sched = worker->sched;
+  CPU* cpu = task->cpu;
+  uint64_t retired;
+  atomic_store(&task->state, TASK_RUNNING);
+  EXIT exit = CPU_runFor(cpu, sched->slice, &retired);
+  worker->retired += retired;
+  worker->slices++;
+
+  if (!cpu->running) {
+    atomic_store(&task->state, TASK_DONE);
+    task->done(task);
+    if (atomic_fetch_sub(&sched->live, 1) == 1) {
+      pthread_mutex_lock(&sched->lock);
+      pthread_cond_broadcast(&sched->idle);
+      pthread_mutex_unlock(&sched->lock);
+    }
+    return;
+  }
+  if (exit == EXIT_WAIT) {
+    // Park, then look again: an interrupt or service request raised
+    // before the store saw the task running and left requeueing to us.
+    worker->parks++;
+    atomic_store(&task->state, TASK_PARKED);
+    if (atomic_load(&cpu->i) == 0 && atomic_load(&cpu->serviceRequests) == 0
+        && cpu->running) {
+      return;
+    }
+    int parked = TASK_PARKED;
+    if (!atomic_compare_exchange_strong(&task->state, &parked, TASK_QUEUED)) {
+      return;
+    }
+  } else {
+    atomic_store(&task->state, TASK_QUEUED);
+  }
+  SCHED_enqueue(sched, task);
+}
+
+void* SCHED_thread(void* data) {
+  SCHED_worker* worker = data;
+  SCHED* sched = worker->sched;
+  SCHED_self = worker;
+  while (!atomic_load(&sched->shutdown)) {
+    TASK* task = SCHED_find(worker);
+    if (task == NULL) {
+      if (atomic_load(&sched->runnable) > 0) {
+        // Queued somewhere, but still being pushed or lost to a thief.
+        sched_yield();
+      } else {
+        SCHED_sleep(sched);
+      }
+      continue;
+    }
+    atomic_fetch_sub(&sched->runnable, 1);
+    SCHED_runTask(worker, task);
+  }
+  return NULL;
+}
+
+bool SCHED_init(SCHED* sched, int workerCount, uint64_t slice) {
+  sched->workers = calloc(workerCount, sizeof(SCHED_worker));
+  if (sched->workers == NULL) {
+    return false;
+  }
+  sched->workerCount = workerCount;
+  sched->slice = slice;
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->work, NULL);
+  pthread_cond_init(&sched->idle, NULL);
+  sched->injectHead = NULL;
+  sched->injectTail = NULL;
+  atomic_init(&sched->injected, 0);
+  atomic_init(&sched->runnable, 0);
+  atomic_init(&sched->sleepers, 0);
+  atomic_init(&sched->live, 0);
+  atomic_init(&sched->shutdown, false);
+  for (int n = 0; n < workerCount; n++) {
+    SCHED_worker* worker = &sched->workers[n];
+    worker->sched = sched;
+    worker->seed = n * 2654435761u + 1;
+    atomic_init(&worker->deque.top, 0);
+    atomic_init(&worker->deque.bottom, 0);
+  }
+  for (int n = 0; n < workerCount; n++) {
+    pthread_create(&sched->workers[n].thread, NULL, SCHED_thread, &sched->workers[n]);
+  }
+  return true;
+}
+
+// Hands `task->cpu` to the pool. `done` runs on a worker once the cpu has
+// stopped; after that the scheduler no longer touches the task, but a
+// device thread still raising interrupts on the cpu may.
+void SCHED_submit(SCHED* sched, TASK* task) {
+  task->sched = sched;
+  atomic_init(&task->state, TASK_QUEUED);
+  CPU_setWakeHook(task->cpu, SCHED_wake, task);
+  atomic_fetch_add(&sched->live, 1);
+  SCHED_enqueue(sched, task);
+}
+
+// Blocks until every submitted task is done.
+void SCHED_wait(SCHED* sched) {
+  pthread_mutex_lock(&sched->lock);
+  while (atomic_load(&sched->live) > 0) {
+    pthread_cond_wait(&sched->idle, &sched->lock);
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+// Instructions retired by all workers so far.
+uint64_t SCHED_retired(SCHED* sched) {
+  uint64_t retired = 0;
+  for (int n = 0; n < sched->workerCount; n++) {
+    retired += sched->workers[n].retired;
+  }
+  return retired;
+}
+
+// Stops the workers. Tasks still queued or parked are left as they are.
+void SCHED_free(SCHED* sched) {
+  pthread_mutex_lock(&sched->lock);
+  atomic_store(&sched->shutdown, true);
+  pthread_cond_broadcast(&sched->work);
+  pthread_mutex_unlock(&sched->lock);
+  for (int n = 0; n < sched->workerCount; n++) {
+    pthread_join(sched->workers[n].thread, NULL);
+  }
+  pthread_mutex_destroy(&sched->lock);
+  pthread_cond_destroy(&sched->work);
+  pthread_cond_destroy(&sched->idle);
+  free(sched->workers);
+  sched->workers = NULL;
+}
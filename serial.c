@@ -0,0 +1,332 @@
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+/*
+   irx serial device
+   A bus port backed by a pair of host file descriptors. A reader thread
+   moves input into a lock-free ring and raises interrupt `line` once per
+   burst; the guest drains the ring through DATA_IN until it returns 0.
+   When the guest falls behind and the ring fills, the thread blocks until
+   the guest has taken half of it, or all of it, before reading more.
+   DATA_OUT collects bytes in a buffer which goes out with one write when
+   it fills, at a newline if `lineBuffered`, and once its oldest byte has
+   waited `latency` ns. The host flushes it too when the guest goes idle
+   and when it is done; see TERM_run.
+
+   SERIAL_attachDMA adds a DMA channel, so the guest can read input into
+   memory and write output from it a block at a time. While a DMA_IN
+   transfer is in flight, input goes to it instead of raising an
+   interrupt per burst. DMA output shares the output buffer.
+
+   When input ends the cpu stops, unless `stopAtEnd` is cleared: then the
+   guest is told through a last interrupt and DMA_END on its channel.
+
+   All state lives in the SERIAL struct, which is also the bus callback's
+   context, so every machine can have its own serial port.
+   */
+
+#define SERIAL_BUFFER_SIZE 4096 // input and output, for a terminal
+#define SERIAL_CHUNK (64 * 1024) // most bytes one read takes
+#define SERIAL_LATENCY (1000 * 1000) // ns, 1 ms
+#define SERIAL_CTRL_Q 0x11
+
+typedef struct SERIAL_t {
+  CPU* cpu;
+  int in; // host input, read by the serial thread
+  int out; // host output, written by DATA_OUT
+  bool quitKey; // Ctrl-Q on input stops the cpu
+  bool stopAtEnd; // the end of input stops the cpu
+  uint8_t line; // interrupt raised for input, 0 by default
+  RING input; // bytes from `in`, consumed by the guest
+  DMA dma;
+  bool dmaAttached;
+  int stop; // eventfd signalled once the cpu has stopped
+  int space; // eventfd signalled when the ring has room again
+  _Atomic bool full; // the serial thread is waiting on `space`
+  size_t taken; // bytes the guest took since it last looked at `full`
+  pthread_t thread;
+  bool started;
+
+  // Output, only touched on the cpu's thread.
+  uint8_t* output; // bytes not written yet
+  size_t outputSize;
+  size_t outputUsed;
+  uint64_t latency; // ns a byte may wait in `output`, 0 to write each one
+  bool lineBuffered; // write out at every '\n'
+  uint64_t deadline; // when the oldest byte in `output` has waited `latency`
+  uint64_t outputBytes; // written to `out`
+  uint64_t outputWrites; // write calls that took
+} SERIAL;
+
+// Serial thread: blocks until the guest has made room in the ring, see
+// SERIAL_taken, or the cpu has stopped.
+static void SERIAL_waitForSpace(SERIAL* serial) {
+  struct pollfd fds[2] = {
+    { .fd = serial->space, .events = POLLIN },
+    { .fd = serial->stop, .events = POLLIN },
+  };
+  atomic_store(&serial->full, true);
+  // Either SERIAL_taken sees `full`, or this sees what it took.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (RING_space(&serial->input) == 0 && poll(fds, 2, -1) == -1 && errno != EINTR) {
+    perror("poll");
+  }
+  if (fds[0].revents != 0) {
+    uint64_t count;
+    if (read(serial->space, &count, sizeof(count)) == -1) {
+      perror("read");
+    }
+  }
+  atomic_store(&serial->full, false);
+}
+
+// Cpu thread: notes `count` bytes taken from the ring, and wakes the
+// serial thread if it is waiting for space once half the ring has been
+// taken, or the ring has run `dry`. Only then does it pay for the fence.
+static void SERIAL_taken(SERIAL* serial, size_t count, bool dry) {
+  serial->taken += count;
+  if (serial->taken == 0 || (!dry && serial->taken < RING_capacity(&serial->input) / 2)) {
+    return;
+  }
+  serial->taken = 0;
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&serial->full, memory_order_relaxed)
+      && atomic_exchange(&serial->full, false)) {
+    uint64_t one = 1;
+    if (write(serial->space, &one, sizeof(one)) == -1) {
+      perror("write");
+    }
+  }
+}
+
+void* SERIAL_thread(void* data) {
+  SERIAL* serial = data;
+  CPU* cpu = serial->cpu;
+  struct pollfd fds[2] = {
+    { .fd = serial->in, .events = POLLIN },
+    { .fd = serial->stop, .events = POLLIN },
+  };
+
+  while (cpu->running) {
+    uint8_t chunk[SERIAL_CHUNK];
+    size_t space = RING_space(&serial->input);
+    if (space == 0) {
+      // The guest is behind; leave further input with the kernel.
+      SERIAL_waitForSpace(serial);
+      continue;
+    }
+    if (space > sizeof(chunk)) {
+      space = sizeof(chunk);
+    }
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      CPU_stop(cpu);
+      break;
+    }
+    if (fds[1].revents != 0) {
+      break;
+    }
+    if (fds[0].revents == 0) {
+      continue;
+    }
+    ssize_t count = read(serial->in, chunk, space);
+    if (count == -1) {
+      if (errno == EAGAIN || errno == EINTR) continue;
+      perror("read");
+      CPU_stop(cpu);
+      break;
+    }
+    if (count == 0) {
+      // input closed
+      if (serial->stopAtEnd) {
+        CPU_stop(cpu);
+      } else {
+        if (serial->dmaAttached) {
+          DMA_end(&serial->dma);
+        }
+        CPU_raiseInterrupt(cpu, serial->line);
+      }
+      break;
+    }
+    for (ssize_t n = 0; serial->quitKey && n < count; n++) {
+      if (chunk[n] == SERIAL_CTRL_Q) {
+        count = n;
+        CPU_stop(cpu);
+      }
+    }
+    if (count > 0) {
+      RING_write(&serial->input, chunk, count);
+      bool transfer = serial->dmaAttached && DMA_busy(&serial->dma, DMA_IN);
+      if (serial->dmaAttached) {
+        // Even when idle: a DMA_IN issued just now may have missed this.
+        DMA_ready(&serial->dma);
+      }
+      if (!transfer) {
+        CPU_raiseInterrupt(cpu, serial->line);
+      }
+    }
+  }
+  return NULL;
+}
+
+static uint64_t SERIAL_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Writes all of `data` to `out`.
+static void SERIAL_write(SERIAL* serial, const uint8_t* data, size_t length) {
+  size_t done = 0;
+  while (done < length) {
+    ssize_t count = write(serial->out, data + done, length - done);
+    if (count == -1) {
+      if (errno == EINTR) continue;
+      // Drop the rest rather than hang the guest.
+      perror("write");
+      return;
+    }
+    done += count;
+    serial->outputBytes += count;
+    serial->outputWrites++;
+  }
+}
+
+// Writes out buffered output. On the cpu's thread.
+void SERIAL_flush(SERIAL* serial) {
+  if (serial->outputUsed > 0) {
+    SERIAL_write(serial, serial->output, serial->outputUsed);
+    serial->outputUsed = 0;
+  }
+}
+
+// Flushes output that has waited out its latency. Call from the cpu's
+// thread between run slices.
+void SERIAL_poll(SERIAL* serial) {
+  if (serial->outputUsed > 0 && SERIAL_now() >= serial->deadline) {
+    SERIAL_flush(serial);
+  }
+}
+
+uint8_t SERIAL_io(void* ctx, enum DIRECTION dir, uint8_t value) {
+  SERIAL* serial = ctx;
+  if (dir == READ) {
+    uint8_t c = 0;
+    bool popped = RING_pop(&serial->input, &c);
+    SERIAL_taken(serial, popped, !popped);
+    return c;
+  }
+  if (serial->outputUsed == 0) {
+    serial->deadline = SERIAL_now() + serial->latency;
+  }
+  serial->output[serial->outputUsed++] = value;
+  if (serial->outputUsed == serial->outputSize || serial->latency == 0
+      || (value == '\n' && serial->lineBuffered)) {
+    SERIAL_flush(serial);
+  }
+  return 0;
+}
+
+// The DMA side: input from the ring, output through the buffer unless
+// it is too big for it.
+size_t SERIAL_transfer(void* ctx, enum DIRECTION dir, uint8_t* data, size_t length) {
+  SERIAL* serial = ctx;
+  if (dir == READ) {
+    size_t count = RING_read(&serial->input, data, length);
+    SERIAL_taken(serial, count, count < length);
+    return count;
+  }
+  if (serial->latency == 0 || length > serial->outputSize - serial->outputUsed) {
+    SERIAL_flush(serial);
+  }
+  if (serial->latency == 0 || length > serial->outputSize) {
+    SERIAL_write(serial, data, length);
+    return length;
+  }
+  if (serial->outputUsed == 0) {
+    serial->deadline = SERIAL_now() + serial->latency;
+  }
+  memcpy(serial->output + serial->outputUsed, data, length);
+  serial->outputUsed += length;
+  if (serial->outputUsed == serial->outputSize) {
+    SERIAL_flush(serial);
+  }
+  return length;
+}
+
+// Attaches a serial device on bus `port`, buffering up to `size` bytes
+// of input and of output. SERIAL_start starts reading.
+bool SERIAL_init(SERIAL* serial, CPU* cpu, uint8_t port, int in, int out, size_t size) {
+  serial->cpu = cpu;
+  serial->in = in;
+  serial->out = out;
+  serial->quitKey = false;
+  serial->stopAtEnd = true;
+  serial->line = 0;
+  serial->dmaAttached = false;
+  serial->started = false;
+  serial->outputUsed = 0;
+  atomic_init(&serial->full, false);
+  serial->taken = 0;
+  serial->latency = SERIAL_LATENCY;
+  serial->lineBuffered = true;
+  serial->outputBytes = 0;
+  serial->outputWrites = 0;
+  serial->outputSize = size;
+  serial->output = malloc(size);
+  if (serial->output == NULL) {
+    return false;
+  }
+  if (!RING_init(&serial->input, size)) {
+    free(serial->output);
+    return false;
+  }
+  serial->stop = eventfd(0, 0);
+  serial->space = eventfd(0, 0);
+  if (serial->stop == -1 || serial->space == -1) {
+    if (serial->stop != -1) {
+      close(serial->stop);
+    }
+    if (serial->space != -1) {
+      close(serial->space);
+    }
+    RING_free(&serial->input);
+    free(serial->output);
+    return false;
+  }
+  CPU_registerBusCallback(cpu, port, SERIAL_io, serial);
+  return true;
+}
+
+// Adds a DMA channel on bus ports `port` onwards, see dma.c.
+bool SERIAL_attachDMA(SERIAL* serial, uint8_t port) {
+  serial->dmaAttached = DMA_init(&serial->dma, serial->cpu, port, SERIAL_transfer, serial);
+  return serial->dmaAttached;
+}
+
+bool SERIAL_start(SERIAL* serial) {
+  serial->started = pthread_create(&serial->thread, NULL, SERIAL_thread, serial) == 0;
+  return serial->started;
+}
+
+// Flushes output and stops the reader thread started by SERIAL_start.
+// Call once the cpu is no longer running.
+void SERIAL_free(SERIAL* serial) {
+  SERIAL_flush(serial);
+  uint64_t stopped = 1;
+  if (write(serial->stop, &stopped, sizeof(stopped)) == -1) {
+    perror("write");
+  }
+  if (serial->started) {
+    pthread_join(serial->thread, NULL);
+  }
+  close(serial->stop);
+  close(serial->space);
+  RING_free(&serial->input);
+  free(serial->output);
+}
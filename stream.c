@@ -0,0 +1,237 @@
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.c"
+#include "ring.c"
+#include "machine.c"
+#include "image.c"
+#include "dma.c"
+#include "intc.c"
+#include "serial.c"
+#include "mmu.c"
+
+/*
+   irx stream runner
+   Runs a guest as a filter, e.g. `cat big.log | stream prog.img > out`.
+   The serial device reads `in` and writes `out` through buffers big
+   enough to keep the guest busy, and nothing assumes a terminal. When
+   input ends the guest gets a last interrupt and DMA_END on its channel,
+   and the runner exits with A once the guest halts.
+
+   usage: stream [-t|-j] [-s] [-m store] [-i input] [-o output] [image]
+
+   The serial port is bus port 0, its DMA channel ports 1 to 5 and the
+   interrupt controller ports 6 to 9. Serial input raises interrupt line
+   0 and finished transfers line 1. Without an image the built-in guest
+   upper-cases ASCII. -s prints throughput on stderr.
+
+   -m maps the file `store` as extended memory: the MMU is on ports 10 to
+   12, and switches 16 KiB banks of the file into windows at 0x4000 and
+   0x8000, see mmu.c. The file is created if need be, and grown to hold
+   at least two banks.
+   */
+
+#define STREAM_BUFFER_SIZE (1 << 20)
+#define STREAM_SLICE 100000
+#define STREAM_DMA_PORT 1
+#define STREAM_INTC_PORT 6
+#define STREAM_MMU_PORT 10
+#define STREAM_BANK_SIZE (16 * 1024)
+
+#define STREAM_PORT(port, value) OP(SET, 6), port, OP(SET, 0), value, OP(SYS, DATA_OUT)
+
+// Reads a page at a time into 0x1000 through DMA, upper-cases it with
+// LOAD_R/STORE_R and writes it back out, until input ends.
+const uint8_t upper[] = {
+  0x04, 0x00,
+  0x7F, 0x00,
+  STREAM_PORT(1, 0x00),          // 0x04 address 0x1000
+  STREAM_PORT(2, 0x10),
+  STREAM_PORT(3, 0x00),          // 0x0E length 0x0100
+  STREAM_PORT(4, 0x01),
+  STREAM_PORT(5, DMA_IN),        // 0x18
+  OP(SYS, CLEAR_INT),            // 0x1D wait for the transfer
+  OP(SYS, DATA_IN),
+  OP(DEC, 0),                    // 0x1F Z while DMA_BUSY
+  OP(BRCH, 3), 0x27, 0x00,
+  OP(EXT, WAIT),                 // 0x23
+  OP(JMP, 3), 0x1D, 0x00,
+  OP(COPY_OUT, 5),               // 0x27 H: 1 DMA_DONE, 2 DMA_END
+  OP(SET, 6), 1,
+  OP(SYS, DATA_IN),              // 0x2A A: bytes in, 0 for a whole page
+  OP(COPY_OUT, 4),               // 0x2B G: bytes left to convert
+  OP(SET, 0), 0x00,
+  OP(OR, 4),
+  OP(BRCH, 3), 0x39, 0x00,       // 0x2F
+  OP(SET, 0), 0x00,              // 0x32 nothing came in: stop at the end
+  OP(OR, 5),
+  OP(DEC, 0),
+  OP(BRCH, 3), 0x7C, 0x00,       // 0x36
+  OP(SET, 2), 0x00,              // 0x39 CD: the page
+  OP(SET, 3), 0x10,
+  OP(LOAD_R, 0), 1,              // 0x3D
+  OP(SET, 1), 'a',
+  OP(CLF, 0),
+  OP(CMP, 1),
+  OP(BRCH, 0), 0x53, 0x00,       // 0x43 below 'a'
+  OP(SET, 1), 'z' + 1,
+  OP(CLF, 0),
+  OP(CMP, 1),
+  OP(BRCH, 1), 0x53, 0x00,       // 0x4A above 'z'
+  OP(SET, 1), 0x20,
+  OP(CLF, 0),
+  OP(SUB, 1),
+  OP(STORE_R, 0), 1,             // 0x51
+  OP(INC, 2),                    // 0x53
+  OP(COPY_IN, 4),
+  OP(DEC, 0),
+  OP(COPY_OUT, 4),
+  OP(BRCH, 3), 0x3D, 0x00,       // 0x57
+  OP(SET, 6), 1,                 // 0x5A length = bytes in
+  OP(SYS, DATA_IN),
+  OP(SET, 6), 3,
+  OP(SYS, DATA_OUT),
+  STREAM_PORT(1, 0x00),          // 0x60
+  STREAM_PORT(2, 0x10),
+  OP(SET, 0), 0x01,              // 0x6A length high: 1 for a whole page
+  OP(AND, 5),
+  OP(SET, 6), 4,
+  OP(SYS, DATA_OUT),
+  STREAM_PORT(5, DMA_OUT),       // 0x70
+  OP(SET, 0), 0x00,              // 0x75 next page unless input ended
+  OP(OR, 5),
+  OP(DEC, 0),
+  OP(BRCH, 2), 0x04, 0x00,       // 0x79
+  OP(SET, 0), 0x00,              // 0x7C exit status 0
+  OP(SYS, HALT),
+  OP(SYS, CLEAR_INT),            // 0x7F
+  OP(SYS, RETI)
+};
+
+static uint64_t STREAM_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void STREAM_run(CPU* cpu, SERIAL* serial) {
+  while (cpu->running) {
+    if (CPU_runFor(cpu, STREAM_SLICE, NULL) == EXIT_WAIT) {
+      // Waiting for input: let out what the guest has written so far.
+      SERIAL_flush(serial);
+      CPU_idle(cpu);
+    } else {
+      SERIAL_poll(serial);
+    }
+  }
+  SERIAL_flush(serial);
+}
+
+static int STREAM_open(const char* path, int flags) {
+  int fd = open(path, flags, 0644);
+  if (fd == -1) {
+    perror(path);
+    exit(1);
+  }
+  return fd;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: stream [-t|-j] [-s] [-m store] [-i input] [-o output] [image]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char* path = NULL;
+  const char* store = NULL;
+  int in = STDIN_FILENO, out = STDOUT_FILENO;
+  CORE core = CORE_SWITCH;
+  bool stats = false;
+  for (int n = 1; n < argc; n++) {
+    if (strcmp(argv[n], "-t") == 0) {
+      core = CORE_THREADED;
+    } else if (strcmp(argv[n], "-j") == 0) {
+      core = CORE_JIT;
+    } else if (strcmp(argv[n], "-s") == 0) {
+      stats = true;
+    } else if (strcmp(argv[n], "-m") == 0 && n + 1 < argc) {
+      store = argv[++n];
+    } else if (strcmp(argv[n], "-i") == 0 && n + 1 < argc) {
+      in = STREAM_open(argv[++n], O_RDONLY);
+    } else if (strcmp(argv[n], "-o") == 0 && n + 1 < argc) {
+      out = STREAM_open(argv[++n], O_WRONLY | O_CREAT | O_TRUNC);
+    } else if (argv[n][0] != '-' && path == NULL) {
+      path = argv[n];
+    } else {
+      usage();
+    }
+  }
+
+  MACHINE* machine = calloc(1, sizeof(MACHINE));
+  CPU* cpu = &machine->cpu;
+  MACHINE_init(machine, 0);
+  CPU_setCore(cpu, core);
+  IMAGE image = { 0 };
+  if (path != NULL) {
+    if (!IMAGE_open(&image, path)) {
+      return 1;
+    }
+    IMAGE_load(&image, machine);
+  } else {
+    MACHINE_load(machine, upper, sizeof(upper));
+  }
+
+  SERIAL serial;
+  INTC intc;
+  if (!SERIAL_init(&serial, cpu, 0, in, out, STREAM_BUFFER_SIZE)
+      || !SERIAL_attachDMA(&serial, STREAM_DMA_PORT)
+      || !INTC_init(&intc, cpu, STREAM_INTC_PORT)) {
+    fprintf(stderr, "stream: no serial device\n");
+    return 1;
+  }
+  serial.dma.line = 1;
+  MMU mmu;
+  if (store != NULL) {
+    struct stat st;
+    size_t size = stat(store, &st) == 0 ? (size_t)st.st_size : 0;
+    if (size < 2 * STREAM_BANK_SIZE) {
+      size = 2 * STREAM_BANK_SIZE;
+    }
+    if (!MMU_init(&mmu, cpu, STREAM_MMU_PORT, STREAM_BANK_SIZE, size, store)
+        || !MMU_addWindow(&mmu, 0x4000) || !MMU_addWindow(&mmu, 0x8000)) {
+      fprintf(stderr, "stream: no extended memory\n");
+      return 1;
+    }
+  }
+  // Nobody reads this as it comes: fill the buffer before writing.
+  serial.lineBuffered = false;
+  serial.stopAtEnd = false;
+  uint64_t start = STREAM_now();
+  if (!SERIAL_start(&serial)) {
+    fprintf(stderr, "stream: no serial thread\n");
+    return 1;
+  }
+  STREAM_run(cpu, &serial);
+  SERIAL_free(&serial);
+  double seconds = (STREAM_now() - start) / 1e9;
+
+  int status = cpu->a;
+  if (cpu->exit != EXIT_HALT) {
+    fprintf(stderr, "stream: invalid instruction at 0x%04X\n", cpu->ip);
+    status = 1;
+  }
+  if (stats) {
+    uint64_t bytes = serial.dmaAttached ? serial.dma.bytes : 0;
+    fprintf(stderr, "stream: %llu bytes out in %llu writes, %.3fs, %.1f MB/s out, "
+        "%llu DMA bytes, %.1f guest M/s\n", (unsigned long long)serial.outputBytes,
+        (unsigned long long)serial.outputWrites, seconds, serial.outputBytes / seconds / 1e6,
+        (unsigned long long)bytes, cpu->retired / seconds / 1e6);
+  }
+  MACHINE_free(machine);
+  if (store != NULL) {
+    MMU_free(&mmu);
+  }
+  IMAGE_close(&image);
+  free(machine);
+  return status;
+}
@@ -1,14 +1,20 @@
-#include <pthread.h>
 #include <ctype.h>
 #include <termios.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include "cpu.c"
+#include "ring.c"
+#include "machine.c"
+#include "image.c"
+#include "dma.c"
+#include "intc.c"
+#include "serial.c"
 
 
-#define ROM_SIZE (16)
-#define MEMORY_SIZE (64 * 1024 - ROM_SIZE)
+#define ROM_SIZE (32)
+#define TERM_DMA_PORT 1 // the serial DMA channel, ports 1 to 5
+#define TERM_INTC_PORT 6 // the interrupt controller, ports 6 to 9
 
 struct termios orig_termios;
 void die(const char *s) {
@@ -28,111 +34,112 @@ void enableRawMode() {
   raw.c_oflag &= ~(OPOST);
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-  raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 }
 
-char buf[256];
-uint8_t bufPtr = 1;
-uint8_t readPtr = 0;
-
-#define CTRL_KEY(k) ((k) & 0x1f)
-void* SERIAL_thread(void *data) {
-  CPU* cpu = data;
+#define TERM_SLICE 100000
 
+void TERM_run(CPU* cpu, SERIAL* serial) {
   while (cpu->running) {
-    char c = '\0';
-    size_t count = 0;
-    if ((count = read(STDIN_FILENO, &c, 1)) == -1 && errno != EAGAIN) die("read");
-    if (count > 0) {
-      if (iscntrl(c)) {
-        if (c == CTRL_KEY('q')) {
-          cpu->running = false;
-          break;
-        }
-      }
-      buf[bufPtr++] = c;
-      CPU_raiseInterrupt(cpu, 0);
+    if (CPU_runFor(cpu, TERM_SLICE, NULL) == EXIT_WAIT) {
+      // Guest is idle: show what it wrote, then sleep until the serial
+      // thread raises an interrupt.
+      SERIAL_flush(serial);
+      CPU_idle(cpu);
+    } else {
+      SERIAL_poll(serial);
     }
   }
-  return NULL;
+  SERIAL_flush(serial);
 }
 
-void TERM_run(CPU* cpu) {
-  while (cpu->running) {
-    CPU_step(cpu);
-  }
-}
+int main(int argc, char *argv[]) {
+  enableRawMode();
 
-uint8_t SERIAL_io(enum DIRECTION dir, uint8_t value) {
-  if (dir == READ) {
-    return buf[readPtr++];
+  MACHINE* machine = calloc(1, sizeof(MACHINE));
+  CPU* cpu = &machine->cpu;
+  const char* path = NULL;
+  for (int n = 1; n < argc; n++) {
+    if (strcmp(argv[n], "-L") == 0) {
+      n++;
+    } else if (argv[n][0] != '-') {
+      path = argv[n];
+    }
   }
-  if (dir == WRITE) {
-    write(STDOUT_FILENO, &value, 1);
-    return 0;
+  // An image maps its own ROM.
+  MACHINE_init(machine, path != NULL ? 0 : ROM_SIZE);
+  IMAGE image = { 0 };
+  if (path != NULL && !IMAGE_open(&image, path)) {
+    return 1;
   }
-  return 0;
-}
-
-uint8_t RAM[MEMORY_SIZE];
-uint8_t ROM[ROM_SIZE];
-
-uint8_t accessMemory(enum DIRECTION dir, uint16_t addr, uint8_t value) {
-  if (dir == READ) {
-    if (addr < ROM_SIZE) {
-      return ROM[addr];
-    } else {
-      return RAM[addr - ROM_SIZE];
-    }
-  } else {
-    if (addr >= ROM_SIZE) {
-      RAM[addr - ROM_SIZE] = value;
+  SERIAL serial;
+  if (!SERIAL_init(&serial, cpu, 0, STDIN_FILENO, STDOUT_FILENO, SERIAL_BUFFER_SIZE)) die("serial");
+  serial.quitKey = true;
+  if (!SERIAL_attachDMA(&serial, TERM_DMA_PORT)) die("serial");
+  // Serial input on line 0, finished transfers on line 1.
+  serial.dma.line = 1;
+  INTC intc;
+  if (!INTC_init(&intc, cpu, TERM_INTC_PORT)) die("intc");
+  for (int n = 1; n < argc; n++) {
+    if (strcmp(argv[n], "-t") == 0) {
+      CPU_setCore(cpu, CORE_THREADED);
+    } else if (strcmp(argv[n], "-j") == 0) {
+      CPU_setCore(cpu, CORE_JIT);
+    } else if (strcmp(argv[n], "-l") == 0) {
+      // JIT in lockstep with the interpreter
+      CPU_setCore(cpu, CORE_JIT);
+      JIT_setLockstep(cpu, true);
+    } else if (strcmp(argv[n], "-L") == 0 && n + 1 < argc) {
+      // Output latency in microseconds, 0 for a write per byte.
+      serial.latency = strtoull(argv[++n], NULL, 0) * 1000;
     }
   }
-  return 0;
-}
-
-int main(int argc, char *argv[]) {
-  enableRawMode();
-
-  CPU cpu;
-  CPU_init(&cpu);
-  CPU_registerBusCallback(&cpu, 0, SERIAL_io);
-  CPU_registerMemCallback(&cpu, accessMemory);
-  pthread_t thread;
-  pthread_create(&thread, NULL, SERIAL_thread, &cpu);
+  if (!SERIAL_start(&serial)) die("serial");
 
   uint8_t program[] = {
     // Little-endian execution start address.
     0x04, 0x00,
     // Little-endian execution interupt
-    0x0A, 0x00,
+    0x0B, 0x00,
     // Main loop
     OP(SEF, 4),
     OP(SET, 7), 0x00,
+    // sleep until an interrupt
+    OP(EXT, WAIT),
     OP(JMP, 3), 0x07, 0x00,
     // Interrupt
     // clear interupt count
     OP(SYS, CLEAR_INT),
-    // Read from device bus
+    // Read from device bus until it runs dry
     OP(SYS, DATA_IN),
+    // select the serial port in E, Z is set when A is 0
+    OP(SET, 6), 0x00,
+    OP(BRCH, 2), 0x17, 0x00,
     // store character
     OP(COPY_OUT, 1),
     // write to terminal
     OP(SYS, DATA_OUT),
+    OP(JMP, 3), 0x0C, 0x00,
     // RETI
-    OP(SYS, RETI),
-    OP(SYS, NOOP)
+    OP(SYS, RETI)
   };
 
-  memcpy(ROM, &program, sizeof(program));
-  CPU_prime(&cpu);
-  TERM_run(&cpu);
-  pthread_join(thread, NULL);
+  if (path != NULL) {
+    IMAGE_load(&image, machine);
+  } else {
+    MACHINE_load(machine, program, sizeof(program));
+  }
+  TERM_run(cpu, &serial);
+  SERIAL_free(&serial);
   disableRawMode();
   write(STDOUT_FILENO, "\n\r", 1);
-  CPU_dump(&cpu);
+  CPU_dump(cpu);
+  printf("serial: %llu bytes in %llu writes\n", (unsigned long long)serial.outputBytes,
+      (unsigned long long)serial.outputWrites);
+  MACHINE_free(machine);
+  IMAGE_close(&image);
+  free(machine);
   return 0;
 }
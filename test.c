@@ -0,0 +1,1313 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "cpu.c"
+#include "ring.c"
+#include "machine.c"
+
+/*
+   irx tests
+   Checks the parts of the cpu whose mistakes a guest rarely shows
+   straight away, against reference models written out the long way.
+
+   usage: test [name...]
+
+   Runs every test, or the ones named, and exits non-zero if any failed.
+   A failing test reports the first case that went wrong.
+   */
+
+#define TEST_LIST(X) \
+  X(flags) \
+  X(blocks) \
+  X(postInc) \
+  X(idle) \
+  X(lockstep) \
+  X(jit)
+
+static uint32_t TEST_seed = 1;
+
+static uint32_t TEST_random(void) {
+  TEST_seed = TEST_seed * 1103515245 + 12345;
+  return TEST_seed >> 8;
+}
+
+/*
+   Flags
+
+   Every ALU, pair, load/store and flag instruction over all 8-bit operands,
+   with the carry coming in directly and pending from each lazy op, checked
+   against eager flags: what each instruction set before flags were lazy,
+   quirks included. Every branch condition is tested on the lazy state
+   before CPU_flags folds it. Then every instruction after every other,
+   with random operands and flags coming in.
+   */
+
+#define TEST_PAGE 0x40 // loads and stores stay in this page
+
+typedef struct {
+  uint8_t r[8];
+  uint8_t f;
+  uint8_t memory[PAGE_SIZE]; // TEST_PAGE
+} TEST_STATE;
+
+static void TEST_flag(uint8_t* f, uint8_t flag, bool set) {
+  *f = set ? *f | flag : *f & ~flag;
+}
+
+// One instruction with eager flags. Only touches TEST_PAGE.
+static void TEST_eager(TEST_STATE* s, uint8_t kind, uint8_t field, uint16_t operand) {
+  uint8_t* r = s->r;
+  uint8_t a = r[0];
+  uint8_t b = r[field];
+  uint8_t carry = (s->f & FLAG_C) != 0;
+  switch (kind) {
+    case H_ADD: {
+      uint16_t result = a + b + carry;
+      r[0] = result;
+      TEST_flag(&s->f, FLAG_Z, r[0] == 0);
+      TEST_flag(&s->f, FLAG_O, ~(a ^ b) & (a ^ result) & 0x80);
+      TEST_flag(&s->f, FLAG_C, result & 0x100);
+      TEST_flag(&s->f, FLAG_N, result & 0x80);
+      break;
+    }
+    case H_SUB:
+    case H_CMP: {
+      int16_t result = a - (b + carry);
+      if (kind == H_SUB) {
+        r[0] = result;
+      }
+      // CMP tested the 16-bit result, SUB the register.
+      TEST_flag(&s->f, FLAG_Z, kind == H_SUB ? r[0] == 0 : result == 0);
+      TEST_flag(&s->f, FLAG_O, (a ^ b) & (a ^ result) & 0x80);
+      TEST_flag(&s->f, FLAG_C, result < 0);
+      TEST_flag(&s->f, FLAG_N, result & 0x80);
+      break;
+    }
+    case H_MUL: {
+      uint16_t result = a * b;
+      r[0] = result;
+      r[1] = result >> 8;
+      TEST_flag(&s->f, FLAG_O, ~(a ^ b) & (a ^ result) & 0x80);
+      TEST_flag(&s->f, FLAG_Z, result == 0);
+      break;
+    }
+    case H_AND: r[0] &= b; TEST_flag(&s->f, FLAG_Z, r[0] == 0); break;
+    case H_OR: r[0] |= b; TEST_flag(&s->f, FLAG_Z, r[0] == 0); break;
+    case H_XOR: r[0] ^= b; TEST_flag(&s->f, FLAG_Z, r[0] == 0); break;
+    case H_NOT: r[0] = ~b; TEST_flag(&s->f, FLAG_Z, r[0] == 0); break;
+    case H_SET:
+      r[field] = operand;
+      TEST_flag(&s->f, FLAG_Z, r[0] == 0);
+      break;
+    case H_INC:
+    case H_DEC:
+      r[field] += kind == H_INC ? 1 : -1;
+      // Z came from A whichever register was stepped.
+      TEST_flag(&s->f, FLAG_Z, r[0] == 0);
+      TEST_flag(&s->f, FLAG_N, r[field] & 0x80);
+      break;
+    // SHL and RTL tested bit 8 of a byte for the carry, so never set it.
+    case H_SHL: r[field] = b << 1; break;
+    case H_SHR: r[field] = b >> 1; s->f &= ~FLAG_C; break;
+    case H_RTL: r[field] = (b << 1) | (b >> 7); break;
+    case H_RTR:
+      r[field] = (b >> 1) | (b << 7);
+      if (b & 1) {
+        s->f |= FLAG_C;
+      }
+      break;
+    case H_CLF: s->f &= ~(1 << field); break;
+    case H_SEF: s->f |= 1 << field; break;
+    case H_COPY_IN: r[0] = b; break;
+    case H_COPY_OUT: r[field] = a; break;
+    case H_LOAD_I:
+    case H_LOAD_R:
+    case H_STORE_I:
+    case H_STORE_R: {
+      uint16_t addr = kind == H_LOAD_I || kind == H_STORE_I ? operand
+        : (r[operand * 2 + 1] << 8) | r[operand * 2];
+      if (kind == H_LOAD_I || kind == H_LOAD_R) {
+        r[field] = s->memory[addr & 0xFF];
+      } else {
+        s->memory[addr & 0xFF] = r[field];
+      }
+      s->f &= ~FLAGS_ALU;
+      break;
+    }
+    case H_INC16:
+    case H_DEC16: {
+      uint8_t* pair = &r[(operand & 3) * 2];
+      uint16_t result = ((pair[1] << 8) | pair[0]) + (kind == H_INC16 ? 1 : -1);
+      pair[0] = result;
+      pair[1] = result >> 8;
+      TEST_flag(&s->f, FLAG_Z, result == 0);
+      TEST_flag(&s->f, FLAG_N, result & 0x8000);
+      break;
+    }
+    case H_ADD16:
+    case H_CMP16: {
+      uint8_t* first = &r[((operand >> 4) & 3) * 2];
+      uint8_t* second = &r[(operand & 3) * 2];
+      uint16_t x = (first[1] << 8) | first[0];
+      uint16_t y = (second[1] << 8) | second[0];
+      uint16_t result = kind == H_ADD16 ? x + y : x - y;
+      if (kind == H_ADD16) {
+        first[0] = result;
+        first[1] = result >> 8;
+        TEST_flag(&s->f, FLAG_C, x + y > 0xFFFF);
+        TEST_flag(&s->f, FLAG_O, ~(x ^ y) & (x ^ result) & 0x8000);
+      } else {
+        TEST_flag(&s->f, FLAG_C, x < y);
+        TEST_flag(&s->f, FLAG_O, (x ^ y) & (x ^ result) & 0x8000);
+      }
+      TEST_flag(&s->f, FLAG_Z, result == 0);
+      TEST_flag(&s->f, FLAG_N, result & 0x8000);
+      break;
+    }
+    case H_SWAP: {
+      uint8_t src = operand & 0x7;
+      uint8_t dest = (operand >> 4) & 0x7;
+      uint8_t swap = r[dest];
+      r[dest] = r[src];
+      r[src] = swap;
+      s->f &= ~FLAGS_ALU;
+      break;
+    }
+  }
+}
+
+static const uint8_t TEST_flagKinds[] = {
+  H_ADD, H_SUB, H_CMP, H_MUL, H_AND, H_OR, H_XOR, H_NOT, H_SET, H_INC, H_DEC,
+  H_SHL, H_SHR, H_RTL, H_RTR, H_CLF, H_SEF, H_COPY_IN, H_COPY_OUT,
+  H_LOAD_I, H_LOAD_R, H_STORE_I, H_STORE_R, H_SWAP,
+  H_INC16, H_DEC16, H_ADD16, H_CMP16,
+};
+#define TEST_FLAG_KINDS (int)sizeof(TEST_flagKinds)
+
+static bool TEST_isPairOp(uint8_t kind) {
+  return kind == H_INC16 || kind == H_DEC16 || kind == H_ADD16 || kind == H_CMP16;
+}
+
+// The operand `kind` takes for input `y`, keeping memory in TEST_PAGE,
+// SWAP to A-G, with the ignored bits 3 and 7 from `y`, and the 16-bit
+// ops to AB and CD.
+static uint16_t TEST_operand(uint8_t kind, uint8_t y) {
+  if (TEST_isPairOp(kind)) {
+    return y & 0x11;
+  }
+  switch (kind) {
+    case H_SET: return y;
+    case H_LOAD_I:
+    case H_STORE_I: return (TEST_PAGE << 8) | y;
+    case H_LOAD_R:
+    case H_STORE_R: return 2; // GH, with H kept at TEST_PAGE
+    case H_SWAP: return ((y >> 4) % 5 << 4) | (y & 0xF) % 5 | (y & 0x88);
+  }
+  return 0;
+}
+
+// Loads the registers and flags of `s` into the cpu, the flags either
+// directly or left pending by running `prefix` on `pa` and `pb`, from
+// flags `f`, first.
+static void TEST_enter(CPU* cpu, uint8_t* memory, const TEST_STATE* s,
+    int prefix, uint8_t pa, uint8_t pb, uint8_t f) {
+  if (prefix >= 0) {
+    CPU_setFlags(cpu, f);
+    cpu->a = pa;
+    cpu->b = pb;
+    CPU_handlerFunctions[prefix](cpu, 1, 0);
+  } else {
+    CPU_setFlags(cpu, s->f);
+  }
+  memcpy(cpu->registers, s->r, sizeof(s->r));
+  memcpy(memory + (TEST_PAGE << 8), s->memory, PAGE_SIZE);
+}
+
+// Compares the cpu with `s`, branches first, and says how they differ.
+static bool TEST_compare(CPU* cpu, const TEST_STATE* s, const char* what) {
+  for (int condition = 0; condition < 8; condition++) {
+    bool taken = (s->f & (1 << (condition / 2))) != ((condition % 2) << (condition / 2));
+    if (CPU_branchTaken(cpu, condition) != taken) {
+      printf("  %s: branch %d %s, want %s (flags %02X)\n", what, condition,
+          taken ? "not taken" : "taken", taken ? "taken" : "not taken", s->f);
+      return false;
+    }
+  }
+  uint8_t f = CPU_flags(cpu);
+  if (f != s->f || memcmp(cpu->registers, s->r, sizeof(s->r)) != 0) {
+    printf("  %s: flags %02X, want %02X; A %02X B %02X, want %02X %02X\n", what, f, s->f,
+        cpu->a, cpu->b, s->r[0], s->r[1]);
+    return false;
+  }
+  return true;
+}
+
+// The eager flags `prefix` leaves on `pa` and `pb`, from flags `f`.
+static uint8_t TEST_prefixFlags(int prefix, uint8_t pa, uint8_t pb, uint8_t f) {
+  TEST_STATE s = { .r = { pa, pb }, .f = f };
+  TEST_eager(&s, prefix, 1, 0);
+  return s.f;
+}
+
+static bool TEST_flags(void) {
+  CPU* cpu = calloc(1, sizeof(CPU));
+  uint8_t* memory = calloc(1, 0x10000);
+  CPU_init(cpu);
+  CPU_mapMemory(cpu, 0, 0x10000, memory, PAGE_READ | PAGE_WRITE);
+  TEST_STATE s;
+  for (int n = 0; n < PAGE_SIZE; n++) {
+    s.memory[n] = n * 37 + 11;
+  }
+
+  // Ways in: flags set directly, or C and O pending from ADD, SUB, CMP or MUL,
+  // each with carry clear and set.
+  struct { int prefix; uint8_t pa, pb; uint8_t f; } ways[] = {
+    { -1, 0, 0, 0 }, { -1, 0, 0, FLAG_C }, { -1, 0, 0, 0xFF & ~FLAG_C }, { -1, 0, 0, 0xFF },
+    { H_ADD, 0x01, 0x02, 0 }, { H_ADD, 0xF0, 0x20, 0 }, { H_ADD, 0x70, 0x10, 0 },
+    { H_SUB, 0x05, 0x03, 0 }, { H_SUB, 0x03, 0x05, 0 }, { H_SUB, 0x80, 0x01, 0 },
+    { H_CMP, 0x00, 0x01, FLAG_I }, { H_MUL, 0x40, 0x02, FLAG_C }, { H_MUL, 0x02, 0x03, 0 },
+  };
+  int wayCount = sizeof(ways) / sizeof(ways[0]);
+  uint64_t cases = 0;
+  for (int k = 0; k < TEST_FLAG_KINDS; k++) {
+    uint8_t kind = TEST_flagKinds[k];
+    bool flagOp = kind == H_CLF || kind == H_SEF;
+    // The 16-bit ops take their pairs from the field instead.
+    static const uint8_t pairs[] = { 0x00, 0x01, 0x10, 0x02 };
+    bool pairOp = TEST_isPairOp(kind);
+    for (int field = 0; field < (flagOp ? 8 : pairOp ? 4 : 2); field++) {
+      for (int w = 0; w < wayCount; w++) {
+        for (int x = 0; x < 256; x++) {
+          for (int y = 0; y < 256; y++) {
+            memset(s.r, 0, sizeof(s.r));
+            s.r[0] = x;
+            s.r[1] = y;
+            s.r[2] = y;
+            s.r[3] = x;
+            s.r[4] = y;
+            s.r[5] = TEST_PAGE;
+            s.f = ways[w].prefix >= 0
+              ? TEST_prefixFlags(ways[w].prefix, ways[w].pa, ways[w].pb, ways[w].f)
+              : ways[w].f;
+            uint16_t operand = pairOp ? pairs[field] : TEST_operand(kind, y);
+            TEST_enter(cpu, memory, &s, ways[w].prefix, ways[w].pa, ways[w].pb, ways[w].f);
+            CPU_handlerFunctions[kind](cpu, field, operand);
+            TEST_eager(&s, kind, field, operand);
+            cases++;
+            if (!TEST_compare(cpu, &s, CPU_handlerNames[kind])) {
+              printf("  field %d, A %02X, y %02X, way in %d\n", field, x, y, w);
+              return false;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Pairs, with random flags coming in and fields A to G.
+  for (int k1 = 0; k1 < TEST_FLAG_KINDS; k1++) {
+    for (int k2 = 0; k2 < TEST_FLAG_KINDS; k2++) {
+      for (int n = 0; n < 256; n++) {
+        uint8_t kinds[2] = { TEST_flagKinds[k1], TEST_flagKinds[k2] };
+        for (int r = 0; r < 5; r++) {
+          s.r[r] = TEST_random();
+        }
+        s.r[5] = TEST_PAGE;
+        s.r[6] = TEST_random();
+        s.r[7] = TEST_random();
+        s.f = TEST_random();
+        TEST_enter(cpu, memory, &s, -1, 0, 0, 0);
+        for (int i = 0; i < 2; i++) {
+          bool flagOp = kinds[i] == H_CLF || kinds[i] == H_SEF;
+          uint8_t field = TEST_random() % (flagOp ? 8 : 5);
+          uint16_t operand = TEST_operand(kinds[i], TEST_random());
+          CPU_handlerFunctions[kinds[i]](cpu, field, operand);
+          TEST_eager(&s, kinds[i], field, operand);
+        }
+        cases++;
+        if (!TEST_compare(cpu, &s, CPU_handlerNames[kinds[1]])
+            || memcmp(memory + (TEST_PAGE << 8), s.memory, PAGE_SIZE) != 0) {
+          printf("  after %s\n", CPU_handlerNames[kinds[0]]);
+          return false;
+        }
+      }
+    }
+  }
+  printf("  %llu cases\n", (unsigned long long)cases);
+  CPU_free(cpu);
+  free(cpu);
+  free(memory);
+  return true;
+}
+
+/*
+   Block transfers
+
+   MOVE, FILL and COMPARE against the byte loops they stand for, over a
+   table of lengths and of placements around page boundaries, overlaps
+   and the wrap past 0xFFFF. The table runs with every page plain memory,
+   then with the pages in reverse order in host memory, so that a run
+   crossing a page has to be split, and then with a MMIO page and a ROM
+   page in the way as well. COMPARE gets
+   blocks that differ first at chosen offsets, either way round.
+   */
+
+#define TEST_MMIO_PAGE 0x80
+#define TEST_ROM_PAGE 0x90
+
+// A page of memory behind a callback.
+static uint8_t TEST_mmio(void* ctx, enum DIRECTION dir, uint16_t addr, uint8_t value) {
+  uint8_t* page = ctx;
+  if (dir == READ) {
+    return page[addr & 0xFF];
+  }
+  page[addr & 0xFF] = value;
+  return 0;
+}
+
+static uint8_t TEST_rom(void* ctx, enum DIRECTION dir, uint16_t addr, uint8_t value) {
+  return 0;
+}
+
+static void TEST_poke(uint8_t* m, uint16_t addr, uint8_t value, bool rom) {
+  if (!rom || addr >> 8 != TEST_ROM_PAGE) {
+    m[addr] = value;
+  }
+}
+
+// One block instruction, a byte at a time; `rom` drops writes to
+// TEST_ROM_PAGE.
+static void TEST_blockModel(TEST_STATE* s, uint8_t* m, uint8_t kind, bool rom) {
+  uint8_t* r = s->r;
+  uint16_t first = (r[1] << 8) | r[0];
+  uint16_t second = (r[3] << 8) | r[2];
+  uint16_t length = (r[5] << 8) | r[4];
+  switch (kind) {
+    case H_MOVE:
+      // Down from the last byte when the destination starts in the source.
+      if (second != first && (uint16_t)(second - first) < length) {
+        for (uint16_t n = length; n > 0; n--) {
+          TEST_poke(m, second + n - 1, m[(uint16_t)(first + n - 1)], rom);
+        }
+      } else {
+        for (uint16_t n = 0; n < length; n++) {
+          TEST_poke(m, second + n, m[(uint16_t)(first + n)], rom);
+        }
+      }
+      s->f &= ~FLAGS_ALU;
+      break;
+    case H_FILL:
+      for (uint16_t n = 0; n < length; n++) {
+        TEST_poke(m, second + n, r[0], rom);
+      }
+      s->f &= ~FLAGS_ALU;
+      break;
+    case H_COMPARE: {
+      uint16_t offset = 0;
+      uint8_t a = 0, b = 0;
+      for (; offset < length; offset++) {
+        a = m[(uint16_t)(first + offset)];
+        b = m[(uint16_t)(second + offset)];
+        if (a != b) {
+          break;
+        }
+      }
+      if (offset == length) {
+        a = b = 0;
+      }
+      r[4] = offset;
+      r[5] = offset >> 8;
+      // A CMP of the bytes that differ, without carry.
+      int16_t result = a - b;
+      TEST_flag(&s->f, FLAG_Z, result == 0);
+      TEST_flag(&s->f, FLAG_O, (a ^ b) & (a ^ result) & 0x80);
+      TEST_flag(&s->f, FLAG_C, result < 0);
+      TEST_flag(&s->f, FLAG_N, result & 0x80);
+      break;
+    }
+  }
+}
+
+static bool TEST_blocks(void) {
+  static const uint16_t lengths[] = {
+    0, 1, 2, 3, 255, 256, 257, 511, 512, 700, 0x1000, 0x7FFF, 0x8001, 0xFFFF,
+  };
+  static const uint16_t starts[] = {
+    0x0000, 0x0001, 0x10FF, 0x1100, 0x7FF0, TEST_MMIO_PAGE << 8, (TEST_ROM_PAGE << 8) - 3,
+    0xFF00, 0xFFF0, 0xFFFF,
+  };
+  static const int16_t apart[] = { 0, 1, -1, 2, -2, 3, 255, -255, 256, -256, 257, 4000, -4000 };
+  static const uint8_t kinds[] = { H_MOVE, H_FILL, H_COMPARE };
+  CPU* cpu = calloc(1, sizeof(CPU));
+  uint8_t* memory = malloc(0x10000);
+  uint8_t* model = malloc(0x10000); // as the guest sees it
+  uint8_t* pages[PAGE_COUNT]; // where each guest page is in `memory`
+  CPU_init(cpu);
+  uint64_t cases = 0;
+  bool ok = true;
+  for (int layout = 0; layout < 3 && ok; layout++) {
+    bool rom = layout == 2;
+    for (int page = 0; page < PAGE_COUNT; page++) {
+      pages[page] = memory + (layout == 0 ? page : PAGE_COUNT - 1 - page) * PAGE_SIZE;
+      CPU_mapMemory(cpu, page << 8, PAGE_SIZE, pages[page], PAGE_READ | PAGE_WRITE);
+    }
+    if (rom) {
+      CPU_mapMMIO(cpu, TEST_MMIO_PAGE << 8, PAGE_SIZE, TEST_mmio, pages[TEST_MMIO_PAGE]);
+      CPU_mapReadOnly(cpu, TEST_ROM_PAGE << 8, PAGE_SIZE, pages[TEST_ROM_PAGE], TEST_rom, NULL);
+    }
+    for (int n = 0; n < 0x10000; n++) {
+      model[n] = TEST_random();
+    }
+    for (int page = 0; page < PAGE_COUNT; page++) {
+      memcpy(pages[page], model + (page << 8), PAGE_SIZE);
+    }
+    for (size_t k = 0; k < sizeof(kinds) && ok; k++) {
+      for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]) && ok; l++) {
+        for (size_t st = 0; st < sizeof(starts) / sizeof(starts[0]) && ok; st++) {
+          for (size_t d = 0; d < sizeof(apart) / sizeof(apart[0]) && ok; d++) {
+            uint16_t length = lengths[l];
+            uint16_t first = starts[st];
+            uint16_t second = first + apart[d];
+            // COMPARE: the second block a copy of the first, differing
+            // from some offset on, if at all.
+            int differ = -1;
+            if (kinds[k] == H_COMPARE && length > 0 && apart[d] != 0) {
+              uint16_t offsets[] = { 0, 1, length / 2, length - 1, length };
+              differ = offsets[cases % 5];
+              for (uint16_t n = 0; n < differ; n++) {
+                model[(uint16_t)(second + n)] = model[(uint16_t)(first + n)];
+              }
+              if (differ < length) {
+                model[(uint16_t)(second + differ)] += cases % 2 ? 1 : -1;
+              }
+              for (int page = 0; page < PAGE_COUNT; page++) {
+                memcpy(pages[page], model + (page << 8), PAGE_SIZE);
+              }
+            }
+            TEST_STATE s = { .f = TEST_random() };
+            for (int r = 0; r < 8; r++) {
+              s.r[r] = TEST_random();
+            }
+            s.r[0] = first;
+            s.r[1] = first >> 8;
+            s.r[2] = second;
+            s.r[3] = second >> 8;
+            s.r[4] = length;
+            s.r[5] = length >> 8;
+            CPU_setFlags(cpu, s.f);
+            memcpy(cpu->registers, s.r, sizeof(s.r));
+            CPU_handlerFunctions[kinds[k]](cpu, 0, 0);
+            TEST_blockModel(&s, model, kinds[k], rom);
+            cases++;
+            bool same = TEST_compare(cpu, &s, CPU_handlerNames[kinds[k]]);
+            for (int page = 0; page < PAGE_COUNT && same; page++) {
+              same = memcmp(pages[page], model + (page << 8), PAGE_SIZE) == 0;
+            }
+            if (!same) {
+              printf("  %s from %04X to %04X, %u bytes%s, differing at %d\n",
+                  CPU_handlerNames[kinds[k]], first, second, length,
+                  layout == 0 ? "" : rom ? ", pages reversed, MMIO and ROM" : ", pages reversed",
+                  differ);
+              ok = false;
+            }
+          }
+        }
+      }
+    }
+  }
+  printf("  %llu cases\n", (unsigned long long)cases);
+  CPU_free(cpu);
+  free(cpu);
+  free(memory);
+  free(model);
+  return ok;
+}
+
+/*
+   Post-increment
+
+   LOAD_R and STORE_R with and without POST_INC, into and from every
+   register, through every pair, at addresses where the step carries into
+   the high byte or wraps. A LOAD_R into a register of its own pair keeps
+   the loaded value; a STORE_R stores the register before the step.
+   */
+
+static bool TEST_postInc(void) {
+  static const uint16_t addresses[] = {
+    0x0000, 0x0001, (TEST_PAGE << 8) | 0x7F, (TEST_PAGE << 8) | 0xFF, 0x00FF, 0xFFFE, 0xFFFF,
+  };
+  CPU* cpu = calloc(1, sizeof(CPU));
+  uint8_t* memory = malloc(0x10000);
+  uint8_t* model = malloc(0x10000);
+  CPU_init(cpu);
+  CPU_mapMemory(cpu, 0, 0x10000, memory, PAGE_READ | PAGE_WRITE);
+  for (int n = 0; n < 0x10000; n++) {
+    memory[n] = model[n] = TEST_random();
+  }
+  uint64_t cases = 0;
+  for (int store = 0; store < 2; store++) {
+    for (int field = 0; field < 8; field++) {
+      for (int pair = 0; pair < 4; pair++) {
+        for (int step = 0; step < 2; step++) {
+          for (size_t n = 0; n < sizeof(addresses) / sizeof(addresses[0]); n++) {
+            uint16_t addr = addresses[n];
+            TEST_STATE s = { .f = TEST_random() };
+            for (int r = 0; r < 8; r++) {
+              s.r[r] = TEST_random();
+            }
+            s.r[pair * 2] = addr;
+            s.r[pair * 2 + 1] = addr >> 8;
+            uint8_t operand = pair | (step ? POST_INC : 0);
+            CPU_setFlags(cpu, s.f);
+            memcpy(cpu->registers, s.r, sizeof(s.r));
+            CPU_handlerFunctions[store ? H_STORE_R : H_LOAD_R](cpu, field, operand);
+
+            uint8_t value = store ? s.r[field] : model[addr];
+            if (store) {
+              model[addr] = value;
+            }
+            if (step) {
+              s.r[pair * 2] = addr + 1;
+              s.r[pair * 2 + 1] = (uint16_t)(addr + 1) >> 8;
+            }
+            if (!store) {
+              s.r[field] = value;
+            }
+            s.f &= ~FLAGS_ALU;
+            cases++;
+            if (!TEST_compare(cpu, &s, store ? "STORE_R" : "LOAD_R")
+                || memcmp(memory, model, 0x10000) != 0) {
+              printf("  %s %d through pair %d%s at %04X\n", store ? "STORE_R" : "LOAD_R",
+                  field, pair, step ? " with POST_INC" : "", addr);
+              for (int r = 0; r < 8; r++) {
+                printf("  r%d %02X, want %02X\n", r, cpu->registers[r], s.r[r]);
+              }
+              return false;
+            }
+          }
+        }
+      }
+    }
+  }
+  printf("  %llu cases\n", (unsigned long long)cases);
+  CPU_free(cpu);
+  free(cpu);
+  free(memory);
+  free(model);
+  return true;
+}
+
+/*
+   Idle loops
+
+   Guests that spin waiting for interrupts, in a JMP to itself and in a
+   loop polling memory, while a host thread raises TEST_RAISES interrupts
+   TEST_GAP_MS apart. The cpu has to park in the loop, service every
+   interrupt, and account whole trips round it for the time it was parked:
+   no more than the clock allows at the idle rate, and most of it, since
+   the cpu spends most of the run parked. At rate 0 nothing is accounted.
+   A loop counting down is never taken for idle.
+   */
+
+#define TEST_RAISES 5
+#define TEST_GAP_MS 20
+#define TEST_IDLE_CODE 0x0100
+#define TEST_IDLE_HANDLER 0x0200
+#define TEST_IDLE_FLAG 0x0300
+
+typedef struct {
+  CPU* cpu;
+  pthread_t thread;
+} TEST_RAISER;
+
+static void* TEST_raise(void* data) {
+  TEST_RAISER* raiser = data;
+  for (int n = 0; n < TEST_RAISES; n++) {
+    struct timespec gap = { 0, TEST_GAP_MS * 1000000L };
+    nanosleep(&gap, NULL);
+    CPU_raiseInterrupt(raiser->cpu, 0);
+  }
+  return NULL;
+}
+
+// Runs `code` to HALT, parking like a host would, with the interrupt
+// handler counting interrupts in D and halting at TEST_RAISES. The
+// handler keeps A and B for the loop it interrupts.
+static bool TEST_idleRun(const char* what, const uint8_t* code, size_t size,
+    uint64_t rate, int length) {
+  static const uint8_t handler[] = {
+    OP(SYS, CLEAR_INT),
+    OP(PUSH, 0),
+    OP(PUSH, 1),
+    OP(INC, 3),
+    OP(COPY_IN, 3),
+    OP(SET, 1), TEST_RAISES,
+    OP(CLF, 0),
+    OP(CMP, 1),
+    OP(BRCH, 2), (TEST_IDLE_HANDLER + 16) & 0xFF, TEST_IDLE_HANDLER >> 8,
+    OP(POP, 1),
+    OP(POP, 0),
+    OP(SYS, RETI),
+    OP(SYS, NOOP),
+    OP(SYS, HALT), // + 16
+  };
+  CPU* cpu = calloc(1, sizeof(CPU));
+  uint8_t* memory = calloc(1, 0x10000);
+  memory[0] = TEST_IDLE_CODE & 0xFF;
+  memory[1] = TEST_IDLE_CODE >> 8;
+  memory[2] = TEST_IDLE_HANDLER & 0xFF;
+  memory[3] = TEST_IDLE_HANDLER >> 8;
+  memcpy(memory + TEST_IDLE_CODE, code, size);
+  memcpy(memory + TEST_IDLE_HANDLER, handler, sizeof(handler));
+  CPU_init(cpu);
+  CPU_mapMemory(cpu, 0, 0x10000, memory, PAGE_READ | PAGE_WRITE);
+  CPU_setCore(cpu, CORE_THREADED);
+  CPU_setIdleRate(cpu, rate);
+  CPU_prime(cpu);
+
+  TEST_RAISER raiser = { cpu };
+  uint64_t start = CPU_now();
+  pthread_create(&raiser.thread, NULL, TEST_raise, &raiser);
+  int parks = 0;
+  while (cpu->running) {
+    if (CPU_runFor(cpu, 100000, NULL) == EXIT_WAIT) {
+      parks++;
+      CPU_idle(cpu);
+    }
+  }
+  pthread_join(raiser.thread, NULL);
+  uint64_t elapsed = CPU_now() - start;
+
+  uint64_t most = elapsed / 1000 * rate / 1000000;
+  bool ok = cpu->exit == EXIT_HALT && cpu->d == TEST_RAISES && parks >= TEST_RAISES
+    && cpu->idleLength == (uint64_t)length && cpu->idleSkipped % length == 0
+    && cpu->idleSkipped <= most && cpu->idleSkipped >= most / 2;
+  printf("  %s at %llu/s: %d parks, %d interrupts, %llu skipped in %.1f ms\n", what,
+      (unsigned long long)rate, parks, cpu->d, (unsigned long long)cpu->idleSkipped,
+      elapsed / 1e6);
+  if (!ok) {
+    printf("  want %d interrupts, whole trips of %d, at most %llu and at least half\n",
+        TEST_RAISES, length, (unsigned long long)most);
+  }
+  CPU_free(cpu);
+  free(cpu);
+  free(memory);
+  return ok;
+}
+
+static bool TEST_idle(void) {
+  static const uint8_t spin[] = {
+    OP(SEF, 4),
+    OP(JMP, 3), (TEST_IDLE_CODE + 1) & 0xFF, TEST_IDLE_CODE >> 8,
+  };
+  static const uint8_t poll[] = {
+    OP(SEF, 4),
+    OP(LOAD_I, 0), TEST_IDLE_FLAG & 0xFF, TEST_IDLE_FLAG >> 8, // + 1
+    OP(SET, 1), 0,
+    OP(CLF, 0),
+    OP(CMP, 1),
+    OP(BRCH, 2), (TEST_IDLE_CODE + 1) & 0xFF, TEST_IDLE_CODE >> 8,
+    OP(SYS, HALT),
+  };
+  bool ok = TEST_idleRun("JMP to itself", spin, sizeof(spin), CPU_IDLE_RATE, 1)
+    && TEST_idleRun("polling", poll, sizeof(poll), CPU_IDLE_RATE, 5)
+    && TEST_idleRun("polling", poll, sizeof(poll), 0, 5);
+  if (!ok) {
+    return false;
+  }
+
+  static const uint8_t countdown[] = {
+    OP(SEF, 4),
+    OP(SET, 0), 200,
+    OP(DEC, 0), // + 3
+    OP(BRCH, 3), (TEST_IDLE_CODE + 3) & 0xFF, TEST_IDLE_CODE >> 8,
+    OP(SYS, HALT),
+  };
+  CPU* cpu = calloc(1, sizeof(CPU));
+  uint8_t* memory = calloc(1, 0x10000);
+  memcpy(memory + TEST_IDLE_CODE, countdown, sizeof(countdown));
+  CPU_init(cpu);
+  CPU_mapMemory(cpu, 0, 0x10000, memory, PAGE_READ | PAGE_WRITE);
+  CPU_setCore(cpu, CORE_THREADED);
+  cpu->ip = TEST_IDLE_CODE;
+  EXIT exit;
+  do {
+    exit = CPU_runFor(cpu, 7, NULL);
+  } while (exit == EXIT_BUDGET);
+  printf("  counting down: %llu instructions, %llu skipped\n",
+      (unsigned long long)cpu->retired, (unsigned long long)cpu->idleSkipped);
+  ok = exit == EXIT_HALT && cpu->retired == 2 + 2 * 200 + 1 && cpu->idleSkipped == 0;
+  CPU_free(cpu);
+  free(cpu);
+  free(memory);
+  return ok;
+}
+
+/*
+   Lockstep
+
+   Random programs run on every core side by side, a few instructions at
+   a time, and the cores have to agree after every slice: the switch core
+   is the reference for the threaded core with and without
+   superinstructions and for the JIT. Programs lean on the runs that get
+   fused, and raise interrupts from the bus in the middle of them as well
+   as from the host between slices. Some stores and MOVEs rewrite
+   immediates of code that may be cached or compiled by then.
+   */
+
+#define TEST_CORES 4
+#define TEST_PROGRAMS 200
+#define TEST_SLICES 2000
+#define TEST_CODE 0x0100 // programs, up to TEST_CODE_SIZE bytes
+#define TEST_CODE_SIZE 0x200
+#define TEST_HANDLER 0x0080
+#define TEST_TRAP_PORT 3 // I/O on it ends the slice
+
+static const char* const TEST_coreNames[TEST_CORES] = {
+  "switch", "threaded", "threaded unfused", "jit"
+};
+
+typedef struct {
+  uint8_t code[TEST_CODE_SIZE];
+  int length;
+  uint16_t starts[TEST_CODE_SIZE]; // instruction addresses
+  int startCount;
+  uint16_t immediates[TEST_CODE_SIZE]; // addresses of SET immediates
+  int immediateCount;
+  uint16_t jumps[TEST_CODE_SIZE]; // code offsets of jump targets to fill in
+  int jumpCount;
+  // Code offsets of the low and high bytes of addresses to point at SET
+  // immediates, for STORE_I and MOVE to rewrite.
+  uint16_t rewrites[TEST_CODE_SIZE][2];
+  int rewriteCount;
+} TEST_PROGRAM;
+
+static void TEST_byte(TEST_PROGRAM* p, uint8_t value) {
+  p->code[p->length++] = value;
+}
+
+// Starts an instruction.
+static void TEST_op(TEST_PROGRAM* p, uint8_t instruction) {
+  p->starts[p->startCount++] = TEST_CODE + p->length;
+  TEST_byte(p, instruction);
+}
+
+static void TEST_set(TEST_PROGRAM* p, uint8_t field, uint8_t value) {
+  TEST_op(p, OP(SET, field));
+  p->immediates[p->immediateCount++] = TEST_CODE + p->length;
+  TEST_byte(p, value);
+}
+
+// A SET that nothing rewrites, for addresses and lengths.
+static void TEST_setFixed(TEST_PROGRAM* p, uint8_t field, uint8_t value) {
+  TEST_op(p, OP(SET, field));
+  TEST_byte(p, value);
+}
+
+static void TEST_rewrite(TEST_PROGRAM* p, uint16_t low, uint16_t high) {
+  p->rewrites[p->rewriteCount][0] = low;
+  p->rewrites[p->rewriteCount][1] = high;
+  p->rewriteCount++;
+}
+
+// An address operand, filled in once the program is laid out.
+static void TEST_target(TEST_PROGRAM* p, uint16_t* fixups, int* count) {
+  fixups[(*count)++] = p->length;
+  TEST_byte(p, 0);
+  TEST_byte(p, 0);
+}
+
+static void TEST_branch(TEST_PROGRAM* p) {
+  TEST_op(p, OP(BRCH, TEST_random() % 8));
+  TEST_target(p, p->jumps, &p->jumpCount);
+}
+
+static const uint8_t TEST_aluOps[] = {
+  ADD, SUB, CMP, MUL, AND, OR, XOR, NOT, INC, DEC,
+  SHL, SHR, RTL, RTR, COPY_IN, COPY_OUT,
+};
+
+static void TEST_alu(TEST_PROGRAM* p) {
+  TEST_op(p, OP(TEST_aluOps[TEST_random() % sizeof(TEST_aluOps)], TEST_random() % 8));
+}
+
+// Register pairs 0 to 3 in bits 0-1 and 4-5, as the 16-bit ops take them.
+static uint8_t TEST_pairs(void) {
+  return TEST_random() & 0x33;
+}
+
+static void TEST_generate(TEST_PROGRAM* p) {
+  memset(p, 0, sizeof(*p));
+  while (p->length < TEST_CODE_SIZE - 16) {
+    uint8_t r = TEST_random() % 8;
+    switch (TEST_random() % 16) {
+      case 0:
+      case 1:
+        TEST_alu(p);
+        break;
+      case 2:
+        TEST_set(p, r, TEST_random());
+        break;
+      case 3:
+        // Interrupts start on, and are only now and then turned off.
+        if (TEST_random() % 8 == 0) {
+          TEST_op(p, OP(TEST_random() % 2 ? SEF : CLF, 4));
+        } else {
+          TEST_op(p, OP(TEST_random() % 2 ? SEF : CLF, TEST_random() % 4));
+        }
+        break;
+      case 4:
+        TEST_branch(p);
+        break;
+      case 5:
+        TEST_set(p, r, TEST_random());
+        TEST_op(p, OP(TEST_random() % 2 ? SUB : CMP, r));
+        TEST_branch(p);
+        break;
+      case 6:
+        switch (TEST_random() % 4) {
+          case 0: TEST_op(p, OP(DEC, r)); break;
+          case 1: TEST_op(p, OP(TEST_random() % 2 ? SUB : CMP, r)); break;
+          case 2: TEST_op(p, OP(EXT, DEC16)); TEST_byte(p, TEST_pairs()); break;
+          case 3: TEST_op(p, OP(EXT, CMP16)); TEST_byte(p, TEST_pairs()); break;
+        }
+        TEST_branch(p);
+        break;
+      case 7:
+        TEST_op(p, OP(TEST_random() % 2 ? PUSH : POP, r));
+        TEST_op(p, OP(TEST_random() % 2 ? PUSH : POP, TEST_random() % 8));
+        break;
+      case 8:
+        // The bus raises an interrupt on some values; see TEST_bus.
+        TEST_set(p, 6, TEST_random() % 8);
+        if (TEST_random() % 4 == 0) {
+          TEST_op(p, OP(SYS, DATA_IN));
+        } else {
+          TEST_op(p, OP(COPY_OUT, r));
+          TEST_op(p, OP(SYS, DATA_OUT));
+        }
+        break;
+      case 9:
+        TEST_op(p, OP(TEST_random() % 2 ? LOAD_I : STORE_I, r));
+        TEST_byte(p, TEST_random());
+        TEST_byte(p, TEST_PAGE);
+        break;
+      case 10:
+        // Self-modifying code.
+        TEST_op(p, OP(STORE_I, r));
+        TEST_rewrite(p, p->length, p->length + 1);
+        TEST_byte(p, 0);
+        TEST_byte(p, 0);
+        break;
+      case 11:
+        TEST_setFixed(p, 5, TEST_PAGE);
+        TEST_op(p, OP(TEST_random() % 2 ? LOAD_R : STORE_R, r));
+        TEST_byte(p, 2 | (TEST_random() % 2 ? POST_INC : 0));
+        break;
+      case 12:
+        switch (TEST_random() % 8) {
+          case 0: TEST_op(p, OP(SYS, RET)); break;
+          case 1: TEST_op(p, OP(JMP, 7)); TEST_target(p, p->jumps, &p->jumpCount); break;
+          default: TEST_op(p, OP(JMP, 3)); TEST_target(p, p->jumps, &p->jumpCount); break;
+        }
+        break;
+      case 13:
+        switch (TEST_random() % 4) {
+          case 0: TEST_op(p, OP(EXT, (INC16 + TEST_random() % 4))); TEST_byte(p, TEST_pairs()); break;
+          case 1: TEST_op(p, OP(SYS, SWAP)); TEST_byte(p, TEST_random()); break;
+          case 2: TEST_op(p, OP(SYS, NOOP)); break;
+          case 3: TEST_alu(p); break;
+        }
+        break;
+      case 14:
+        // A block op within TEST_PAGE and the page after, from wherever A
+        // and C point.
+        TEST_setFixed(p, 1, TEST_PAGE);
+        TEST_setFixed(p, 3, TEST_PAGE);
+        TEST_setFixed(p, 4, TEST_random() % 48);
+        TEST_setFixed(p, 5, 0);
+        switch (TEST_random() % 3) {
+          case 0: TEST_op(p, OP(MOVE, 0)); break;
+          case 1: TEST_op(p, OP(FILL, 0)); break;
+          case 2: TEST_op(p, OP(COMPARE, 0)); TEST_branch(p); break;
+        }
+        break;
+      case 15:
+        // MOVE a byte of data over an immediate.
+        TEST_setFixed(p, 1, TEST_PAGE);
+        TEST_setFixed(p, 2, 0);
+        TEST_rewrite(p, p->length - 1, p->length + 1);
+        TEST_setFixed(p, 3, 0);
+        TEST_setFixed(p, 4, 1);
+        TEST_setFixed(p, 5, 0);
+        TEST_op(p, OP(MOVE, 0));
+        break;
+    }
+  }
+  TEST_op(p, OP(JMP, 3));
+  TEST_byte(p, TEST_CODE & 0xFF);
+  TEST_byte(p, TEST_CODE >> 8);
+
+  for (int n = 0; n < p->jumpCount; n++) {
+    uint16_t target = p->starts[TEST_random() % p->startCount];
+    p->code[p->jumps[n]] = target & 0xFF;
+    p->code[p->jumps[n] + 1] = target >> 8;
+  }
+  for (int n = 0; n < p->rewriteCount; n++) {
+    uint16_t target = p->immediateCount > 0
+      ? p->immediates[TEST_random() % p->immediateCount] : TEST_PAGE << 8;
+    p->code[p->rewrites[n][0]] = target & 0xFF;
+    p->code[p->rewrites[n][1]] = target >> 8;
+  }
+}
+
+typedef struct {
+  CPU cpu;
+  uint8_t memory[0x10000];
+} TEST_MACHINE;
+
+// Every port: reads give something that depends on the state, and
+// writes of a multiple of 8 raise the interrupt line in the top bits.
+static uint8_t TEST_bus(void* ctx, enum DIRECTION dir, uint8_t value) {
+  CPU* cpu = &((TEST_MACHINE*)ctx)->cpu;
+  if (dir == READ) {
+    return cpu->ip * 7 + cpu->b;
+  }
+  if ((value & 7) == 0) {
+    CPU_raiseInterrupt(cpu, value >> 5);
+  }
+  return 0;
+}
+
+// The stack page of some programs, which behaves like memory but raises
+// an interrupt on the same writes as TEST_bus, in the middle of a PUSH
+// run or an interrupt entry.
+static uint8_t TEST_stack(void* ctx, enum DIRECTION dir, uint16_t addr, uint8_t value) {
+  TEST_MACHINE* machine = ctx;
+  if (dir == READ) {
+    return machine->memory[addr];
+  }
+  machine->memory[addr] = value;
+  if ((value & 7) == 0) {
+    CPU_raiseInterrupt(&machine->cpu, value >> 5);
+  }
+  return 0;
+}
+
+static bool TEST_same(CPU* cpu, const uint8_t* memory, CPU* ref, const uint8_t* refMemory,
+    bool allMemory) {
+  if (memcmp(cpu->registers, ref->registers, sizeof(cpu->registers)) != 0
+      || cpu->ip != ref->ip || CPU_flags(cpu) != CPU_flags(ref)
+      || cpu->retired != ref->retired || cpu->running != ref->running
+      || cpu->waiting != ref->waiting || cpu->exit != ref->exit
+      || atomic_load(&cpu->i) != atomic_load(&ref->i)) {
+    printf("  ip %04X f %02X retired %llu i %02X, want ip %04X f %02X retired %llu i %02X\n",
+        cpu->ip, cpu->f, (unsigned long long)cpu->retired, atomic_load(&cpu->i),
+        ref->ip, ref->f, (unsigned long long)ref->retired, atomic_load(&ref->i));
+    for (int n = 0; n < 8; n++) {
+      printf("  r%d %02X, want %02X\n", n, cpu->registers[n], ref->registers[n]);
+    }
+    return false;
+  }
+  // Pages the programs write on purpose, or everything.
+  static const uint8_t pages[] = { 0x00, 0x01, 0x02, TEST_PAGE, TEST_PAGE + 1, 0xFF };
+  for (size_t n = 0; n < (allMemory ? PAGE_COUNT : sizeof(pages)); n++) {
+    uint16_t base = (allMemory ? n : pages[n]) << 8;
+    if (memcmp(memory + base, refMemory + base, PAGE_SIZE) != 0) {
+      printf("  memory differs in page %02X\n", base >> 8);
+      return false;
+    }
+  }
+  return true;
+}
+
+// A block cached at every offset of page 01, filling the whole cache, and
+// then a store of HALT over 0100 from the page itself and a jump there.
+// Page 01 is INC B up to the store at 01FC and JMP CD at 01FF.
+static bool TEST_crowdedPage(void) {
+  TEST_MACHINE* machines[TEST_CORES];
+  bool ok = true;
+  for (int c = 0; c < TEST_CORES; c++) {
+    TEST_MACHINE* machine = machines[c] = calloc(1, sizeof(TEST_MACHINE));
+    CPU* cpu = &machine->cpu;
+    uint8_t* page = machine->memory + 0x0100;
+    memset(page, OP(INC, 1), 0xFC);
+    page[0xFC] = OP(STORE_I, 0);
+    page[0xFD] = 0x00;
+    page[0xFE] = 0x01;
+    page[0xFF] = OP(JMP, 1);
+    CPU_init(cpu);
+    CPU_mapMemory(cpu, 0, 0x10000, machine->memory, PAGE_READ | PAGE_WRITE);
+    CPU_setIdleDetection(cpu, false);
+    CPU_setCore(cpu, c == 0 ? CORE_SWITCH : c == 3 ? CORE_JIT : CORE_THREADED);
+    CPU_setFusion(cpu, c != 2);
+    cpu->a = OP(SYS, HALT);
+    cpu->c = 0x00;
+    cpu->d = 0x01;
+    // One instruction from every offset but the store's.
+    for (int offset = 0; offset < PAGE_SIZE; offset++) {
+      if (offset != 0xFC) {
+        cpu->ip = 0x0100 + offset;
+        CPU_runFor(cpu, 1, NULL);
+      }
+    }
+    cpu->ip = 0x01FC;
+    CPU_runFor(cpu, 1000, NULL);
+    if (cpu->running || cpu->ip != 0x0101) {
+      printf("  %s: crowded page ran on to ip %04X, want a HALT at 0100\n",
+          TEST_coreNames[c], cpu->ip);
+      ok = false;
+    } else if (c > 0 && !TEST_same(cpu, machine->memory, &machines[0]->cpu,
+        machines[0]->memory, true)) {
+      printf("  %s: crowded page\n", TEST_coreNames[c]);
+      ok = false;
+    }
+  }
+  for (int c = 0; c < TEST_CORES; c++) {
+    CPU_free(&machines[c]->cpu);
+    free(machines[c]);
+  }
+  return ok;
+}
+
+static bool TEST_lockstep(void) {
+  TEST_PROGRAM* program = malloc(sizeof(TEST_PROGRAM));
+  TEST_MACHINE* machines[TEST_CORES];
+  CPU* cpus[TEST_CORES];
+  uint8_t* memories[TEST_CORES];
+  uint64_t slices = 0, instructions = 0;
+  bool ok = TEST_crowdedPage();
+  for (int n = 0; n < TEST_PROGRAMS && ok; n++) {
+    uint32_t seed = TEST_seed;
+    TEST_generate(program);
+    uint8_t data[PAGE_SIZE], registers[8];
+    for (int i = 0; i < PAGE_SIZE; i++) {
+      data[i] = TEST_random();
+    }
+    for (int i = 0; i < 8; i++) {
+      registers[i] = TEST_random();
+    }
+    uint8_t handler[] = {
+      OP(SYS, CLEAR_INT), OP(TEST_aluOps[TEST_random() % sizeof(TEST_aluOps)], TEST_random() % 6),
+      OP(SYS, RETI),
+    };
+    for (int c = 0; c < TEST_CORES; c++) {
+      TEST_MACHINE* machine = machines[c] = calloc(1, sizeof(TEST_MACHINE));
+      CPU* cpu = cpus[c] = &machine->cpu;
+      uint8_t* memory = memories[c] = machine->memory;
+      memory[0] = TEST_CODE & 0xFF;
+      memory[1] = TEST_CODE >> 8;
+      memory[2] = TEST_HANDLER & 0xFF;
+      memory[3] = TEST_HANDLER >> 8;
+      memcpy(memory + TEST_HANDLER, handler, sizeof(handler));
+      memcpy(memory + TEST_CODE, program->code, program->length);
+      memcpy(memory + (TEST_PAGE << 8), data, PAGE_SIZE);
+      CPU_init(cpu);
+      CPU_mapMemory(cpu, 0, 0x10000, memory, PAGE_READ | PAGE_WRITE);
+      for (int port = 0; port < 256; port++) {
+        CPU_registerBusCallback(cpu, port, TEST_bus, machine);
+      }
+      if (n % 4 == 1) {
+        CPU_mapMMIO(cpu, 0xFF00, PAGE_SIZE, TEST_stack, machine);
+      }
+      CPU_trapBus(cpu, TEST_TRAP_PORT, true);
+      // Parked idle loops are accounted by the clock.
+      CPU_setIdleDetection(cpu, false);
+      CPU_setCore(cpu, c == 0 ? CORE_SWITCH : c == 3 ? CORE_JIT : CORE_THREADED);
+      CPU_setFusion(cpu, c != 2);
+      CPU_prime(cpu);
+      memcpy(cpu->registers, registers, sizeof(registers));
+      CPU_setFlags(cpu, FLAG_I);
+    }
+
+    for (int slice = 0; slice < TEST_SLICES && ok && cpus[0]->running; slice++) {
+      uint64_t budget = TEST_random() % 4 ? 1 + TEST_random() % 9 : 10 + TEST_random() % 500;
+      bool raise = TEST_random() % 16 == 0;
+      uint8_t line = TEST_random() % CPU_LINES;
+      EXIT exits[TEST_CORES];
+      uint64_t retired[TEST_CORES];
+      for (int c = 0; c < TEST_CORES; c++) {
+        if (raise) {
+          CPU_raiseInterrupt(cpus[c], line);
+        }
+        exits[c] = CPU_runFor(cpus[c], budget, &retired[c]);
+      }
+      bool last = slice == TEST_SLICES - 1 || !cpus[0]->running;
+      for (int c = 1; c < TEST_CORES && ok; c++) {
+        if (exits[c] != exits[0] || retired[c] != retired[0]
+            || !TEST_same(cpus[c], memories[c], cpus[0], memories[0], last)) {
+          printf("  %s: program %d (seed %u), slice %d of %llu: exit %d after %llu, "
+              "want %d after %llu\n", TEST_coreNames[c], n, seed, slice,
+              (unsigned long long)budget, exits[c], (unsigned long long)retired[c],
+              exits[0], (unsigned long long)retired[0]);
+          ok = false;
+        }
+      }
+      slices++;
+      instructions += retired[0];
+    }
+    for (int c = 0; c < TEST_CORES; c++) {
+      CPU_free(cpus[c]);
+      free(machines[c]);
+    }
+  }
+  printf("  %llu slices, %llu instructions\n", (unsigned long long)slices,
+      (unsigned long long)instructions);
+  free(program);
+  return ok;
+}
+
+/*
+   JIT
+
+   Loops of the register-only instructions the JIT translates, run on the
+   switch and JIT cores side by side long enough to be compiled, and then
+   entered again from fresh registers and flags. A loop branches back on
+   a random condition, and falling out of it runs an ALU instruction on
+   the way round, so native code is also entered with C and O pending.
+   Some loops have a store in the middle, which the JIT leaves to the
+   interpreter.
+   */
+
+#define TEST_JIT_PROGRAMS 2000
+#define TEST_JIT_SLICES 200
+
+static void TEST_jitOp(TEST_PROGRAM* p) {
+  switch (TEST_random() % 8) {
+    case 0:
+    case 1:
+    case 2:
+      TEST_alu(p);
+      break;
+    case 3:
+      TEST_set(p, TEST_random() % 8, TEST_random());
+      break;
+    case 4: {
+      // Any flag but I.
+      uint8_t flag = TEST_random() % 7;
+      TEST_op(p, OP(TEST_random() % 2 ? SEF : CLF, flag < 4 ? flag : flag + 1));
+      break;
+    }
+    case 5:
+      TEST_op(p, OP(EXT, (INC16 + TEST_random() % 4)));
+      TEST_byte(p, TEST_pairs());
+      break;
+    case 6:
+      TEST_op(p, OP(SYS, SWAP));
+      TEST_byte(p, TEST_random() & 0x77);
+      break;
+    case 7:
+      TEST_op(p, OP(SYS, NOOP));
+      break;
+  }
+}
+
+static void TEST_jitProgram(TEST_PROGRAM* p) {
+  memset(p, 0, sizeof(*p));
+  int length = 1 + TEST_random() % (BLOCK_MAX - 2);
+  int split = TEST_random() % 4 == 0 ? (int)(TEST_random() % length) : -1;
+  for (int n = 0; n < length; n++) {
+    if (n == split) {
+      TEST_op(p, OP(STORE_I, TEST_random() % 8));
+      TEST_byte(p, TEST_random());
+      TEST_byte(p, TEST_PAGE);
+    }
+    TEST_jitOp(p);
+  }
+  TEST_op(p, TEST_random() % 4 == 0 ? OP(JMP, 3) : OP(BRCH, TEST_random() % 8));
+  TEST_byte(p, TEST_CODE & 0xFF);
+  TEST_byte(p, TEST_CODE >> 8);
+  TEST_alu(p);
+  TEST_op(p, OP(JMP, 3));
+  TEST_byte(p, TEST_CODE & 0xFF);
+  TEST_byte(p, TEST_CODE >> 8);
+}
+
+static bool TEST_jit(void) {
+  TEST_PROGRAM* program = malloc(sizeof(TEST_PROGRAM));
+  TEST_MACHINE* machines[2];
+  uint64_t instructions = 0, native = 0;
+  bool ok = true;
+  for (int n = 0; n < TEST_JIT_PROGRAMS && ok; n++) {
+    uint32_t seed = TEST_seed;
+    TEST_jitProgram(program);
+    for (int c = 0; c < 2; c++) {
+      TEST_MACHINE* machine = machines[c] = calloc(1, sizeof(TEST_MACHINE));
+      CPU* cpu = &machine->cpu;
+      machine->memory[0] = TEST_CODE & 0xFF;
+      machine->memory[1] = TEST_CODE >> 8;
+      memcpy(machine->memory + TEST_CODE, program->code, program->length);
+      CPU_init(cpu);
+      CPU_mapMemory(cpu, 0, 0x10000, machine->memory, PAGE_READ | PAGE_WRITE);
+      CPU_setIdleDetection(cpu, false);
+      CPU_setCore(cpu, c == 0 ? CORE_SWITCH : CORE_JIT);
+      CPU_prime(cpu);
+    }
+    CPU* ref = &machines[0]->cpu;
+    CPU* cpu = &machines[1]->cpu;
+
+    for (int slice = 0; slice < TEST_JIT_SLICES && ok; slice++) {
+      if (slice % 16 == 0) {
+        // Half of them where carries and overflows happen.
+        static const uint8_t edges[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+        uint8_t registers[8];
+        for (int r = 0; r < 8; r++) {
+          registers[r] = TEST_random() % 2 ? edges[TEST_random() % 5] : TEST_random();
+        }
+        uint8_t f = TEST_random();
+        for (int c = 0; c < 2; c++) {
+          memcpy(machines[c]->cpu.registers, registers, sizeof(registers));
+          CPU_setFlags(&machines[c]->cpu, f);
+        }
+      }
+      uint64_t budget = TEST_random() % 2 ? 1 + TEST_random() % 16 : 1 + TEST_random() % 1000;
+      uint64_t retired, refRetired;
+      EXIT exit = CPU_runFor(cpu, budget, &retired);
+      EXIT refExit = CPU_runFor(ref, budget, &refRetired);
+      if (exit != refExit || retired != refRetired
+          || !TEST_same(cpu, machines[1]->memory, ref, machines[0]->memory, false)) {
+        printf("  program %d (seed %u), slice %d of %llu: exit %d after %llu, "
+            "want %d after %llu\n", n, seed, slice, (unsigned long long)budget,
+            exit, (unsigned long long)retired, refExit, (unsigned long long)refRetired);
+        ok = false;
+      }
+      instructions += refRetired;
+    }
+    for (int b = 0; b < BLOCK_CACHE_SIZE; b++) {
+      native += cpu->blocks[b].native != NULL;
+    }
+    for (int c = 0; c < 2; c++) {
+      CPU_free(&machines[c]->cpu);
+      free(machines[c]);
+    }
+  }
+  printf("  %llu instructions, %llu blocks compiled\n", (unsigned long long)instructions,
+      (unsigned long long)native);
+  free(program);
+  return ok;
+}
+
+#define X_TEST(name) { #name, TEST_##name },
+static const struct { const char* name; bool (*run)(void); } TEST_tests[] = {
+  TEST_LIST(X_TEST)
+};
+#undef X_TEST
+
+int main(int argc, char* argv[]) {
+  int failures = 0;
+  for (size_t t = 0; t < sizeof(TEST_tests) / sizeof(TEST_tests[0]); t++) {
+    bool named = argc == 1;
+    for (int n = 1; n < argc; n++) {
+      named |= strcmp(argv[n], TEST_tests[t].name) == 0;
+    }
+    if (!named) {
+      continue;
+    }
+    printf("%s\n", TEST_tests[t].name);
+    // The same cases whichever tests run.
+    TEST_seed = 1;
+    bool ok = TEST_tests[t].run();
+    printf("%s: %s\n", TEST_tests[t].name, ok ? "ok" : "FAILED");
+    failures += !ok;
+  }
+  return failures == 0 ? 0 : 1;
+}
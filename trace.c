@@ -0,0 +1,222 @@
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+   irx execution trace
+   Streams a cpu's TRACE_RECORDs to a file without slowing the guest down
+   to the speed of the disk. The cpu's thread appends each record to a
+   lock-free ring; a drain thread copies the ring into the file through a
+   sliding mmap window. When the ring is full the cpu waits for the drain
+   thread, so no record is ever lost.
+
+   File layout, little-endian:
+     0  "IRXT"
+     4  u16 version, TRACE_VERSION
+     6  u16 record size, sizeof(TRACE_RECORD)
+     8  records, in execution order
+
+   Needs a build with -DCPU_TRACE, and ring.c.
+   */
+
+#define TRACE_MAGIC "IRXT"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 8
+#define TRACE_RING_SIZE (1 << 20)
+#define TRACE_WINDOW_SIZE (16 << 20) // the file grows a window at a time
+
+typedef struct TRACE_t {
+  TRACER tracer;
+  CPU* cpu;
+  RING ring;
+  int fd;
+  uint8_t* window; // mapping of the file from windowStart
+  size_t windowStart;
+  size_t size; // bytes of the file written so far
+  _Atomic bool stopping;
+  pthread_t thread;
+} TRACE;
+
+// Called by the cpu for every instruction.
+void TRACE_emit(void* ctx, const TRACE_RECORD* record) {
+  TRACE* trace = ctx;
+  const uint8_t* bytes = (const uint8_t*)record;
+  size_t written = RING_write(&trace->ring, bytes, sizeof(TRACE_RECORD));
+  while (written < sizeof(TRACE_RECORD)) {
+    sched_yield();
+    written += RING_write(&trace->ring, bytes + written, sizeof(TRACE_RECORD) - written);
+  }
+}
+
+// Moves the window so that it covers trace->size.
+static bool TRACE_advance(TRACE* trace) {
+  if (trace->window != NULL) {
+    munmap(trace->window, TRACE_WINDOW_SIZE);
+    trace->window = NULL;
+    trace->windowStart += TRACE_WINDOW_SIZE;
+  }
+  if (ftruncate(trace->fd, trace->windowStart + TRACE_WINDOW_SIZE) == -1) {
+    perror("trace");
+    return false;
+  }
+  void* window = mmap(NULL, TRACE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+      trace->fd, trace->windowStart);
+  if (window == MAP_FAILED) {
+    perror("trace");
+    return false;
+  }
+  trace->window = window;
+  return true;
+}
+
+void* TRACE_thread(void* data) {
+  TRACE* trace = data;
+  while (true) {
+    if (trace->size == trace->windowStart + TRACE_WINDOW_SIZE && !TRACE_advance(trace)) {
+      // Out of disk: stop the guest rather than drop records silently.
+      CPU_stop(trace->cpu);
+      break;
+    }
+    size_t offset = trace->size - trace->windowStart;
+    size_t count = RING_read(&trace->ring, trace->window + offset, TRACE_WINDOW_SIZE - offset);
+    trace->size += count;
+    if (count == 0) {
+      if (atomic_load(&trace->stopping) && RING_used(&trace->ring) == 0) {
+        break;
+      }
+      usleep(100);
+    }
+  }
+  return NULL;
+}
+
+// Creates `path` and starts tracing `cpu` into it.
+bool TRACE_start(TRACE* trace, CPU* cpu, const char* path) {
+  trace->cpu = cpu;
+  trace->tracer.emit = TRACE_emit;
+  trace->tracer.ctx = trace;
+  trace->window = NULL;
+  trace->windowStart = 0;
+  atomic_init(&trace->stopping, false);
+  trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (trace->fd == -1) {
+    perror(path);
+    return false;
+  }
+  if (!RING_init(&trace->ring, TRACE_RING_SIZE)) {
+    close(trace->fd);
+    return false;
+  }
+  if (!TRACE_advance(trace)) {
+    RING_free(&trace->ring);
+    close(trace->fd);
+    return false;
+  }
+  memcpy(trace->window, TRACE_MAGIC, 4);
+  trace->window[4] = TRACE_VERSION;
+  trace->window[5] = 0;
+  trace->window[6] = sizeof(TRACE_RECORD);
+  trace->window[7] = 0;
+  trace->size = TRACE_HEADER_SIZE;
+  if (!CPU_setTracer(cpu, &trace->tracer)
+      || pthread_create(&trace->thread, NULL, TRACE_thread, trace) != 0) {
+    CPU_setTracer(cpu, NULL);
+    munmap(trace->window, TRACE_WINDOW_SIZE);
+    RING_free(&trace->ring);
+    close(trace->fd);
+    return false;
+  }
+  return true;
+}
+
+// Detaches from the cpu, writes out everything buffered and closes the
+// file. Call from the cpu's thread, or once it has stopped running.
+void TRACE_stop(TRACE* trace) {
+  CPU_setTracer(trace->cpu, NULL);
+  atomic_store(&trace->stopping, true);
+  pthread_join(trace->thread, NULL);
+  if (trace->window != NULL) {
+    munmap(trace->window, TRACE_WINDOW_SIZE);
+  }
+  if (ftruncate(trace->fd, trace->size) == -1) {
+    perror("trace");
+  }
+  close(trace->fd);
+  RING_free(&trace->ring);
+}
+
+/*
+   Disassembly, for the decoder. Mnemonics are the opcode names from
+   docs/cpu.md, registers are A B C D G H E SP, and pairs are named by
+   their low register.
+   */
+
+static const char* const TRACE_registers[8] = { "A", "B", "C", "D", "G", "H", "E", "SP" };
+static const char* const TRACE_flags[8] = { "C", "Z", "N", "O", "I", "BRK", "U2", "U" };
+
+// Writes the instruction `record` executed as text.
+void TRACE_disassemble(const TRACE_RECORD* record, char* text, size_t size) {
+  uint8_t kind = CPU_decodeTable[record->instruction];
+  uint8_t field = (record->instruction & 0x70) >> 4;
+  const char* name = CPU_handlerNames[kind];
+  const char* reg = TRACE_registers[field];
+  uint16_t operand = record->operand;
+  switch (kind) {
+    case H_INVALID:
+      snprintf(text, size, "?? 0x%02X", record->instruction);
+      break;
+    case H_SWAP:
+      snprintf(text, size, "SWAP %s, %s", TRACE_registers[(operand >> 4) & 7],
+          TRACE_registers[operand & 7]);
+      break;
+    case H_JMP:
+    case H_JMP_I:
+      if ((field & 3) == 3) {
+        snprintf(text, size, "JMP 0x%04X%s", operand, field & 4 ? " call" : "");
+      } else {
+        snprintf(text, size, "JMP %s%s%s", TRACE_registers[(field & 3) * 2],
+            TRACE_registers[(field & 3) * 2 + 1], field & 4 ? " call" : "");
+      }
+      break;
+    case H_CLF:
+    case H_SEF:
+      snprintf(text, size, "%s %s", name, TRACE_flags[field]);
+      break;
+    case H_BRCH:
+      snprintf(text, size, "BRCH %s%s, 0x%04X", field & 1 ? "N" : "",
+          TRACE_flags[field / 2], operand);
+      break;
+    case H_LOAD_I:
+    case H_STORE_I:
+      snprintf(text, size, "%s %s, [0x%04X]", name, reg, operand);
+      break;
+    case H_LOAD_R:
+    case H_STORE_R:
+      snprintf(text, size, "%s %s, [%s%s%s]", name, reg, TRACE_registers[(operand & 3) * 2],
+          TRACE_registers[(operand & 3) * 2 + 1], operand & POST_INC ? "+" : "");
+      break;
+    case H_INC16:
+    case H_DEC16:
+      snprintf(text, size, "%s %s%s", name, TRACE_registers[(operand & 3) * 2],
+          TRACE_registers[(operand & 3) * 2 + 1]);
+      break;
+    case H_ADD16:
+    case H_CMP16:
+      snprintf(text, size, "%s %s%s, %s%s", name, TRACE_registers[((operand >> 4) & 3) * 2],
+          TRACE_registers[((operand >> 4) & 3) * 2 + 1], TRACE_registers[(operand & 3) * 2],
+          TRACE_registers[(operand & 3) * 2 + 1]);
+      break;
+    case H_SET:
+      snprintf(text, size, "SET %s, 0x%02X", reg, operand);
+      break;
+    case H_NOOP: case H_HALT: case H_DATA_IN: case H_DATA_OUT:
+    case H_CLEAR_INT: case H_RET: case H_RETI: case H_WAIT:
+    case H_MOVE: case H_FILL: case H_COMPARE:
+      snprintf(text, size, "%s", name);
+      break;
+    default:
+      snprintf(text, size, "%s %s", name, reg);
+      break;
+  }
+}
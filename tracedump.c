@@ -0,0 +1,101 @@
+#include <sys/stat.h>
+#include "cpu.c"
+#include "ring.c"
+#include "trace.c"
+
+/*
+   irx trace decoder
+   Prints a trace written by TRACE_start as one line per instruction:
+   sequence number, ip, instruction bytes, disassembly, the registers the
+   instruction changed, the flags after it, and the memory it touched.
+
+   usage: tracedump trace [first [count]]
+   */
+
+static void usage(void) {
+  fprintf(stderr, "usage: tracedump trace [first [count]]\n");
+  exit(1);
+}
+
+static void printRecord(uint64_t n, const TRACE_RECORD* record) {
+  char text[32];
+  TRACE_disassemble(record, text, sizeof(text));
+  uint8_t operands = CPU_handlerOperands[CPU_decodeTable[record->instruction]];
+  char bytes[9] = "";
+  snprintf(bytes, sizeof(bytes), "%02X", record->instruction);
+  if (operands > 0) {
+    snprintf(bytes + 2, sizeof(bytes) - 2, " %02X", record->operand & 0xFF);
+  }
+  if (operands > 1) {
+    snprintf(bytes + 5, sizeof(bytes) - 5, " %02X", record->operand >> 8);
+  }
+  printf("%10llu  %04X  %-8s  %-22s", (unsigned long long)n, record->ip, bytes, text);
+
+  int count = 0;
+  for (int r = 0; r < 8; r++) {
+    if (record->changed & (1 << r)) {
+      if (count < 6) {
+        printf(" %s=%02X", TRACE_registers[r], record->values[count]);
+      } else {
+        printf(" %s=?", TRACE_registers[r]);
+      }
+      count++;
+    }
+  }
+  printf("  F=");
+  for (int f = 3; f >= 0; f--) {
+    printf("%s", (record->f & (1 << f)) ? TRACE_flags[f] : "-");
+  }
+  if (record->access & TRACE_READ) {
+    printf("  R");
+  }
+  if (record->access & TRACE_WRITE) {
+    printf("  W");
+  }
+  if (record->access & (TRACE_READ | TRACE_WRITE)) {
+    printf(" %04X", record->address);
+  }
+  if (record->access & TRACE_INTERRUPT) {
+    printf("  (interrupt)");
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 4) {
+    usage();
+  }
+  uint64_t first = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+  uint64_t limit = argc > 3 ? strtoull(argv[3], NULL, 0) : UINT64_MAX;
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat info;
+  if (fd == -1 || fstat(fd, &info) == -1) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (info.st_size < TRACE_HEADER_SIZE) {
+    fprintf(stderr, "%s: not an irx trace\n", argv[1]);
+    return 1;
+  }
+  const uint8_t* file = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (memcmp(file, TRACE_MAGIC, 4) != 0 || file[4] != TRACE_VERSION
+      || file[6] != sizeof(TRACE_RECORD)) {
+    fprintf(stderr, "%s: not an irx trace, or from another version\n", argv[1]);
+    return 1;
+  }
+  CPU_buildDecodeTable();
+  uint64_t records = (info.st_size - TRACE_HEADER_SIZE) / sizeof(TRACE_RECORD);
+  for (uint64_t n = first; n < records && n - first < limit; n++) {
+    TRACE_RECORD record;
+    memcpy(&record, file + TRACE_HEADER_SIZE + n * sizeof(TRACE_RECORD), sizeof(record));
+    printRecord(n, &record);
+  }
+  munmap((void*)file, info.st_size);
+  return 0;
+}
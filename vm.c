@@ -1,36 +1,57 @@
 #include "cpu.c"
+#include "ring.c"
+#include "machine.c"
+#include "image.c"
+#include "trace.c"
 
 #define ROM_SIZE (16)
-#define MEMORY_SIZE (64 * 1024 - ROM_SIZE)
 
-uint8_t RAM[MEMORY_SIZE];
-uint8_t ROM[ROM_SIZE];
-
-uint8_t accessMemory(enum DIRECTION dir, uint16_t addr, uint8_t value) {
-  if (dir == READ) {
-    if (addr < ROM_SIZE) {
-      return ROM[addr];
-    } else {
-      return RAM[addr - ROM_SIZE];
+int main(int argc, char *argv[]) {
+  MACHINE* machine = calloc(1, sizeof(MACHINE));
+  CPU* cpu = &machine->cpu;
+  const char* path = NULL;
+  const char* profilePath = NULL;
+  const char* tracePath = NULL;
+  for (int n = 1; n < argc; n++) {
+    if (strcmp(argv[n], "-p") == 0 && n + 1 < argc) {
+      profilePath = argv[++n];
+    } else if (strcmp(argv[n], "-T") == 0 && n + 1 < argc) {
+      tracePath = argv[++n];
+    } else if (argv[n][0] != '-') {
+      path = argv[n];
     }
-  } else {
-    if (addr >= ROM_SIZE) {
-      RAM[addr - ROM_SIZE] = value;
+  }
+  // An image maps its own ROM.
+  MACHINE_init(machine, path != NULL ? 0 : ROM_SIZE);
+  IMAGE image = { 0 };
+  if (path != NULL && !IMAGE_open(&image, path)) {
+    return 1;
+  }
+  for (int n = 1; n < argc; n++) {
+    if (strcmp(argv[n], "-t") == 0) {
+      CPU_setCore(cpu, CORE_THREADED);
+    } else if (strcmp(argv[n], "-j") == 0) {
+      CPU_setCore(cpu, CORE_JIT);
+    } else if (strcmp(argv[n], "-l") == 0) {
+      // JIT in lockstep with the interpreter
+      CPU_setCore(cpu, CORE_JIT);
+      JIT_setLockstep(cpu, true);
     }
   }
-  return 0;
-}
-
-void CPU_run(CPU* cpu) {
-  while (cpu->running) {
-    CPU_step(cpu);
+  // -p file: write a profile, as JSON if the name ends in .json, else CSV.
+  if (profilePath != NULL && !CPU_enableProfile(cpu)) {
+    fprintf(stderr, "vm: profiling needs a build with -DCPU_PROFILE (make vmprof)\n");
+    return 1;
+  }
+  // -T file: trace every instruction, for tracedump.
+  TRACE trace;
+  if (tracePath != NULL && !CPU_TRACING) {
+    fprintf(stderr, "vm: tracing needs a build with -DCPU_TRACE (make vmtrace)\n");
+    return 1;
+  }
+  if (tracePath != NULL && !TRACE_start(&trace, cpu, tracePath)) {
+    return 1;
   }
-}
-
-int main(int argc, char *argv[]) {
-  CPU cpu;
-  CPU_init(&cpu);
-  CPU_registerMemCallback(&cpu, accessMemory);
 
   uint8_t program[] = {
     // Little-endian execution start address.
@@ -45,9 +66,29 @@ int main(int argc, char *argv[]) {
     OP(SYS, HALT)
   };
 
-  memcpy(ROM, &program, sizeof(program));
-  CPU_prime(&cpu);
-  CPU_run(&cpu);
-  CPU_dump(&cpu);
+  if (path != NULL) {
+    IMAGE_load(&image, machine);
+  } else {
+    MACHINE_load(machine, program, sizeof(program));
+  }
+  CPU_run(cpu);
+  if (tracePath != NULL) {
+    TRACE_stop(&trace);
+  }
+  CPU_dump(cpu);
+  if (profilePath != NULL) {
+    size_t length = strlen(profilePath);
+    bool json = length >= 5 && strcmp(profilePath + length - 5, ".json") == 0;
+    FILE* out = fopen(profilePath, "w");
+    if (out == NULL) {
+      perror(profilePath);
+    } else {
+      CPU_dumpProfile(cpu, out, json ? PROFILE_JSON : PROFILE_CSV);
+      fclose(out);
+    }
+  }
+  MACHINE_free(machine);
+  IMAGE_close(&image);
+  free(machine);
   return 0;
 }